@@ -118,6 +118,18 @@ SOURCE=..\lz.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\thread.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\simdrive.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\telemetry.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\read.c
 # End Source File
 # End Group
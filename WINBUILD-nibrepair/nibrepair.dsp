@@ -106,6 +106,14 @@ SOURCE=..\lz.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\thread.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\telemetry.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\nibrepair.c
 # End Source File
 # Begin Source File
@@ -110,6 +110,14 @@ SOURCE=..\lz.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\thread.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\telemetry.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\prot.c
 # End Source File
 # End Group
@@ -110,6 +110,18 @@ SOURCE=..\lz.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\thread.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\simdrive.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\telemetry.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\nibwrite.c
 # End Source File
 # Begin Source File
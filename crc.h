@@ -69,6 +69,9 @@ typedef unsigned int crc;
 void  crcInit(void);
 crc   crcSlow(unsigned char const message[], int nBytes);
 crc   crcFast(unsigned char const message[], int nBytes);
+crc   crcStart(void);
+crc   crcUpdate(crc remainder, unsigned char const message[], int nBytes);
+crc   crcFinish(crc remainder);
 
 
 #endif /* _crc_h */
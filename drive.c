@@ -20,6 +20,7 @@ unsigned int floppybytes;
 extern CBM_FILE fd;
 extern int use_floppycode_srq;
 extern int extended_parallel_test;
+drive_transport *transport = NULL;
 
 #ifdef OPENCBM_42
 int
@@ -50,6 +51,8 @@ cbm_parallel_burst_write_n(CBM_FILE f, unsigned char *Buffer, unsigned int Lengt
 unsigned char
 burst_read(CBM_FILE f)
 {
+	if(transport)
+		return transport->read();
 #if !defined (DJGPP) && !defined (OPENCBM_42)
 	if(use_floppycode_srq)
 		return cbm_srq_burst_read(f);
@@ -60,6 +63,11 @@ burst_read(CBM_FILE f)
 void
 burst_write(CBM_FILE f, unsigned char c)
 {
+	if(transport)
+	{
+		transport->write(c);
+		return;
+	}
 #if !defined (DJGPP) && !defined (OPENCBM_42)
 	if(use_floppycode_srq)
 		cbm_srq_burst_write(f, c);
@@ -70,6 +78,8 @@ burst_write(CBM_FILE f, unsigned char c)
 int
 burst_read_n(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
 {
+	if(transport)
+		return transport->read_n(Buffer, Length);
 #if !defined (DJGPP) && !defined (OPENCBM_42)
 	if(use_floppycode_srq)
 		return cbm_srq_burst_read_n(f, Buffer, Length);
@@ -80,6 +90,8 @@ burst_read_n(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
 int
 burst_write_n(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
 {
+	if(transport)
+		return transport->write_n(Buffer, Length);
 #if !defined (DJGPP) && !defined (OPENCBM_42)
 	if(use_floppycode_srq)
 		return cbm_srq_burst_write_n(f, Buffer, Length);
@@ -90,6 +102,8 @@ burst_write_n(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
 int
 burst_read_track(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
 {
+	if(transport)
+		return transport->read_track(Buffer, Length);
 #if !defined (DJGPP) && !defined (OPENCBM_42)
 	if(use_floppycode_srq)
 		return cbm_srq_burst_read_track(f, Buffer, Length);
@@ -100,6 +114,8 @@ burst_read_track(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
 int
 burst_write_track(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
 {
+	if(transport)
+		return transport->write_track(Buffer, Length);
 #if !defined (DJGPP) && !defined (OPENCBM_42)
 	if(use_floppycode_srq)
 		return cbm_srq_burst_write_track(f, Buffer, Length);
@@ -124,10 +140,13 @@ handle_exit(void)
 	send_mnib_cmd(fd, FL_RESET, NULL, 0);
 	delay(50);
 	printf("Resetting drive...\n");
-	cbm_reset(fd);
+	if(!transport)
+	{
+		cbm_reset(fd);
 #ifndef DJGPP
-	cbm_driver_close(fd);
+		cbm_driver_close(fd);
 #endif
+	}
 	printf("Cleaning up...\n");
 }
 
@@ -212,7 +231,10 @@ upload_code(CBM_FILE fd, BYTE drive)
     }
 
 	printf("Uploading floppy-side code ($%.4x bytes, $300-$%.3x)...", databytes, databytes+0x300);
-	ret = cbm_upload(fd, drive, 0x300, floppy_code, databytes);
+	if(transport)
+		ret = transport->upload(floppy_code, databytes);
+	else
+		ret = cbm_upload(fd, drive, 0x300, floppy_code, databytes);
 	if (ret < 0) return ret;
 	floppybytes = databytes;
 	printf("done.\n");
@@ -337,12 +359,17 @@ init_floppy(CBM_FILE fd, BYTE drive, int bump)
 	char cmd[80];
 	char error[500];
 
-	/* prepare error string $73: CBM DOS V2.6 1541 */
-	sprintf(cmd, "M-W%c%c%c%c%c%c%c%c", 0, 3, 5, 0xa9, 0x73, 0x4c, 0xc1, 0xe6);
-	cbm_exec_command(fd, drive, cmd, 11);
-	sprintf(cmd, "M-E%c%c", 0x00, 0x03);
-	cbm_exec_command(fd, drive, cmd, 5);
-	cbm_device_status(fd, drive, error, sizeof(error));
+	if(transport)
+		transport->status(error, sizeof(error));
+	else
+	{
+		/* prepare error string $73: CBM DOS V2.6 1541 */
+		sprintf(cmd, "M-W%c%c%c%c%c%c%c%c", 0, 3, 5, 0xa9, 0x73, 0x4c, 0xc1, 0xe6);
+		cbm_exec_command(fd, drive, cmd, 11);
+		sprintf(cmd, "M-E%c%c", 0x00, 0x03);
+		cbm_exec_command(fd, drive, cmd, 5);
+		cbm_device_status(fd, drive, error, sizeof(error));
+	}
 	printf("Drive Version: %s\n", error);
 	if(fplog) fprintf(fplog,"Drive Version: %s\n", error);
 
@@ -369,7 +396,8 @@ init_floppy(CBM_FILE fd, BYTE drive, int bump)
 
 	delay(1000);
 
-	if (bump) perform_bump(fd,drive);
+	/* a virtual drive has no DOS to run the bump */
+	if ((bump) && (!transport)) perform_bump(fd,drive);
 
 	/*
 	 * Initialize media and switch drive to 1541 mode.
@@ -379,10 +407,11 @@ init_floppy(CBM_FILE fd, BYTE drive, int bump)
 
 	printf("Initializing\n");
 
-	if(drivetype == 1571)
+	if((drivetype == 1571) && (!transport))
 		cbm_exec_command(fd, drive, "U0>M0", 0);
 
-	cbm_exec_command(fd, drive, "I0", 0);  /* test - this hangs on a completely non-CBM disk */
+	if(!transport)
+		cbm_exec_command(fd, drive, "I0", 0);  /* test - this hangs on a completely non-CBM disk */
 
 	if (upload_code(fd, drive) < 0)
 	{
@@ -393,7 +422,8 @@ init_floppy(CBM_FILE fd, BYTE drive, int bump)
 	/* Begin executing drive code at $300 */
 	printf("Starting custom drive code...");
 	sprintf(cmd, "M-E%c%c", 0x00, 0x03);
-	cbm_exec_command(fd, drive, cmd, 5);
+	if(!transport)
+		cbm_exec_command(fd, drive, cmd, 5);
 	burst_read(fd);
 	printf("Started!\n");
 
@@ -12,12 +12,22 @@
 #include <ctype.h>
 #include <signal.h>
 
+#if !defined(WIN32) && !defined(_WIN32) && !defined(DJGPP)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#define HAVE_MMAP
+#endif
+
 #include "mnibarch.h"
 #include "gcr.h"
 #include "nibtools.h"
 #include "prot.h"
 #include "crc.h"
 #include "md5.h"
+#include "lz.h"
+#include "thread.h"
 //#include "bitshifter.c"
 
 void parseargs(char *argv[])
@@ -43,6 +53,13 @@ void parseargs(char *argv[])
 			}
 			break;
 
+		case 'J':
+			workers = atoi(&(*argv)[2]);
+			if(!workers) workers = cpu_count();
+			if(workers > MAX_WORKER_THREADS) workers = MAX_WORKER_THREADS;
+			printf("* Process tracks with %d threads\n", workers);
+			break;
+
 		case 'B':
 			backwards = 1;
 			printf("* Write tracks backwards\n");
@@ -391,10 +408,46 @@ void switchusage(void)
  	" -r: Disable automatic sync reduction\n"
 	" -f: Disable automatic bad GCR simulation\n"
 	//" -b: Custom fillbyte (0,5,f,a=adaptive)\n"
+	" -J[n]: Process tracks with 'n' threads (default: all CPUs)\n"
 	" -v: Verbose (output more detailed info)\n");
 }
 
-int load_file(char *filename, BYTE *file_buffer)
+/* set up a processing context from the parsed options and default tables */
+void init_context(nib_context *ctx)
+{
+	ctx->verbose = verbose;
+	ctx->fix_gcr = fix_gcr;
+	ctx->gap_match_length = gap_match_length;
+	ctx->cap_min_ignore = cap_min_ignore;
+	ctx->fattrack = fattrack;
+	ctx->reduce_sync = reduce_sync;
+	ctx->increase_sync = increase_sync;
+	ctx->rpm_real = rpm_real;
+	ctx->workers = workers;
+	ctx->sync_align_buffer = sync_align_buffer;
+	ctx->fillbyte = fillbyte;
+
+	memcpy(ctx->capacity, capacity, sizeof(ctx->capacity));
+	memcpy(ctx->capacity_min, capacity_min, sizeof(ctx->capacity_min));
+	memcpy(ctx->capacity_max, capacity_max, sizeof(ctx->capacity_max));
+	memcpy(ctx->align_map, align_map, sizeof(ctx->align_map));
+	memcpy(ctx->reduce_map, reduce_map, sizeof(ctx->reduce_map));
+}
+
+static void put_dword(BYTE *p, DWORD value)
+{
+	p[0] = (BYTE) value;
+	p[1] = (BYTE) (value >> 8);
+	p[2] = (BYTE) (value >> 16);
+	p[3] = (BYTE) (value >> 24);
+}
+
+static DWORD get_dword(BYTE *p)
+{
+	return (DWORD) p[0] | ((DWORD) p[1] << 8) | ((DWORD) p[2] << 16) | ((DWORD) p[3] << 24);
+}
+
+int load_file(char *filename, BYTE *file_buffer, int file_buffer_size)
 {
 	int size;
 	FILE *fpin;
@@ -411,8 +464,16 @@ int load_file(char *filename, BYTE *file_buffer)
 	size = ftell(fpin);
 	rewind(fpin);
 
+	if ((size <= 0) || (size > file_buffer_size))
+	{
+		printf("File %s has an invalid size (%d bytes)\n", filename, size);
+		fclose(fpin);
+		return 0;
+	}
+
 	if (fread(file_buffer, size, 1, fpin) != 1) {
 			printf("unable to read file\n");
+			fclose(fpin);
 			return 0;
 	}
 
@@ -421,13 +482,162 @@ int load_file(char *filename, BYTE *file_buffer)
 	return size;
 }
 
+/*
+ * Maps a whole file read-only into memory, so tracks can be used right from
+ * the file and are only copied where they get changed.  Where files can't be
+ * mapped, the file is read into an allocated buffer instead.
+ */
+int map_file(char *filename, mapped_file *map)
+{
+	FILE *fpin;
+	long size;
+#if defined(WIN32) || defined(_WIN32)
+	HANDLE file, mapping;
+	DWORD high = 0;
+#elif defined(HAVE_MMAP)
+	struct stat st;
+	void *data;
+	int fd;
+#endif
+
+	memset(map, 0, sizeof(mapped_file));
+
+#if defined(WIN32) || defined(_WIN32)
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		printf("Couldn't open input file %s!\n", filename);
+		return 0;
+	}
+
+	map->size = GetFileSize(file, &high);
+	if ((map->size) && (map->size != INVALID_FILE_SIZE) && (!high))
+	{
+		/* the view keeps the file open */
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+		{
+			map->data = (BYTE *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+
+	if (map->data)
+	{
+		map->mapped = 1;
+		return 1;
+	}
+#elif defined(HAVE_MMAP)
+	if ((fd = open(filename, O_RDONLY)) < 0)
+	{
+		printf("Couldn't open input file %s!\n", filename);
+		return 0;
+	}
+
+	if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+	{
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			close(fd);
+			map->data = (BYTE *) data;
+			map->size = st.st_size;
+			map->mapped = 1;
+			return 1;
+		}
+	}
+	close(fd);
+#endif
+
+	if ((fpin = fopen(filename, "rb")) == NULL)
+	{
+		printf("Couldn't open input file %s!\n", filename);
+		return 0;
+	}
+
+	fseek(fpin, 0, SEEK_END);
+	size = ftell(fpin);
+	rewind(fpin);
+
+	if ((size <= 0) || ((map->data = (BYTE *) malloc(size)) == NULL))
+	{
+		printf("unable to read file\n");
+		fclose(fpin);
+		return 0;
+	}
+
+	if (fread(map->data, size, 1, fpin) != 1)
+	{
+		printf("unable to read file\n");
+		unmap_file(map);
+		fclose(fpin);
+		return 0;
+	}
+
+	fclose(fpin);
+	map->size = size;
+	return 1;
+}
+
+void unmap_file(mapped_file *map)
+{
+	if (!map->data)
+		return;
+
+#if defined(WIN32) || defined(_WIN32)
+	if (map->mapped)
+		UnmapViewOfFile(map->data);
+	else
+#elif defined(HAVE_MMAP)
+	if (map->mapped)
+		munmap(map->data, map->size);
+	else
+#endif
+		free(map->data);
+
+	map->data = NULL;
+	map->size = 0;
+}
+
+/* reads a NIB or NBZ file, NIB tracks are parsed right from the mapped file */
+int read_nib_file(nib_context *ctx, char *filename, BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	mapped_file map;
+	int size, result;
+
+	if (compare_extension(filename, "NBZ"))
+		printf("Uncompressing NBZ...\n");
+
+	printf("Loading \"%s\"...\n",filename);
+
+	if (!map_file(filename, &map))
+		return 0;
+
+	printf("Successfully loaded %d bytes\n", (int) map.size);
+
+	if (compare_extension(filename, "NBZ"))
+	{
+		size = unpack_nbz(ctx, map.data, (int) map.size, file_buffer, file_buffer_size);
+		unmap_file(&map);
+		if (!size)
+			return 0;
+
+		return read_nib(file_buffer, size, track_buffer, track_density, track_length);
+	}
+
+	result = read_nib(map.data, (int) map.size, track_buffer, track_density, track_length);
+	unmap_file(&map);
+	return result;
+}
+
 int read_nib(BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
 	int track, t_index=0, h_index=0;
 
 	printf("Parsing NIB data...\n");
 
-	if (memcmp(file_buffer, "MNIB-1541-RAW", 13) != 0)
+	if ((file_buffer_size < 0x100) || (memcmp(file_buffer, "MNIB-1541-RAW", 13) != 0))
 	{
 		printf("Not valid NIB data!\n");
 		return 0;
@@ -435,15 +645,25 @@ int read_nib(BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *
 	else
 		printf("NIB file version %d\n", file_buffer[13]);
 
-	while(file_buffer[0x10+h_index])
+	while((h_index < 0x100 - 0x10) && (file_buffer[0x10+h_index]))
 	{
 		track = file_buffer[0x10+h_index];
-		track_density[track] = (BYTE)(file_buffer[0x10 + h_index + 1]);
-		track_density[track] %= BM_MATCH;  	 /* discard unused BM_MATCH mark */
 
-		memcpy(track_buffer + (track * NIB_TRACK_LENGTH),
-			file_buffer + (t_index * NIB_TRACK_LENGTH) + 0x100,
-			NIB_TRACK_LENGTH);
+		if (0x100 + ((t_index + 1) * NIB_TRACK_LENGTH) > file_buffer_size)
+		{
+			printf("NIB data is truncated at track %d\n", track);
+			break;
+		}
+
+		if (track <= MAX_HALFTRACKS_1541 + 1)
+		{
+			track_density[track] = (BYTE)(file_buffer[0x10 + h_index + 1]);
+			track_density[track] %= BM_MATCH;  	 /* discard unused BM_MATCH mark */
+
+			memcpy(track_buffer + (track * NIB_TRACK_LENGTH),
+				file_buffer + (t_index * NIB_TRACK_LENGTH) + 0x100,
+				NIB_TRACK_LENGTH);
+		}
 
 		h_index+=2;
 		t_index++;
@@ -452,7 +672,7 @@ int read_nib(BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *
 	return 1;
 }
 
-int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, size_t cycle)
+int read_nb2(nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, size_t cycle)
 {
 	int track, pass_density, nibsize, temp_track_inc, numtracks;
 	int header_entry = 0;
@@ -507,7 +727,7 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 			printf("Cannot find directory sector.\n");
 			return 0;
 	}
-	if(verbose) printf("\ndiskid: %c%c\n", diskid[0], diskid[1]);
+	if(ctx->verbose) printf("\ndiskid: %c%c\n", diskid[0], diskid[1]);
 
 	rewind(fpin);
 	if (fread(header, sizeof(header), 1, fpin) != 1) {
@@ -525,12 +745,12 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 		best_err = 0;
 		best_len = 0;  /* unused for now */
 
-		if(verbose) printf("\n%4.1f:",(float) track / 2);
+		if(ctx->verbose) printf("\n%4.1f:",(float) track / 2);
 
 		/* contains 16 passes of track, four for each density */
 		for(pass_density = 0; pass_density < 4; pass_density ++)
 		{
-			if(verbose) printf(" (%d)", pass_density);
+			if(ctx->verbose) printf(" (%d)", pass_density);
 
 			for(pass = 0; pass <= 3; pass ++)
 			{
@@ -538,11 +758,11 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 				fread(nibdata, NIB_TRACK_LENGTH, 1, fpin);
 				if(pass>(cycle-1)) continue;
 
-				length = extract_GCR_track(tmpdata, nibdata,
+				length = extract_GCR_track(ctx, tmpdata, nibdata,
 					&dummy,
 					track/2,
-					capacity_min[track_density[track]&3],
-					capacity_max[track_density[track]&3]);
+					ctx->capacity_min[track_density[track]&3],
+					ctx->capacity_max[track_density[track]&3]);
 
 				errors = check_errors(tmpdata, length, track, diskid, errorstring);
 
@@ -568,15 +788,15 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 		}
 
 		/* output some specs */
-		if(verbose)
+		if(ctx->verbose)
 		{
 			printf(" (");
 			if(track_density[track] & BM_NO_SYNC) printf("NOSYNC!");
 			if(track_density[track] & BM_FF_TRACK) printf("KILLER!");
 
-			printf("%d:%d) (pass %d, %d errors) %.1d%%", track_density[track]&3, track_length[track],
-				best_pass+1, best_err,
-				((track_length[track] / capacity[track_density[track]&3]) * 100));
+			printf("%d:%d) (pass %d, %d errors) %.1d%%", track_density[track]&3, (int)track_length[track],
+				(int)best_pass+1, (int)best_err,
+				(int)((track_length[track] / ctx->capacity[track_density[track]&3]) * 100));
 		}
 	}
 	fclose(fpin);
@@ -584,42 +804,42 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 	return 1;
 }
 
-int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int read_g64(nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
 	int track, g64maxtrack, g64tracks, headersize;
 	int pointer=0;
-	BYTE header[0x7f0];
-	BYTE length_record[2];
-	FILE *fpin;
+	BYTE *header;
+	mapped_file map;
 
 	printf("Reading G64 file...\n");
 
-	if ((fpin = fopen(filename, "rb")) == NULL)
-	{
-		printf("Couldn't open input file %s!\n", filename);
+	if (!map_file(filename, &map))
 		return 0;
-	}
 
-	if (fread(header, sizeof(header), 1, fpin) != 1)
+	header = map.data;
+
+	if (map.size < 0x2ac)
 	{
 		printf("unable to read G64 header\n");
+		unmap_file(&map);
 		return 0;
 	}
 
 	if (memcmp(header, "GCR-1541", 8) != 0)
 	{
 		printf("input file %s isn't a G64 data file!\n", filename);
+		unmap_file(&map);
 		return 0;
 	}
 
-	if (memcmp(header+0x2ac, "EXT", 3) == 0)
+	if ((map.size >= 0x7f0) && (memcmp(header+0x2ac, "EXT", 3) == 0))
 	{
 		printf("\nExtended SPS G64 detected\n");
 		headersize=0x7f0;
-		if(!sync_align_buffer) sync_align_buffer=1;
+		if(!ctx->sync_align_buffer) ctx->sync_align_buffer=1;
 		else
 		{
-			sync_align_buffer=0;
+			ctx->sync_align_buffer=0;
 			printf("SPS file, but sync align was disabled by switch\n");
 		}
 	}
@@ -629,13 +849,6 @@ int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 	g64tracks = (char)header[0x9];
 	g64maxtrack = (BYTE)header[0xb] << 8 | (BYTE)header[0xa];
 	if(verbose) printf("\nTracks:%d\nSize:%d\n", g64tracks, g64maxtrack);
-	rewind(fpin);
-
-	if (fread(header, headersize, 1, fpin) != 1)
-	{
-		printf("unable to read G64 header\n");
-		return 0;
-	}
 
 	if(g64maxtrack>NIB_TRACK_LENGTH)
 	{
@@ -643,10 +856,14 @@ int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 			//return 0;
 	}
 
+	/* the header only has room for this many tracks */
+	if(g64tracks > MAX_HALFTRACKS_1541 + 1)
+		g64tracks = MAX_HALFTRACKS_1541 + 1;
+
 	for (track = 2; track <= g64tracks; track++, pointer += 4)
 	{
-		int pointer2 = *(int*)(header+0xc+pointer);
-		int tmpLength;
+		DWORD pointer2 = get_dword(header+0xc+pointer);
+		size_t tmpLength;
 
 		/* check to see if track exists in file, else skip it */
 		if(!pointer2)
@@ -658,22 +875,28 @@ int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 		/* get density from header */
 		track_density[track] = header[0x15c + pointer];
 
-		fseek(fpin, pointer2, SEEK_SET);
-		//printf("\nDEBUG: filepointer=%d\n",pointer2);
+		if((pointer2 < (DWORD) headersize) || (pointer2 > map.size - 2))
+		{
+			printf("Track %d is outside of the G64 file\n", track);
+			track_length[track]=0;
+			continue;
+		}
 
 		/* get length */
-		fread(length_record, 2, 1, fpin);
-		tmpLength = length_record[1] << 8 | length_record[0];
+		tmpLength = header[pointer2 + 1] << 8 | header[pointer2];
 
 		if(tmpLength>NIB_TRACK_LENGTH)
 		{
 			tmpLength = NIB_TRACK_LENGTH;
 			//printf(" skipping extra data");
 		}
+		if(tmpLength > map.size - pointer2 - 2)
+			tmpLength = map.size - pointer2 - 2;
+
 		track_length[track] = tmpLength;
 
 		/* get track from file */
-		fread(track_buffer + (track * NIB_TRACK_LENGTH), tmpLength, 1, fpin);
+		memcpy(track_buffer + (track * NIB_TRACK_LENGTH), header + pointer2 + 2, tmpLength);
 
 		/* output some specs */
 		if(verbose)
@@ -681,16 +904,16 @@ int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 			printf("%4.1f: ",(float) track/2);
 			if(track_density[track] & BM_NO_SYNC) printf("NOSYNC!");
 			if(track_density[track] & BM_FF_TRACK) printf("KILLER!");
-			printf("%d (density:%d)\n", track_length[track], track_density[track]);
+			printf("%d (density:%d)\n", (int)track_length[track], track_density[track]);
 		}
 	}
-	fclose(fpin);
+	unmap_file(&map);
 	//printf("Successfully loaded G64 file\n");
 	return 1;
 }
 
 
-int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int read_d64(nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
 	int track, sector, sector_ref;
 	BYTE buffer[256];
@@ -771,7 +994,7 @@ int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 			if(d64size/256 > cur_sector)
 				fread(buffer, 256, 1, fpin); // @@@SRT: check success
 			else
-				memset(buffer, fillbyte, sizeof(buffer));
+				memset(buffer, ctx->fillbyte, sizeof(buffer));
 
 			// convert to gcr
 			convert_sector_to_GCR(buffer, gcrdata + (sector * (SECTOR_SIZE + sector_gap_length[track])), track, sector, id, error);
@@ -788,28 +1011,28 @@ int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 		//track_length[track*2] = sector_map[track] * (SECTOR_SIZE + sector_gap_length[track]);
 
 		// handle track "stretch"
-		if(rpm_real)
+		if(ctx->rpm_real)
 		{
 			switch (track_density[track*2])
 			{
 				case 0:
-					capacity[speed_map[track]] = (size_t)(DENSITY0/rpm_real);
+					ctx->capacity[speed_map[track]] = (size_t)(DENSITY0/ctx->rpm_real);
 					break;
 				case 1:
-					capacity[speed_map[track]] = (size_t)(DENSITY1/rpm_real);
+					ctx->capacity[speed_map[track]] = (size_t)(DENSITY1/ctx->rpm_real);
 					break;
 				case 2:
-					capacity[speed_map[track]] = (size_t)(DENSITY2/rpm_real);
+					ctx->capacity[speed_map[track]] = (size_t)(DENSITY2/ctx->rpm_real);
 					break;
 				case 3:
-					capacity[speed_map[track]] = (size_t)(DENSITY3/rpm_real);
+					ctx->capacity[speed_map[track]] = (size_t)(DENSITY3/ctx->rpm_real);
 					break;
 			}
-			//printf("[%d] = %d\n",track_density[track*2],capacity[speed_map[track*2]]);
+			//printf("[%d] = %d\n",track_density[track*2],ctx->capacity[speed_map[track*2]]);
 		}
 
 		// use real/calculated track length
-		track_length[track*2] = capacity[speed_map[track]&3];
+		track_length[track*2] = ctx->capacity[speed_map[track]&3];
 
 		// render track
 		memcpy(track_buffer + (track * 2 * NIB_TRACK_LENGTH), gcrdata, track_length[track*2]);
@@ -890,6 +1113,261 @@ int write_nib(BYTE*file_buffer, BYTE *track_buffer, BYTE *track_density, size_t
 	return (sizeof(header) + (header_entry * NIB_TRACK_LENGTH));
 }
 
+/*
+ * Track store: keeps tracks of any length, each taking just the space it
+ * needs from a list of larger chunks.  Jobs can store tracks at the same time.
+ */
+struct track_chunk
+{
+	struct track_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+#define TRACK_CHUNK_SIZE (16 * NIB_TRACK_LENGTH)
+
+int init_store(track_store *store)
+{
+	memset(store, 0, sizeof(track_store));
+	return ((store->lock = create_lock()) != NULL);
+}
+
+/* copies a track into the store, returns where it is kept or NULL if out of memory */
+BYTE *store_track(track_store *store, int index, BYTE *data, size_t length)
+{
+	struct track_chunk *chunk;
+	BYTE *p = NULL;
+	size_t size;
+
+	if((index < 0) || (index > MAX_HALFTRACKS_1541 + 1))
+		return NULL;
+
+	enter_lock(store->lock);
+
+	chunk = store->chunks;
+	if((!chunk) || (chunk->size - chunk->used < length))
+	{
+		size = (length > TRACK_CHUNK_SIZE) ? length : TRACK_CHUNK_SIZE;
+		if((chunk = (struct track_chunk *) malloc(sizeof(struct track_chunk) + size)) != NULL)
+		{
+			chunk->next = store->chunks;
+			chunk->size = size;
+			chunk->used = 0;
+			store->chunks = chunk;
+		}
+	}
+
+	if(chunk)
+	{
+		p = (BYTE *) (chunk + 1) + chunk->used;
+		chunk->used += length;
+		store->data[index] = p;
+		store->length[index] = length;
+	}
+
+	leave_lock(store->lock);
+
+	if(p)
+		memcpy(p, data, length);
+	return p;
+}
+
+void free_store(track_store *store)
+{
+	struct track_chunk *chunk;
+
+	while((chunk = store->chunks) != NULL)
+	{
+		store->chunks = chunk->next;
+		free(chunk);
+	}
+
+	destroy_lock(store->lock);
+	memset(store, 0, sizeof(track_store));
+}
+
+/* NBZ v2 is made of independent tracks, they are (un)packed on the worker threads */
+typedef struct
+{
+	BYTE *nib;
+	BYTE *nbz;
+	BYTE *packed;
+	int size;
+	int *failed;
+} nbz_job;
+
+/* each track packs into its own NBZ_MAX_TRACK_SIZE part of packed, the LZ work buffer is on the heap */
+static void pack_nbz_track(void *arg, int job)
+{
+	nbz_job *nbz = (nbz_job *) arg;
+	BYTE *entry = nbz->nbz + NBZ_HEADER_SIZE + 0x100 + (job * NBZ_ENTRY_SIZE);
+	BYTE *track = nbz->nib + 0x100 + (job * NIB_TRACK_LENGTH);
+	int length;
+
+	length = LZ_CompressFast(track, nbz->packed + (job * NBZ_MAX_TRACK_SIZE), NIB_TRACK_LENGTH);
+	if(length < 0)
+	{
+		nbz->failed[job] = 1;
+		return;
+	}
+
+	put_dword(entry + 8, length);
+	put_dword(entry + 12, crcFast(track, NIB_TRACK_LENGTH));
+}
+
+/* compresses a NIB file image into NBZ v2, returns the NBZ size */
+int pack_nbz(nib_context *ctx, BYTE *file_buffer, int file_buffer_size, BYTE *compressed_buffer)
+{
+	nbz_job nbz;
+	BYTE *packed, *entry;
+	int tracks, i, size;
+	int failed[MAX_HALFTRACKS_1541 + 2];
+	DWORD length;
+
+	tracks = (file_buffer_size - 0x100) / NIB_TRACK_LENGTH;
+
+	if(!(packed = (BYTE *) malloc(tracks * NBZ_MAX_TRACK_SIZE)))
+	{
+		printf("Could not allocate compression buffer\n");
+		return 0;
+	}
+
+	memset(compressed_buffer, 0, NBZ_HEADER_SIZE);
+	memcpy(compressed_buffer, NBZ_MAGIC, strlen(NBZ_MAGIC));
+	compressed_buffer[13] = NBZ_VERSION;
+	compressed_buffer[14] = (BYTE) tracks;
+	memcpy(compressed_buffer + NBZ_HEADER_SIZE, file_buffer, 0x100);
+
+	for (i = 0; i < tracks; i++)
+	{
+		entry = compressed_buffer + NBZ_HEADER_SIZE + 0x100 + (i * NBZ_ENTRY_SIZE);
+		memset(entry, 0, NBZ_ENTRY_SIZE);
+		entry[0] = file_buffer[0x10 + (i * 2)];
+		entry[1] = file_buffer[0x10 + (i * 2) + 1];
+	}
+
+	nbz.nib = file_buffer;
+	nbz.nbz = compressed_buffer;
+	nbz.packed = packed;
+	nbz.size = file_buffer_size;
+	nbz.failed = failed;
+
+	memset(failed, 0, sizeof(failed));
+	run_jobs(pack_nbz_track, &nbz, tracks, ctx->workers);
+
+	for (i = 0; i < tracks; i++)
+	{
+		if(failed[i])
+		{
+			printf("Could not allocate compression buffer\n");
+			free(packed);
+			return 0;
+		}
+	}
+
+	/* tracks are stored in order behind the table */
+	size = NBZ_HEADER_SIZE + 0x100 + (tracks * NBZ_ENTRY_SIZE);
+	for (i = 0; i < tracks; i++)
+	{
+		entry = compressed_buffer + NBZ_HEADER_SIZE + 0x100 + (i * NBZ_ENTRY_SIZE);
+		length = get_dword(entry + 8);
+		put_dword(entry + 4, size);
+		memcpy(compressed_buffer + size, packed + (i * NBZ_MAX_TRACK_SIZE), length);
+		size += length;
+	}
+
+	free(packed);
+	return size;
+}
+
+static int unpack_nbz_block(BYTE *block, DWORD length, DWORD crc, BYTE *track_data)
+{
+	if(length > NBZ_MAX_TRACK_SIZE)
+		return 0;
+
+	if(LZ_Uncompress(block, track_data, length, NIB_TRACK_LENGTH) != NIB_TRACK_LENGTH)
+		return 0;
+
+	return (crcFast(track_data, NIB_TRACK_LENGTH) == crc);
+}
+
+/* unpacks one track of an NBZ v2 image, returns 0 if it is damaged */
+int unpack_nbz_track(BYTE *compressed_buffer, int size, int index, BYTE *track_data)
+{
+	BYTE *entry = compressed_buffer + NBZ_HEADER_SIZE + 0x100 + (index * NBZ_ENTRY_SIZE);
+	DWORD offset, length;
+
+	offset = get_dword(entry + 4);
+	length = get_dword(entry + 8);
+
+	if((offset > (DWORD) size) || (length > (DWORD) size - offset))
+		return 0;
+
+	return unpack_nbz_block(compressed_buffer + offset, length, get_dword(entry + 12), track_data);
+}
+
+static void unpack_nbz_job(void *arg, int job)
+{
+	nbz_job *nbz = (nbz_job *) arg;
+
+	if(!unpack_nbz_track(nbz->nbz, nbz->size, job, nbz->nib + 0x100 + (job * NIB_TRACK_LENGTH)))
+		nbz->failed[job] = 1;
+}
+
+/* uncompresses an NBZ file image of either version into NIB, returns the NIB size */
+int unpack_nbz(nib_context *ctx, BYTE *compressed_buffer, int compressed_size, BYTE *file_buffer, int file_buffer_size)
+{
+	nbz_job nbz;
+	int failed[MAX_HALFTRACKS_1541 + 2];
+	int tracks, i, size;
+
+	/* version 1 is a single LZ stream of the whole NIB file */
+	if((compressed_size < NBZ_HEADER_SIZE) || (memcmp(compressed_buffer, NBZ_MAGIC, strlen(NBZ_MAGIC)) != 0))
+	{
+		size = LZ_Uncompress(compressed_buffer, file_buffer, compressed_size, file_buffer_size);
+		if(size < 0)
+		{
+			printf("NBZ data is damaged (error %d)\n", size);
+			return 0;
+		}
+		return size;
+	}
+
+	tracks = compressed_buffer[14];
+	if( (compressed_buffer[13] != NBZ_VERSION) || (tracks > MAX_HALFTRACKS_1541 + 2) ||
+		(compressed_size < NBZ_HEADER_SIZE + 0x100 + (tracks * NBZ_ENTRY_SIZE)) )
+	{
+		printf("Unsupported NBZ version %d\n", compressed_buffer[13]);
+		return 0;
+	}
+
+	if(0x100 + (tracks * NIB_TRACK_LENGTH) > file_buffer_size)
+	{
+		printf("NBZ image has too many tracks (%d)\n", tracks);
+		return 0;
+	}
+
+	memcpy(file_buffer, compressed_buffer + NBZ_HEADER_SIZE, 0x100);
+	memset(failed, 0, sizeof(failed));
+
+	nbz.nib = file_buffer;
+	nbz.nbz = compressed_buffer;
+	nbz.size = compressed_size;
+	nbz.failed = failed;
+
+	run_jobs(unpack_nbz_job, &nbz, tracks, ctx->workers);
+
+	for (i = 0; i < tracks; i++)
+	{
+		if(failed[i])
+		{
+			printf("NBZ track %d is damaged\n", compressed_buffer[NBZ_HEADER_SIZE + 0x100 + (i * NBZ_ENTRY_SIZE)]);
+			return 0;
+		}
+	}
+
+	return 0x100 + (tracks * NIB_TRACK_LENGTH);
+}
 
 int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
@@ -911,6 +1389,7 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	BYTE d64data[MAXBLOCKSONDISK * 256], *d64ptr;
 	BYTE errorinfo[MAXBLOCKSONDISK], errorcode;
 	int blocks_to_save;
+	sector_index index;
 
 	printf("Writing D64 file...\n");
 
@@ -950,6 +1429,7 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 		cycle_start = track_buffer + ((track+(offset*2)) * NIB_TRACK_LENGTH);
 		cycle_stop = track_buffer + ((track+(offset*2)) * NIB_TRACK_LENGTH) + track_length[track+(offset*2)];
 		//printf("debug: start=%d, stop=%d\n",cycle_start,cycle_stop);
+		index_GCR_sectors(cycle_start, cycle_stop, track/2, &index);
 
 		if(verbose) printf("%.2d (%d):" ,track/2, capacity[speed_map[track/2]]);
 
@@ -964,7 +1444,7 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 			if(verbose) printf("%d", sector);
 
 			memset(rawdata, 0,sizeof(rawdata));
-			errorcode = convert_GCR_sector(cycle_start, cycle_stop, rawdata, track/2, sector, id);
+			errorcode = convert_indexed_sector(&index, rawdata, sector, id);
 			errorinfo[blockindex] = errorcode;	/* OK by default */
 
 			if (errorcode != SECTOR_OK)
@@ -1041,48 +1521,233 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 }
 
 
-int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+/* tracks can only be spread over threads when nothing prints while they run */
+static int parallel_tracks(nib_context *ctx)
 {
-	/* writes contents of buffers into G64 file, with header and density information */
-
-	/* when writing a G64 file, we don't care about the limitations of drive hardware
-		However, VICE (previous to version 2.2) ignored the G64 header and hardcodes 7928 as the largest
-		track size, and also requires it to be 84 tracks no matter if they're used or not.
-	*/
+	return ((ctx->workers > 1) && (!ctx->verbose));
+}
 
-	DWORD g64_max_tracklen = 0;
-	BYTE header[12];
-	DWORD gcr_track_p[MAX_HALFTRACKS_1541] = {0};
-	DWORD gcr_speed_p[MAX_HALFTRACKS_1541] = {0};
-	//BYTE gcr_track[g64_max_tracklen + 2];
-	BYTE gcr_track[NIB_TRACK_LENGTH + 2];
-	size_t track_len, badgcr;
-	//size_t skewbytes=0;
-	int index=0, track, added_sync=0, addsyncloops;
-	FILE * fpout;
-	BYTE buffer[NIB_TRACK_LENGTH];
-	size_t raw_track_size[4] = { 6250, 6666, 7142, 7692 };
-	//char errorstring[0x1000];
+/* the RapidLok handler reports on its own and keeps state between tracks and images */
+int rapidlok_aligned(nib_context *ctx)
+{
+	int track;
 
-	printf("Writing G64 file...\n");
-	printf("RPM set to %d\n",rpm_real);
+	for (track = 0; track <= MAX_TRACKS_1541; track++)
+		if (ctx->align_map[track] == ALIGN_RAPIDLOK)
+			return 1;
 
-	fpout = fopen(filename, "wb");
-	if (fpout == NULL)
-	{
-		printf("Cannot open G64 image %s.\n", filename);
-		return 0;
-	}
+	return 0;
+}
 
-	/* determine max track size (old VICE can't handle) */
-	if(!old_g64)
+/* one G64 track, worked out on its own before the image is written */
+typedef struct
+{
+	BYTE *data;
+	size_t length;
+	size_t too_long;
+	size_t capacity[4];
+	BYTE fillbyte;
+	int done;
+} g64_track;
+
+typedef struct
+{
+	nib_context *ctx;
+	BYTE *track_buffer;
+	BYTE *track_density;
+	size_t *track_length;
+	DWORD g64_max_tracklen;
+	g64_track *slots;
+	track_store *store;
+} g64_job;
+
+/* sets the capacity a track is squeezed into, as seen by the drive at the set RPM */
+static void g64_capacity(nib_context *ctx, int track, BYTE density, DWORD g64_max_tracklen)
+{
+	if(ctx->rpm_real)
+	{
+		//ctx->capacity[speed_map[track/2]] = raw_track_size[speed_map[track/2]];
+		switch (density)
+		{
+			case 0:
+				ctx->capacity[speed_map[track/2]] = (size_t)(DENSITY0/ctx->rpm_real);
+				break;
+			case 1:
+				ctx->capacity[speed_map[track/2]] = (size_t)(DENSITY1/ctx->rpm_real);
+				break;
+			case 2:
+				ctx->capacity[speed_map[track/2]] = (size_t)(DENSITY2/ctx->rpm_real);
+				break;
+			case 3:
+				ctx->capacity[speed_map[track/2]] = (size_t)(DENSITY3/ctx->rpm_real);
+			break;
+		}
+
+		//printf("\ntrack=%d density=%d rpmreal=%d speedmap=%d capacity:%d\n",track,DENSITY0,ctx->rpm_real,speed_map[track/2],ctx->capacity[speed_map[track/2]]);
+
+		if(ctx->capacity[speed_map[track/2]] > g64_max_tracklen)
+			ctx->capacity[speed_map[track/2]] = g64_max_tracklen;
+	}
+	else
+		ctx->capacity[speed_map[track/2]] = g64_max_tracklen;
+}
+
+/*
+ * Processes one halftrack into buffer and returns its length.
+ * Given a slot, messages that also show without -v are left in it for the
+ * caller, and a track that would switch on verbose output is not done.
+ */
+static size_t g64_halftrack(nib_context *ctx, int track, BYTE *buffer, BYTE *data, BYTE density,
+	size_t length, DWORD g64_max_tracklen, g64_track *slot)
+{
+	size_t track_len, badgcr, orglen;
+	int added_sync, addsyncloops;
+
+	ctx->fillbyte = data[length - 1];
+	memset(buffer, ctx->fillbyte, NIB_TRACK_LENGTH);
+
+	track_len = length;
+	//if(track_len>g64_max_tracklen) track_len=g64_max_tracklen;
+
+	if(!track_len) return 0;
+
+	memcpy(buffer, data, track_len);
+
+	/* user display */
+	if(ctx->verbose)
+	{
+		printf("\n%4.1f: (", (float)track/2);
+		printf("%d", density&3);
+		if ( (density&3) != speed_map[track/2]) printf("!");
+		printf(":%d) ", length);
+		if (density & BM_NO_SYNC) printf("NOSYNC ");
+		if (density & BM_FF_TRACK) printf("KILLER ");
+	}
+
+	/* process/compress GCR data */
+	if(ctx->increase_sync)
+	{
+		for(addsyncloops=0;addsyncloops<ctx->increase_sync;addsyncloops++)
+		{
+			added_sync = lengthen_sync(buffer, track_len, g64_max_tracklen);
+			track_len += added_sync;
+			if(ctx->verbose) printf("[+sync:%d]", added_sync);
+		}
+	}
+
+	badgcr = check_bad_gcr(ctx, buffer, track_len);
+	if(ctx->verbose>1) printf("(weak:%d)",badgcr);
+
+	g64_capacity(ctx, track, density, g64_max_tracklen);
+
+	if(ctx->rpm_real)
+	{
+		if(track_len > ctx->capacity[speed_map[track/2]])
+		{
+			orglen = track_len;
+			if(!slot) printf("\nTrack %d too long (%d) for %d RPM and will be processed!",track/2,track_len,ctx->rpm_real);
+			track_len = compress_halftrack(ctx, track, buffer, density, track_len);
+			if(!slot) printf(" (%d)", track_len);
+			else slot->too_long = orglen;
+		}
+		if(ctx->verbose) printf(" (%d)", track_len);
+	}
+	else
+	{
+		if(track_len > ctx->capacity[speed_map[track/2]])
+		{
+			if(slot)
+			{
+				slot->done = 0;
+				return 0;
+			}
+			printf("\nTrack %d too long for %d RPM and will be processed!",track/2,ctx->rpm_real);
+			ctx->verbose+=1;
+		}
+			track_len = compress_halftrack(ctx, track, buffer, density, track_len);
+	}
+	if(ctx->verbose>1) printf("(fill:$%.2x)",ctx->fillbyte);
+
+	return track_len;
+}
+
+/* each job starts from the capacities the tracks before it leave behind */
+static void g64_job_track(void *arg, int job)
+{
+	g64_job *g64 = (g64_job *) arg;
+	g64_track *slot = &g64->slots[job];
+	nib_context ctx = *g64->ctx;
+	BYTE buffer[NIB_TRACK_LENGTH];
+	int track = 2 + (job * track_inc);
+
+	memcpy(ctx.capacity, slot->capacity, sizeof(ctx.capacity));
+	slot->too_long = 0;
+	slot->done = 1;
+	slot->length = g64_halftrack(&ctx, track, buffer, g64->track_buffer + (track * NIB_TRACK_LENGTH),
+		g64->track_density[track], g64->track_length[track], g64->g64_max_tracklen, slot);
+
+	/* only keep as much as the track needs until it is written */
+	if((slot->length) && (!(slot->data = store_track(g64->store, track, buffer, slot->length))))
+		slot->done = 0;
+
+	memcpy(slot->capacity, ctx.capacity, sizeof(slot->capacity));
+	slot->fillbyte = ctx.fillbyte;
+}
+
+static void free_g64_slots(g64_track *slots, track_store *store)
+{
+	if(!slots)
+		return;
+
+	free(slots);
+	free_store(store);
+}
+
+int write_g64(nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	/* writes contents of buffers into G64 file, with header and density information */
+
+	/* when writing a G64 file, we don't care about the limitations of drive hardware
+		However, VICE (previous to version 2.2) ignored the G64 header and hardcodes 7928 as the largest
+		track size, and also requires it to be 84 tracks no matter if they're used or not.
+	*/
+
+	DWORD g64_max_tracklen = 0;
+	BYTE header[12];
+	DWORD gcr_track_p[MAX_HALFTRACKS_1541] = {0};
+	DWORD gcr_speed_p[MAX_HALFTRACKS_1541] = {0};
+	//BYTE gcr_track[g64_max_tracklen + 2];
+	BYTE gcr_track[NIB_TRACK_LENGTH + 2];
+	size_t track_len;
+	//size_t skewbytes=0;
+	int index=0, track, job, jobs;
+	FILE * fpout;
+	BYTE buffer[NIB_TRACK_LENGTH], *data;
+	g64_track *slots = NULL;
+	track_store store;
+	g64_job g64;
+	nib_context sim;
+	//char errorstring[0x1000];
+
+	printf("Writing G64 file...\n");
+	printf("RPM set to %d\n",ctx->rpm_real);
+
+	fpout = fopen(filename, "wb");
+	if (fpout == NULL)
+	{
+		printf("Cannot open G64 image %s.\n", filename);
+		return 0;
+	}
+
+	/* determine max track size (old VICE can't handle) */
+	if(!old_g64)
 	{
 		for (track= 0; track < MAX_HALFTRACKS_1541; track += track_inc)
 		{
 			if((track_length[track+2] != 8192) && (track_length[track+2] > g64_max_tracklen))
 			{
 				g64_max_tracklen = track_length[track+2];
-				if(verbose) printf("Longer Track %4.1f = %d\n",(float)(track+2)/2,g64_max_tracklen);
+				if(ctx->verbose) printf("Longer Track %4.1f = %d\n",(float)(track+2)/2,g64_max_tracklen);
 			}
 		}
 	}
@@ -1090,6 +1755,37 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 		g64_max_tracklen = 7928; // old hardcoded value
 	printf("G64 Track Length = %d", g64_max_tracklen);
 
+	/* process tracks on all threads first, the file is written in order below */
+	jobs = ((MAX_HALFTRACKS_1541 - 1) / track_inc) + 1;
+	if((parallel_tracks(ctx)) && (init_store(&store)))
+	{
+		if(!(slots = calloc(jobs, sizeof(g64_track))))
+			free_store(&store);
+	}
+
+	if(slots)
+	{
+		sim = *ctx;
+		for (job = 0; job < jobs; job++)
+		{
+			track = 2 + (job * track_inc);
+			memcpy(slots[job].capacity, sim.capacity, sizeof(sim.capacity));
+			if(track_length[track])
+				g64_capacity(&sim, track, track_density[track], g64_max_tracklen);
+		}
+
+		g64.ctx = ctx;
+		g64.track_buffer = track_buffer;
+		g64.track_density = track_density;
+		g64.track_length = track_length;
+		g64.g64_max_tracklen = g64_max_tracklen;
+		g64.slots = slots;
+		g64.store = &store;
+
+		init_GCR_tables();
+		run_jobs(g64_job_track, &g64, jobs, ctx->workers);
+	}
+
 	/* Create G64 header */
 	strcpy((char *) header, "GCR-1541");
 	header[8] = 0;	/* G64 version */
@@ -1101,6 +1797,7 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	if (fwrite(header, sizeof(header), 1, fpout) != 1)
 	{
 		printf("Cannot write G64 header.\n");
+		free_g64_slots(slots, &store);
 		return 0;
 	}
 
@@ -1118,96 +1815,46 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	if (write_dword(fpout, gcr_track_p, sizeof(gcr_track_p)) < 0)
 	{
 		printf("Cannot write track header.\n");
+		free_g64_slots(slots, &store);
 		return 0;
 	}
 
 	if (write_dword(fpout, gcr_speed_p, sizeof(gcr_speed_p)) < 0)
 	{
 		printf("Cannot write speed header.\n");
+		free_g64_slots(slots, &store);
 		return 0;
 	}
 
+	/* the space behind a short track is written out too, don't leave stack garbage in it */
+	memset(gcr_track, 0, sizeof(gcr_track));
+
 	/* shuffle raw GCR between formats */
-	for (track = 2; track <= MAX_HALFTRACKS_1541+1; track +=track_inc)
+	for (track = 2, job = 0; track <= MAX_HALFTRACKS_1541+1; track +=track_inc, job++)
 	{
-		fillbyte = track_buffer[(track * NIB_TRACK_LENGTH) + track_length[track] - 1];
-		memset(buffer, fillbyte, sizeof(buffer));
-
-		track_len = track_length[track];
-		//if(track_len>g64_max_tracklen) track_len=g64_max_tracklen;
-
-		if(!track_len) continue;
-
-		memcpy(buffer, track_buffer + (track * NIB_TRACK_LENGTH), track_len);
-
-		/* user display */
-		if(verbose)
+		if((slots) && (slots[job].done))
 		{
-			printf("\n%4.1f: (", (float)track/2);
-			printf("%d", track_density[track]&3);
-			if ( (track_density[track]&3) != speed_map[track/2]) printf("!");
-			printf(":%d) ", track_length[track]);
-			if (track_density[track] & BM_NO_SYNC) printf("NOSYNC ");
-			if (track_density[track] & BM_FF_TRACK) printf("KILLER ");
-		}
-
-		/* process/compress GCR data */
-		if(increase_sync)
-		{
-			for(addsyncloops=0;addsyncloops<increase_sync;addsyncloops++)
-			{
-				added_sync = lengthen_sync(buffer, track_len, g64_max_tracklen);
-				track_len += added_sync;
-				if(verbose) printf("[+sync:%d]", added_sync);
-			}
-		}
-
-		badgcr = check_bad_gcr(buffer, track_len);
-		if(verbose>1) printf("(weak:%d)",badgcr);
-
-		if(rpm_real)
-		{
-			//capacity[speed_map[track/2]] = raw_track_size[speed_map[track/2]];
-			switch (track_density[track])
-			{
-				case 0:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY0/rpm_real);
-					break;
-				case 1:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY1/rpm_real);
-					break;
-				case 2:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY2/rpm_real);
-					break;
-				case 3:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY3/rpm_real);
-				break;
-			}
-
-			//printf("\ntrack=%d density=%d rpmreal=%d speedmap=%d capacity:%d\n",track,DENSITY0,rpm_real,speed_map[track/2],capacity[speed_map[track/2]]);
-
-			if(capacity[speed_map[track/2]] > g64_max_tracklen)
-				capacity[speed_map[track/2]] = g64_max_tracklen;
-
-			if(track_len > capacity[speed_map[track/2]])
-			{
-				printf("\nTrack %d too long (%d) for %d RPM and will be processed!",track/2,track_len,rpm_real);
-				track_len = compress_halftrack(track, buffer, track_density[track], track_len);
-				printf(" (%d)", track_len);
-			}
-			if(verbose) printf(" (%d)", track_len);
+			ctx->fillbyte = slots[job].fillbyte;
+			memcpy(ctx->capacity, slots[job].capacity, sizeof(ctx->capacity));
+			if(slots[job].too_long)
+				printf("\nTrack %d too long (%d) for %d RPM and will be processed! (%d)",
+					track/2, slots[job].too_long, ctx->rpm_real, slots[job].length);
+
+			track_len = slots[job].length;
+			data = slots[job].data;
 		}
 		else
 		{
-			capacity[speed_map[track/2]] = g64_max_tracklen;
-			if(track_len > capacity[speed_map[track/2]])
-			{
-				printf("\nTrack %d too long for %d RPM and will be processed!",track/2,rpm_real);
-				verbose+=1;
-			}
-				track_len = compress_halftrack(track, buffer, track_density[track], track_len);
+			/* from the first track a worker left undone on, go on as if there were no workers */
+			free_g64_slots(slots, &store);
+			slots = NULL;
+
+			track_len = g64_halftrack(ctx, track, buffer, track_buffer + (track * NIB_TRACK_LENGTH),
+				track_density[track], track_length[track], g64_max_tracklen, NULL);
+			data = buffer;
 		}
-		if(verbose>1) printf("(fill:$%.2x)",fillbyte);
+
+		if(!track_len) continue;
 
 		gcr_track[0] = (BYTE) (track_len % 256);
 		gcr_track[1] = (BYTE) (track_len / 256);
@@ -1215,7 +1862,7 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 		/* apply skew, if specified */
 		//if(skew)
 		//{
-		//	skewbytes = skew * (capacity[track_density[track]&3] / 200);
+		//	skewbytes = skew * (ctx->capacity[track_density[track]&3] / 200);
 		//	if(skewbytes > track_len)
 		//		skewbytes = skewbytes - track_len;
 		//printf(" {skew=%d} ", skewbytes);
@@ -1223,20 +1870,22 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 		//memcpy(gcr_track+2, buffer+skewbytes, track_len-skewbytes);
 		//memcpy(gcr_track+2+track_len-skewbytes, buffer, skewbytes);
 
-		memcpy(gcr_track+2, buffer, track_len);
+		memcpy(gcr_track+2, data, track_len);
 
 		if (fwrite(gcr_track, (g64_max_tracklen + 2), 1, fpout) != 1)
 		{
 			printf("Cannot write track data.\n");
+			free_g64_slots(slots, &store);
 			return 0;
 		}
 	}
+	free_g64_slots(slots, &store);
 	fclose(fpout);
 	//printf("\nSuccessfully saved G64 file\n");
 	return 1;
 }
 
-size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_t length)
+size_t compress_halftrack(nib_context *ctx, int halftrack, BYTE *track_buffer, BYTE density, size_t length)
 {
 	size_t orglen;
 	BYTE gcrdata[NIB_TRACK_LENGTH];
@@ -1251,38 +1900,38 @@ size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_
 		/* If our track contains sync, we reduce to a minimum of 32 bits
 		   less is too short for some loaders including CBM, but only 10 bits are technically required */
 		orglen = length;
-		if ( (length > (capacity[density&3])) && (!(density & BM_NO_SYNC)) &&
-			(reduce_map[halftrack/2] & REDUCE_SYNC) )
+		if ( (length > (ctx->capacity[density&3])) && (!(density & BM_NO_SYNC)) &&
+			(ctx->reduce_map[halftrack/2] & REDUCE_SYNC) )
 		{
 			/* reduce sync marks within the track */
-			length = reduce_runs(gcrdata, length, capacity[density&3], reduce_sync, 0xff);
-			if(verbose) printf("[sync:-%d]", orglen - length);
+			length = reduce_runs(gcrdata, length, ctx->capacity[density&3], ctx->reduce_sync, 0xff);
+			if(ctx->verbose) printf("[sync:-%d]", orglen - length);
 		}
 
 		/* reduce bad GCR runs */
 		orglen = length;
-		if ( (length > (capacity[density&3])) &&
-			(reduce_map[halftrack/2] & REDUCE_BAD) )
+		if ( (length > (ctx->capacity[density&3])) &&
+			(ctx->reduce_map[halftrack/2] & REDUCE_BAD) )
 		{
-			length = reduce_runs(gcrdata, length, capacity[density&3], 0, 0x00);
-			if(verbose) printf("[badgcr:-%d]", orglen - length);
+			length = reduce_runs(gcrdata, length, ctx->capacity[density&3], 0, 0x00);
+			if(ctx->verbose) printf("[badgcr:-%d]", orglen - length);
 		}
 
 		/* reduce sector gaps -  they occur at the end of every sector and vary from 4-19 bytes, typically  */
 		orglen = length;
-		if ( (length > (capacity[density&3])) &&
-			(reduce_map[halftrack/2] & REDUCE_GAP) )
+		if ( (length > (ctx->capacity[density&3])) &&
+			(ctx->reduce_map[halftrack/2] & REDUCE_GAP) )
 		{
-			length = reduce_gaps(gcrdata, length, capacity[density & 3]);
-			if(verbose) printf("[gaps:-%d]", orglen - length);
+			length = reduce_gaps(gcrdata, length, ctx->capacity[density & 3]);
+			if(ctx->verbose) printf("[gaps:-%d]", orglen - length);
 		}
 
 		/* still not small enough, we have to truncate the end (reduce tail) */
 		orglen = length;
-		if (length > capacity[density&3])
+		if (length > ctx->capacity[density&3])
 		{
-			length = capacity[density&3];
-			if(verbose) printf("[trunc:-%d]", orglen - length);
+			length = ctx->capacity[density&3];
+			if(ctx->verbose) printf("[trunc:-%d]", orglen - length);
 		}
 	}
 
@@ -1298,10 +1947,12 @@ size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_
 	return length;
 }
 
-int sync_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+int sync_tracks(nib_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
 {
-	int track;
+	int track, confidence;
+	size_t bits, i;
 	BYTE temp_buffer[NIB_TRACK_LENGTH*2];
+	BYTE *data;
 	//BYTE *nibdata_aligned; // aligned track
 	//int aligned_len;       // aligned track length
 
@@ -1310,11 +1961,33 @@ int sync_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, B
 	{
 		if(track_length[track])
 		{
-			if(verbose) printf("\n%4.1f: (%d) ",(float) track/2, track_length[track]);
+			if(ctx->verbose) printf("\n%4.1f: (%d) ",(float) track/2, track_length[track]);
+
+			/* more than one revolution, try to find its length in bits */
+			if(track_length[track]==NIB_TRACK_LENGTH)
+			{
+				bits = find_track_period_bits(track_buffer+(track*NIB_TRACK_LENGTH), NIB_TRACK_LENGTH,
+					ctx->capacity_min[track_density[track]&3] - CAP_ALLOWANCE,
+					ctx->capacity_max[track_density[track]&3] + CAP_ALLOWANCE, &confidence);
+
+				if(confidence < BIT_PERIOD_CONFIDENCE) continue;
+
+				track_length[track] = (bits + 7) >> 3;
+				if(ctx->verbose) printf("{period:%d.%d,%d%%} ", (int) (bits >> 3), (int) (bits & 7), confidence);
 
-			if(track_length[track]==NIB_TRACK_LENGTH) continue;
+				/* sync_align() wraps the track on a byte boundary, so let the revolution
+				   start at its first sync and keep the partial last byte at its end */
+				if(bits & 7)
+				{
+					data = track_buffer+(track*NIB_TRACK_LENGTH);
+					for (i = 0; i < track_length[track]; i++)
+						if ((data[i] == 0xff) && (data[i+1] & 0x80)) break;
+					if ((i < track_length[track]) && (i + track_length[track] < NIB_TRACK_LENGTH))
+						memmove(data, data + i, NIB_TRACK_LENGTH - i);
+				}
+			}
 
-			check_bad_gcr(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
+			check_bad_gcr(ctx, track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
 
 			/* Pete's version */
 			if(!sync_align(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]))
@@ -1343,70 +2016,589 @@ int sync_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, B
 			/* end Arnd version */
 
 			/* re-extract/align data, since KF images are just index to index */
-			if(sync_align_buffer < 2)
+			if(ctx->sync_align_buffer < 2)
 			{
 				memcpy(temp_buffer, track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
 				memcpy(temp_buffer+track_length[track], track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
 
-				track_length[track] = extract_GCR_track(
+				track_length[track] = extract_GCR_track(ctx,
 					track_buffer + (track * NIB_TRACK_LENGTH),
 					temp_buffer,
 					&track_alignment[track],
 					track/2,
-					capacity_min[track_density[track]&3],
-					capacity_max[track_density[track]&3] );
+					ctx->capacity_min[track_density[track]&3],
+					ctx->capacity_max[track_density[track]&3] );
 			}
 		}
 	}
-	if(verbose) printf("\n");
+	if(ctx->verbose) printf("\n");
 	return 1;
 }
 
-int align_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+/* one image being worked on by a set of track jobs */
+typedef struct
+{
+	nib_context *ctx;
+	BYTE *track_buffer;
+	BYTE *track_density;
+	size_t *track_length;
+	BYTE *track_alignment;
+} track_job;
+
+/* aligns one halftrack, data holds the track as read on entry */
+static void align_track_data(nib_context *ctx, int track, BYTE *data, BYTE density, size_t *length, BYTE *alignment)
 {
-	int track;
 	BYTE nibdata[NIB_TRACK_LENGTH];
 
-	memset(nibdata, 0, sizeof(nibdata));
+	memcpy(nibdata, data, NIB_TRACK_LENGTH);
+	memset(data, 0x00, NIB_TRACK_LENGTH);
+
+	/* output some specs */
+	if(ctx->verbose)
+	{
+		printf("%4.1f: ",(float) track/2);
+		if(density & BM_NO_SYNC) printf("NOSYNC! ");
+		//if(density & BM_FF_TRACK) printf("KILLER! ");
+		printf("(D:%d) ", density&3);
+	}
+
+	/* process track cycle */
+	*length = extract_GCR_track(ctx,
+		data,
+		nibdata,
+		alignment,
+		track/2,
+		ctx->capacity_min[density&3],
+		ctx->capacity_max[density&3]
+	);
+
+	/* output some specs */
+	if(ctx->verbose)
+	{
+		printf("(L:%d) ", *length);
+		printf("[align=%s]",alignments[*alignment]);
+		printf("\n");
+	}
+}
+
+static void align_halftrack(track_job *job, int track)
+{
+	align_track_data(job->ctx, track, job->track_buffer + (track * NIB_TRACK_LENGTH),
+		job->track_density[track], &job->track_length[track], &job->track_alignment[track]);
+}
+
+/* both halftracks of a track share its align_map entry, so they run in order in one job */
+static void align_job(void *arg, int job)
+{
+	int track;
+
+	for (track = job * 2; track <= job * 2 + 1; track++)
+	{
+		if ((track >= 1) && (track <= 84))
+			align_halftrack((track_job *) arg, track);
+	}
+}
+
+int align_tracks(nib_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	int track;
+	track_job job;
+
+	job.ctx = ctx;
+	job.track_buffer = track_buffer;
+	job.track_density = track_density;
+	job.track_length = track_length;
+	job.track_alignment = track_alignment;
+
 	printf("Aligning tracks...\n");
 
+	if ((parallel_tracks(ctx)) && (!rapidlok_aligned(ctx)))
+	{
+		init_GCR_tables();
+		run_jobs(align_job, &job, (84 / 2) + 1, ctx->workers);
+		return 1;
+	}
+
 	//for (track = start_track; track <= end_track; track ++)
 	for (track = 1; track <= 84; track ++)
+		align_halftrack(&job, track);
+
+	return 1;
+}
+
+/*
+ * Opens a NIB, NBZ (v2) or G64 image to read single tracks with image_track().
+ * The file is mapped and only the track tables are read here, tracks are
+ * copied out when they are used.  Returns 0 if the image has to be
+ * loaded as a whole instead (other formats, NBZ v1, sync-aligned G64,
+ * RapidLok alignment which depends on the track order).
+ */
+int open_image(track_image *image, nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density,
+	size_t *track_length, BYTE *track_alignment)
+{
+	BYTE *header, *entry;
+	size_t size;
+	int track, i, tracks;
+
+	memset(image, 0, sizeof(track_image));
+	image->ctx = ctx;
+	image->track_buffer = track_buffer;
+	image->track_density = track_density;
+	image->track_length = track_length;
+	image->track_alignment = track_alignment;
+
+	if (compare_extension(filename, "NIB"))
+		image->type = IMAGE_NIB;
+	else if (compare_extension(filename, "NBZ"))
+		image->type = IMAGE_NBZ;
+	else if (compare_extension(filename, "G64"))
+		image->type = IMAGE_G64;
+	else
+		return 0;
+
+	if(rapidlok_aligned(ctx))
+		return 0;
+
+	if (!map_file(filename, &image->map))
+		return 0;
+
+	header = image->map.data;
+	size = image->map.size;
+
+	switch (image->type)
 	{
-		memcpy(nibdata, track_buffer+(track*NIB_TRACK_LENGTH), NIB_TRACK_LENGTH);
-		memset(track_buffer + (track * NIB_TRACK_LENGTH), 0x00, NIB_TRACK_LENGTH);
+		case IMAGE_NIB:
+			if((size < 0x100) || (memcmp(header, "MNIB-1541-RAW", 13) != 0))
+				break;
 
-		/* output some specs */
-		if(verbose)
+			for (i = 0; (i < (0x100 - 0x10) / 2) && (header[0x10 + (i * 2)]); i++)
+			{
+				track = header[0x10 + (i * 2)];
+
+				if((size_t) (0x100 + ((i + 1) * NIB_TRACK_LENGTH)) > size)
+				{
+					printf("NIB data is truncated at track %d\n", track);
+					break;
+				}
+
+				if(track > MAX_HALFTRACKS_1541 + 1) continue;
+
+				image->offset[track] = 0x100 + (i * NIB_TRACK_LENGTH);
+				image->density[track] = header[0x10 + (i * 2) + 1] % BM_MATCH;
+			}
+			printf("Opened NIB file \"%s\"\n", filename);
+			return 1;
+
+		case IMAGE_NBZ:
+			if((size < NBZ_HEADER_SIZE + 0x100) || (memcmp(header, NBZ_MAGIC, strlen(NBZ_MAGIC)) != 0) ||
+				(header[13] != NBZ_VERSION))
+				break;
+
+			tracks = header[14];
+			if(size < (size_t) (NBZ_HEADER_SIZE + 0x100 + (tracks * NBZ_ENTRY_SIZE)))
+				break;
+
+			for (i = 0; i < tracks; i++)
+			{
+				entry = header + NBZ_HEADER_SIZE + 0x100 + (i * NBZ_ENTRY_SIZE);
+				track = entry[0];
+				if(track > MAX_HALFTRACKS_1541 + 1) continue;
+
+				image->offset[track] = get_dword(entry + 4);
+				image->length[track] = get_dword(entry + 8);
+				image->crc[track] = get_dword(entry + 12);
+				image->density[track] = entry[1] % BM_MATCH;
+			}
+			printf("Opened NBZ file \"%s\"\n", filename);
+			return 1;
+
+		case IMAGE_G64:
+			/* SPS images need sync alignment of the whole image */
+			if((size < 0x2ac) || (memcmp(header, "GCR-1541", 8) != 0) ||
+				((size >= 0x7f0) && (memcmp(header+0x2ac, "EXT", 3) == 0)) || (ctx->sync_align_buffer))
+				break;
+
+			tracks = (char)header[0x9];
+			if(tracks > MAX_HALFTRACKS_1541 + 1) tracks = MAX_HALFTRACKS_1541 + 1;
+
+			for (track = 2; track <= tracks; track++)
+			{
+				image->offset[track] = get_dword(header + 0xc + ((track - 2) * 4));
+				image->density[track] = header[0x15c + ((track - 2) * 4)];
+
+				/* track exists in the image, but is empty */
+				if(!image->offset[track])
+					track_length[track] = 0;
+			}
+			printf("Opened G64 file \"%s\"\n", filename);
+			return 1;
+	}
+
+	unmap_file(&image->map);
+	return 0;
+}
+
+void close_image(track_image *image)
+{
+	unmap_file(&image->map);
+}
+
+/*
+ * Returns a halftrack of an open NIB or G64 image as it is in the file,
+ * without copying it.  The data is read-only, NULL if the track is not in
+ * the image (or is packed, NBZ).
+ */
+BYTE *track_view(track_image *image, int halftrack, size_t *length)
+{
+	BYTE *data = image->map.data;
+	DWORD offset;
+
+	if((halftrack < 0) || (halftrack > MAX_HALFTRACKS_1541 + 1) || (!image->offset[halftrack]))
+		return NULL;
+
+	offset = image->offset[halftrack];
+
+	switch (image->type)
+	{
+		case IMAGE_NIB:
+			if(offset + NIB_TRACK_LENGTH > image->map.size)
+				return NULL;
+
+			*length = NIB_TRACK_LENGTH;
+			return data + offset;
+
+		case IMAGE_G64:
+			if((offset < 0x2ac) || (offset + 2 > image->map.size))
+				return NULL;
+
+			*length = data[offset + 1] << 8 | data[offset];
+			if(*length > NIB_TRACK_LENGTH)
+				*length = NIB_TRACK_LENGTH;
+			if(*length > image->map.size - offset - 2)
+				*length = image->map.size - offset - 2;
+
+			return data + offset + 2;
+	}
+	return NULL;
+}
+
+/* copies a NIB or NBZ halftrack that is in the image to data, unpacking it if needed */
+static int image_nib_track(track_image *image, int track, BYTE *data)
+{
+	BYTE *view;
+	size_t length;
+
+	if(image->type == IMAGE_NBZ)
+	{
+		if( (image->offset[track] > image->map.size) ||
+			(image->length[track] > image->map.size - image->offset[track]) ||
+			(!unpack_nbz_block(image->map.data + image->offset[track], image->length[track], image->crc[track], data)) )
 		{
-			printf("%4.1f: ",(float) track/2);
-			if(track_density[track] & BM_NO_SYNC) printf("NOSYNC! ");
-			//if(track_density[track] & BM_FF_TRACK) printf("KILLER! ");
-			printf("(D:%d) ", track_density[track]&3);
+			printf("NBZ track %d is damaged\n", track);
+			return 0;
 		}
+		return 1;
+	}
 
-		/* process track cycle */
-		track_length[track] = extract_GCR_track(
-			track_buffer + (track * NIB_TRACK_LENGTH),
-			nibdata,
-			&track_alignment[track],
-			track/2,
-			capacity_min[track_density[track]&3],
-			capacity_max[track_density[track]&3]
-		);
+	if((view = track_view(image, track, &length)) == NULL)
+	{
+		printf("Cannot read track %d\n", track);
+		return 0;
+	}
 
-		/* output some specs */
-		if(verbose)
+	memcpy(data, view, length);
+	return 1;
+}
+
+/* copies a halftrack into the track buffer, where it can be changed */
+static int read_image_track(track_image *image, int track)
+{
+	BYTE *data = image->track_buffer + (track * NIB_TRACK_LENGTH);
+	BYTE *view;
+	size_t length;
+
+	image->loaded[track] = 1;
+
+	/* tracks not in the image are left as they are, like the whole image readers do */
+	if(!image->offset[track])
+		return 1;
+
+	image->track_density[track] = image->density[track];
+
+	if(image->type != IMAGE_G64)
+		return image_nib_track(image, track, data);
+
+	if((view = track_view(image, track, &length)) == NULL)
+	{
+		printf("Track %d is outside of the G64 file\n", track);
+		image->track_length[track] = 0;
+		return 1;
+	}
+
+	memcpy(data, view, length);
+	if(image->type == IMAGE_G64)
+		image->track_length[track] = length;
+
+	return 1;
+}
+
+/*
+ * Makes sure a halftrack of an open image is read and aligned.
+ * NIB data is aligned as align_tracks() does it, both halftracks of a track
+ * at once and in order, since they share the track's align_map entry.
+ */
+int image_track(track_image *image, int halftrack)
+{
+	nib_context *ctx = image->ctx;
+	track_job job;
+	int track;
+
+	if((halftrack < 0) || (halftrack > MAX_HALFTRACKS_1541 + 1))
+		return 0;
+
+	if(image->loaded[halftrack])
+		return 1;
+
+	if(image->type == IMAGE_G64)
+		return read_image_track(image, halftrack);
+
+	job.ctx = ctx;
+	job.track_buffer = image->track_buffer;
+	job.track_density = image->track_density;
+	job.track_length = image->track_length;
+	job.track_alignment = image->track_alignment;
+
+	for (track = halftrack & ~1; track <= (halftrack | 1); track++)
+	{
+		if(!read_image_track(image, track))
+			return 0;
+
+		if ((track >= 1) && (track <= 84))
+			align_halftrack(&job, track);
+	}
+
+	/* a fat track set by hand is copied over the two halftracks behind it, as search_fat_tracks() does */
+	if((ctx->fattrack) && (ctx->fattrack != 99))
+	{
+		for (track = halftrack & ~1; track <= (halftrack | 1); track++)
 		{
-			printf("(L:%d) ", track_length[track]);
-			printf("[align=%s]",alignments[track_alignment[track]]);
-			printf("\n");
+			if((track != ctx->fattrack + 1) && (track != ctx->fattrack + 2))
+				continue;
+
+			if(!image_track(image, ctx->fattrack))
+				return 0;
+
+			memcpy(image->track_buffer + (track * NIB_TRACK_LENGTH),
+				image->track_buffer + (ctx->fattrack * NIB_TRACK_LENGTH),
+				NIB_TRACK_LENGTH);
+
+			image->track_length[track] = image->track_length[ctx->fattrack];
+			image->track_density[track] = image->track_density[ctx->fattrack];
 		}
 	}
 	return 1;
 }
 
-int rig_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+/*
+ * Writes an open NIB or NBZ image as G64 one track at a time, the same as
+ * align_tracks(), search_fat_tracks() and write_g64() do with the whole image.
+ * Only the last two tracks are kept.  Every track is processed against the
+ * longest one, so a first pass aligns the tracks just to find their lengths.
+ */
+int stream_g64(nib_context *ctx, track_image *image, char *filename)
+{
+	nib_context first;
+	BYTE *window, *data;
+	BYTE buffer[NIB_TRACK_LENGTH];
+	BYTE gcr_track[NIB_TRACK_LENGTH + 2];
+	BYTE header[12];
+	BYTE track_density[MAX_HALFTRACKS_1541 + 2];
+	BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
+	BYTE fat_source[MAX_HALFTRACKS_1541 + 2];
+	size_t track_length[MAX_HALFTRACKS_1541 + 2];
+	DWORD gcr_track_p[MAX_HALFTRACKS_1541] = {0};
+	DWORD gcr_speed_p[MAX_HALFTRACKS_1541] = {0};
+	DWORD g64_max_tracklen = 0;
+	size_t track_len;
+	int pass, pair, track, source, numfats = 0, index = 0;
+	FILE *fpout = NULL;
+
+/* the window holds the last two tracks, by halftrack */
+#define WINDOW(t) (window + (((t) & 3) * NIB_TRACK_LENGTH))
+
+	if(!(window = malloc(4 * NIB_TRACK_LENGTH)))
+	{
+		printf("Could not allocate track window\n");
+		return 0;
+	}
+
+	memset(track_density, 0, sizeof(track_density));
+	memset(track_alignment, 0, sizeof(track_alignment));
+	memset(track_length, 0, sizeof(track_length));
+	memset(fat_source, 0, sizeof(fat_source));
+
+	printf("Aligning tracks...\n");
+	if((!ctx->fattrack) && (ctx->verbose)) printf("Searching for fat tracks...\n");
+
+	/* the first pass leaves the context as it is, alignment changes its align map */
+	first = *ctx;
+	first.verbose = 0;
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (pair = 0; pair <= MAX_HALFTRACKS_1541 / 2; pair++)
+		{
+			for (track = pair * 2; track <= (pair * 2) + 1; track++)
+			{
+				if ((track < 1) || (track > 84))
+					continue;
+
+				data = WINDOW(track);
+				memset(data, 0, NIB_TRACK_LENGTH);
+				if((image->offset[track]) && (!image_nib_track(image, track, data)))
+				{
+					free(window);
+					return 0;
+				}
+
+				track_density[track] = image->density[track];
+				align_track_data((pass) ? ctx : &first, track, data, track_density[track],
+					&track_length[track], &track_alignment[track]);
+			}
+
+			for (track = pair * 2; track <= (pair * 2) + 1; track++)
+			{
+				/* copy the fat track found or given */
+				if((source = fat_source[track]) != 0)
+				{
+					memcpy(WINDOW(track), WINDOW(source), NIB_TRACK_LENGTH);
+					track_length[track] = track_length[source];
+					track_density[track] = track_density[source];
+				}
+
+				if(!pass)
+				{
+					/* compare with the track below, as search_fat_tracks() does */
+					if((!ctx->fattrack) && (track >= 4) && (!(track & 1)) &&
+						(is_fat_track(ctx, track - 2, WINDOW(track - 2), track_length[track - 2],
+							WINDOW(track), track_length[track])))
+					{
+						if(!numfats)
+						{
+							ctx->fattrack = track - 2;
+							fat_source[track - 1] = track - 2;
+							track_length[track - 1] = track_length[track - 2];
+							track_density[track - 1] = track_density[track - 2];
+						}
+						else
+						{
+							printf("These are likely not fat tracks, just repeat data - Ignoring\n");
+							ctx->fattrack = 0;
+						}
+						numfats++;
+					}
+					continue;
+				}
+
+				if((track < 2) || ((track - 2) % track_inc) || (!track_length[track]))
+					continue;
+
+				track_len = g64_halftrack(ctx, track, buffer, WINDOW(track), track_density[track],
+					track_length[track], g64_max_tracklen, NULL);
+				if(!track_len) continue;
+
+				gcr_track[0] = (BYTE) (track_len % 256);
+				gcr_track[1] = (BYTE) (track_len / 256);
+				memcpy(gcr_track+2, buffer, track_len);
+
+				if (fwrite(gcr_track, (g64_max_tracklen + 2), 1, fpout) != 1)
+				{
+					printf("Cannot write track data.\n");
+					fclose(fpout);
+					free(window);
+					return 0;
+				}
+			}
+		}
+
+		if(pass)
+			break;
+
+		/* a fat track given by hand is copied over the two halftracks behind it */
+		if((ctx->fattrack) && (ctx->fattrack != 99))
+		{
+			printf("Handle FAT track on %d\n",ctx->fattrack/2);
+
+			for (track = ctx->fattrack + 1; (track <= ctx->fattrack + 2) && (track <= MAX_HALFTRACKS_1541 + 1); track++)
+			{
+				fat_source[track] = ctx->fattrack;
+				track_length[track] = track_length[ctx->fattrack];
+				track_density[track] = track_density[ctx->fattrack];
+			}
+		}
+
+		/* now the G64 layout is known, see write_g64() */
+		printf("Writing G64 file...\n");
+		printf("RPM set to %d\n",ctx->rpm_real);
+
+		fpout = fopen(filename, "wb");
+		if (fpout == NULL)
+		{
+			printf("Cannot open G64 image %s.\n", filename);
+			free(window);
+			return 0;
+		}
+
+		if(!old_g64)
+		{
+			for (track= 0; track < MAX_HALFTRACKS_1541; track += track_inc)
+			{
+				if((track_length[track+2] != 8192) && (track_length[track+2] > g64_max_tracklen))
+				{
+					g64_max_tracklen = track_length[track+2];
+					if(ctx->verbose) printf("Longer Track %4.1f = %d\n",(float)(track+2)/2,g64_max_tracklen);
+				}
+			}
+		}
+		else
+			g64_max_tracklen = 7928; // old hardcoded value
+		printf("G64 Track Length = %d", g64_max_tracklen);
+
+		strcpy((char *) header, "GCR-1541");
+		header[8] = 0;	/* G64 version */
+		header[9] = MAX_HALFTRACKS_1541; /* Number of Halftracks */
+		header[10] = (BYTE) (g64_max_tracklen % 256);	/* Size of each stored track */
+		header[11] = (BYTE) (g64_max_tracklen / 256);
+
+		for (track = 0; track < MAX_HALFTRACKS_1541; track +=track_inc)
+		{
+			if(!track_length[track+2]) continue;
+
+			gcr_track_p[track] = 0xc + (MAX_TRACKS_1541 * 16) + (index++ * (g64_max_tracklen + 2));
+			gcr_speed_p[track] = track_density[track+2]&3;
+		}
+
+		if ( (fwrite(header, sizeof(header), 1, fpout) != 1) ||
+			(write_dword(fpout, gcr_track_p, sizeof(gcr_track_p)) < 0) ||
+			(write_dword(fpout, gcr_speed_p, sizeof(gcr_speed_p)) < 0) )
+		{
+			printf("Cannot write G64 header.\n");
+			fclose(fpout);
+			free(window);
+			return 0;
+		}
+
+		/* as in write_g64(), the space behind a track keeps what was there */
+		memset(gcr_track, 0, sizeof(gcr_track));
+	}
+#undef WINDOW
+
+	free(window);
+	fclose(fpout);
+	return 1;
+}
+
+int rig_tracks(nib_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
 {
 	int track;
 
@@ -1416,11 +2608,11 @@ int rig_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BY
 	{
 		if(track_length[track]==0) continue;
 
-		if(track_length[track] < capacity[track_density[track]&3])
+		if(track_length[track] < ctx->capacity[track_density[track]&3])
 		{
-			memset(track_buffer + (track*NIB_TRACK_LENGTH) + track_length[track], 0x55, capacity[track_density[track]&3] - track_length[track]);
-			//printf("Padded %d bytes\n", capacity[track_density[track]&3]-track_length[track]);
-			track_length[track] = capacity[track_density[track]&3];
+			memset(track_buffer + (track*NIB_TRACK_LENGTH) + track_length[track], 0x55, ctx->capacity[track_density[track]&3] - track_length[track]);
+			//printf("Padded %d bytes\n", ctx->capacity[track_density[track]&3]-track_length[track]);
+			track_length[track] = ctx->capacity[track_density[track]&3];
 		}
 
 		memcpy(track_buffer + (track*NIB_TRACK_LENGTH) + track_length[track],
@@ -1473,60 +2665,42 @@ int write_dword(FILE *fd, DWORD * buf, int num)
 	return 0;
 }
 
-unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length)
+/* decode t18s0 and t18s1, which is what the BAM/DIR hashes cover */
+static void
+dir_sectors(BYTE *track_buffer, size_t *track_length, BYTE *id, unsigned char *data)
 {
-	/* this calculates a CRC32 for the BAM and first directory sector, which is sufficient to differentiate most disks */
-
-	unsigned char data[512];
-	unsigned int result;
-	BYTE id[3];
 	BYTE rawdata[260];
-	BYTE errorcode;
+	int sector;
 
-	crcInit();
-
-	/* get disk id */
-	if (!extract_id(track_buffer + (18 * 2 * NIB_TRACK_LENGTH), id))
+	for (sector = 0; sector < 2; sector++)
 	{
-		printf("Cannot find directory sector.\n");
-		return 0;
+		memset(rawdata, 0, sizeof(rawdata));
+		convert_GCR_sector(
+			track_buffer + ((18*2) * NIB_TRACK_LENGTH),
+			track_buffer + ((18*2) * NIB_TRACK_LENGTH) + track_length[18*2],
+			rawdata, 18, sector, id);
+		memcpy(data + (sector * 256), rawdata + 1, 256);
 	}
-
-	memset(data, 0, sizeof(data));
-
-	/* t18s0 */
-	memset(rawdata, 0, sizeof(rawdata));
-	errorcode = convert_GCR_sector(
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH),
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH) + track_length[18*2],
-		rawdata, 18, 0, id);
-	memcpy(data, rawdata+1 , 256);
-
-	/* t18s1 */
-	memset(rawdata, 0, sizeof(rawdata));
-	errorcode = convert_GCR_sector(
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH),
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH) + track_length[18*2],
-		rawdata, 18, 1, id);
-	memcpy(data+256, rawdata+1, 256);
-
-	result = crcFast(data, sizeof(data));
-	return result;
 }
 
-unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length)
+/*
+	Hash the whole disk in one pass: every sector is decoded once and fed to
+	the CRC32 and MD5 of the BAM/DIR sectors, of all sectors, and to its own
+	CRC32.  Sectors missing from a partial track range hash as zeros, so the
+	totals match a full 35 track disk image.
+*/
+int digest_disk(BYTE *track_buffer, size_t *track_length, disk_digest *digest)
 {
-	/* this calculates a CRC32 for all sectors on the disk */
-
-	unsigned char data[BLOCKSONDISK * 256];
-	unsigned int result;
-	int track, sector, index, valid;
+	unsigned char data[512];
+	crc dir_crc, all_crc;
+	md5_context dir_md5, all_md5;
+	int track, sector, index, dir_done;
 	BYTE id[3];
 	BYTE rawdata[260];
 	BYTE errorcode;
+	sector_index track_index;
 
-	memset(data, 0, sizeof(data));
-	crcInit();
+	memset(digest, 0, sizeof(disk_digest));
 
 	/* get disk id */
 	if (!extract_id(track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
@@ -1535,84 +2709,90 @@ unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length)
 		return 0;
 	}
 
-	index = valid = 0;
+	dir_crc = all_crc = crcStart();
+	md5_starts(&dir_md5);
+	md5_starts(&all_md5);
+
+	index = dir_done = 0;
 	for (track = start_track; track <= 35*2; track += 2)
 	{
-		for (sector = 0; sector < sector_map[track/2]; sector++)
+		index_GCR_sectors(
+			track_buffer + (track * NIB_TRACK_LENGTH),
+			track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
+			track/2, &track_index);
+
+		for (sector = 0; (sector < sector_map[track/2]) && (index < BLOCKSONDISK); sector++)
 		{
 			memset(rawdata, 0, sizeof(rawdata));
 
-			errorcode = convert_GCR_sector(
-				track_buffer + (track * NIB_TRACK_LENGTH),
-				track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-				rawdata, track/2, sector, id);
+			errorcode = convert_indexed_sector(&track_index, rawdata, sector, id);
 
-			memcpy(data+(index*256), rawdata+1, 256);
+			all_crc = crcUpdate(all_crc, rawdata + 1, 256);
+			md5_update(&all_md5, rawdata + 1, 256);
+			digest->sector_crc[index] = crcFast(rawdata + 1, 256);
+			digest->sector_error[index] = errorcode;
 			index++;
 
 			if(errorcode == SECTOR_OK)
-				valid++;
+				digest->valid++;
+
+			if ((track == 18*2) && (sector < 2))
+			{
+				dir_crc = crcUpdate(dir_crc, rawdata + 1, 256);
+				md5_update(&dir_md5, rawdata + 1, 256);
+				dir_done = (sector == 1);
+			}
 		}
 	}
+	digest->sectors = index;
 
-	if(index != valid)
-		if(verbose) printf("[%d/%d sectors] ", valid, index);
+	memset(data, 0, sizeof(data));
+	for (; index < BLOCKSONDISK; index++)
+	{
+		all_crc = crcUpdate(all_crc, data, 256);
+		md5_update(&all_md5, data, 256);
+	}
 
-	result = crcFast(data, sizeof(data));
-	return result;
+	/* track 18 was outside of the range */
+	if (!dir_done)
+	{
+		dir_sectors(track_buffer, track_length, id, data);
+		dir_crc = crcUpdate(crcStart(), data, sizeof(data));
+		md5_starts(&dir_md5);
+		md5_update(&dir_md5, data, sizeof(data));
+	}
+
+	digest->dir_crc = crcFinish(dir_crc);
+	digest->all_crc = crcFinish(all_crc);
+	md5_finish(&dir_md5, digest->dir_md5);
+	md5_finish(&all_md5, digest->all_md5);
+	return 1;
 }
 
-unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned char *result)
+unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length)
 {
-	/* this calculates a MD5 hash of the BAM and first directory sector, which is sufficient to differentiate most disks */
+	/* this calculates a CRC32 for the BAM and first directory sector, which is sufficient to differentiate most disks */
 
 	unsigned char data[512];
 	BYTE id[3];
-	BYTE rawdata[260];
-	BYTE errorcode;
-
-	crcInit();
-	memset(data, 0, sizeof(data));
 
 	/* get disk id */
-	if (!extract_id(track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
+	if (!extract_id(track_buffer + (18 * 2 * NIB_TRACK_LENGTH), id))
 	{
 		printf("Cannot find directory sector.\n");
 		return 0;
 	}
 
-	/* t18s0 */
-	memset(rawdata, 0, sizeof(rawdata));
-	errorcode = convert_GCR_sector(
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH),
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH) + track_length[18*2],
-		rawdata, 18, 0, id);
-	memcpy(data, rawdata+1 , 256);
-
-	/* t18s1 */
-	memset(rawdata, 0, sizeof(rawdata));
-	errorcode = convert_GCR_sector(
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH),
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH) + track_length[18*2],
-		rawdata, 18, 1, id);
-	memcpy(data+256, rawdata+1, 256);
-
-	md5(data, sizeof(data), result);
-	return 1;
+	dir_sectors(track_buffer, track_length, id, data);
+	return crcFast(data, sizeof(data));
 }
 
-unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned char *result)
+unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned char *result)
 {
-	/* this calculates an MD5 hash for all sectors on the disk */
+	/* this calculates a MD5 hash of the BAM and first directory sector, which is sufficient to differentiate most disks */
 
-	unsigned char data[BLOCKSONDISK * 256];
-	int track, sector, index, valid;
+	unsigned char data[512];
 	BYTE id[3];
-	BYTE rawdata[260];
-	BYTE errorcode;
-
-	crcInit();
-	memset(data, 0, sizeof(data));
 
 	/* get disk id */
 	if (!extract_id(track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
@@ -1621,29 +2801,7 @@ unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned c
 		return 0;
 	}
 
-	index = valid = 0;
-	for (track = start_track; track <= 35*2; track += 2)
-	{
-		for (sector = 0; sector < sector_map[track/2]; sector++)
-		{
-			memset(rawdata, 0, sizeof(rawdata));
-
-			errorcode = convert_GCR_sector(
-				track_buffer + (track * NIB_TRACK_LENGTH),
-				track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-				rawdata, track/2, sector, id);
-
-			memcpy(data+(index*256), rawdata+1, 256);
-			index++;
-
-			if(errorcode == SECTOR_OK)
-				valid++;
-		}
-	}
-
-	if(index != valid)
-		if(verbose) printf("[%d/%d sectors] ", valid, index);
-
+	dir_sectors(track_buffer, track_length, id, data);
 	md5(data, sizeof(data), result);
 	return 1;
 }
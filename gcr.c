@@ -108,6 +108,15 @@ static BYTE GCR_decode_low[32] = {
 	0xff, 0x09, 0x0a, 0x0b, 0xff, 0x0d, 0x0e, 0xff
 };
 
+/* Byte-to-GCR conversion table (10 bits per byte), built on first use */
+static unsigned short GCR_encode_8bit[256];
+static int GCR_encode_8bit_ready = 0;
+
+/* 10-bit GCR-to-byte table, built from the two above on first use.
+   Bit 8 flags an illegal high quintet, bit 9 an illegal low quintet. */
+static unsigned short GCR_decode_10bit[1024];
+static int GCR_decode_10bit_ready = 0;
+
 
 int
 find_sync(BYTE ** gcr_pptr, BYTE * gcr_end)
@@ -164,6 +173,126 @@ find_header(BYTE ** gcr_pptr, BYTE * gcr_end)
 	return (*gcr_pptr < gcr_end);
 }
 
+/*
+	Record every sync mark of a buffer in one pass, using the same test as
+	find_sync().  Each 0xff byte is located with memchr(), then the run is
+	followed to the first non-0xff byte.  Buffers may be up to
+	2*NIB_TRACK_LENGTH long.
+*/
+void
+index_syncs(BYTE * gcr_start, size_t length, sync_index * syncs)
+{
+	BYTE *ff;
+	size_t pos, after;
+
+	if (length > 2 * NIB_TRACK_LENGTH)
+		length = 2 * NIB_TRACK_LENGTH;
+
+	syncs->gcr_start = gcr_start;
+	syncs->length = length;
+	syncs->syncs = 0;
+	syncs->headers = 0;
+
+	for (pos = 1; pos < length; )
+	{
+		if ((ff = memchr(gcr_start + pos, 0xff, length - pos)) == NULL)
+			break;
+
+		pos = ff - gcr_start;
+
+		/* sync flag needs a bit set in front of the 0xff */
+		if ((gcr_start[pos - 1] & 0x01) != 0x01)
+		{
+			pos++;
+			continue;
+		}
+
+		for (after = pos + 1; after < length && gcr_start[after] == 0xff; after++);
+
+		syncs->start[syncs->syncs] = (unsigned short) (pos - 1);
+		syncs->after[syncs->syncs] = (unsigned short) after;
+
+		if ((after < length) && (gcr_start[after] == 0x52))
+			syncs->header[syncs->headers++] = (unsigned short) syncs->syncs;
+
+		syncs->syncs++;
+		pos = after + 1;
+	}
+}
+
+/* first sync whose last possible match position is at or beyond pos */
+static int
+first_indexed_sync(sync_index * syncs, size_t pos)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = syncs->syncs;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (syncs->after[mid] < pos + 2)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* same as find_sync(), gcr_end must be within the indexed buffer */
+int
+find_indexed_sync(sync_index * syncs, BYTE ** gcr_pptr, BYTE * gcr_end)
+{
+	size_t pos, end;
+	int i;
+
+	pos = *gcr_pptr - syncs->gcr_start;
+	end = gcr_end - syncs->gcr_start;
+	i = first_indexed_sync(syncs, pos);
+
+	if ((i == syncs->syncs) || (((pos > syncs->start[i]) ? pos : syncs->start[i]) + 1 >= end))
+	{
+		*gcr_pptr = gcr_end;
+		return 0;	/* not found */
+	}
+
+	*gcr_pptr = syncs->gcr_start + ((syncs->after[i] < end) ? syncs->after[i] : end);
+	return (*gcr_pptr < gcr_end);
+}
+
+/* same as find_header(), gcr_end must be within the indexed buffer */
+int
+find_indexed_header(sync_index * syncs, BYTE ** gcr_pptr, BYTE * gcr_end)
+{
+	size_t pos, end;
+	int lo, hi, mid;
+
+	pos = *gcr_pptr - syncs->gcr_start;
+	end = gcr_end - syncs->gcr_start;
+
+	lo = 0;
+	hi = syncs->headers;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (syncs->after[syncs->header[mid]] < pos + 2)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if ((lo == syncs->headers) || (syncs->after[syncs->header[lo]] >= end))
+	{
+		*gcr_pptr = gcr_end;
+		return 0;	/* not found */
+	}
+
+	*gcr_pptr = syncs->gcr_start + syncs->after[syncs->header[lo]] - 1;
+	return 1;
+}
+
 void
 convert_4bytes_to_GCR(BYTE * buffer, BYTE * ptr)
 {
@@ -229,25 +358,163 @@ convert_4bytes_from_GCR(BYTE * gcr, BYTE * plain)
 	return (nConverted);
 }
 
+static void
+init_GCR_encode_8bit(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		GCR_encode_8bit[i] = (unsigned short) ((GCR_conv_data[i >> 4] << 5) | GCR_conv_data[i & 0x0f]);
+
+	GCR_encode_8bit_ready = 1;
+}
+
+/*
+	Encode 'groups' blocks of 4 plain bytes into 5 GCR bytes each
+	(65 groups for a whole data block, 2 for a header).
+	Output is identical to calling convert_4bytes_to_GCR() per group.
+*/
+void
+convert_block_to_GCR(BYTE * buffer, BYTE * ptr, size_t groups)
+{
+	DWORD hi, lo;
+	size_t i;
+
+	if (!GCR_encode_8bit_ready)
+		init_GCR_encode_8bit();
+
+	for (i = 0; i < groups; i++)
+	{
+		/* 20 bits each */
+		hi = (GCR_encode_8bit[buffer[0]] << 10) | GCR_encode_8bit[buffer[1]];
+		lo = (GCR_encode_8bit[buffer[2]] << 10) | GCR_encode_8bit[buffer[3]];
+
+		ptr[0] = (BYTE) (hi >> 12);
+		ptr[1] = (BYTE) (hi >> 4);
+		ptr[2] = (BYTE) ((hi << 4) | (lo >> 16));
+		ptr[3] = (BYTE) (lo >> 8);
+		ptr[4] = (BYTE) lo;
+
+		buffer += 4;
+		ptr += 5;
+	}
+}
+
+/* Encode a 10 byte GCR block header for track/sector/ID */
+void
+convert_header_to_GCR(BYTE * ptr, int track, int sector, BYTE * diskID, BYTE chksum_xor)
+{
+	BYTE header[8];
+
+	header[0] = 0x08;	/* Header identifier */
+	header[1] = (BYTE) (sector ^ track ^ diskID[1] ^ diskID[0] ^ chksum_xor);
+	header[2] = (BYTE) sector;
+	header[3] = (BYTE) track;
+	header[4] = diskID[1];
+	header[5] = diskID[0];
+	header[6] = header[7] = 0x0f;
+
+	convert_block_to_GCR(header, ptr, 2);
+}
+
+static void
+init_GCR_decode_10bit(void)
+{
+	BYTE hnibble, lnibble;
+	int i;
+
+	for (i = 0; i < 1024; i++)
+	{
+		hnibble = GCR_decode_high[i >> 5];
+		lnibble = GCR_decode_low[i & 0x1f];
+
+		GCR_decode_10bit[i] = (unsigned short) (hnibble | lnibble);
+		if (hnibble == 0xff) GCR_decode_10bit[i] |= 0x100;
+		if (lnibble == 0xff) GCR_decode_10bit[i] |= 0x200;
+	}
+	GCR_decode_10bit_ready = 1;
+}
+
+/* build the lookup tables up front, before tracks are processed by several threads */
+void
+init_GCR_tables(void)
+{
+	if (!GCR_encode_8bit_ready)
+		init_GCR_encode_8bit();
+	if (!GCR_decode_10bit_ready)
+		init_GCR_decode_10bit();
+}
+
+/*
+	Decode 'groups' blocks of 5 GCR bytes into 4 plain bytes each
+	(65 groups for a whole data block, 2 for a header).
+	Output is identical to calling convert_4bytes_from_GCR() per group.
+	Returns the index of the first illegal quintet, or -1 if all are legal.
+*/
+int
+convert_block_from_GCR(BYTE * gcr, BYTE * plain, size_t groups)
+{
+	unsigned short d[4];
+	int badpos, k;
+	size_t i;
+
+	if (!GCR_decode_10bit_ready)
+		init_GCR_decode_10bit();
+
+	badpos = -1;
+
+	for (i = 0; i < groups; i++)
+	{
+		d[0] = GCR_decode_10bit[(gcr[0] << 2) | (gcr[1] >> 6)];
+		d[1] = GCR_decode_10bit[((gcr[1] & 0x3f) << 4) | (gcr[2] >> 4)];
+		d[2] = GCR_decode_10bit[((gcr[2] & 0x0f) << 6) | (gcr[3] >> 2)];
+		d[3] = GCR_decode_10bit[((gcr[3] & 0x03) << 8) | gcr[4]];
+
+		plain[0] = (BYTE) d[0];
+		plain[1] = (BYTE) d[1];
+		plain[2] = (BYTE) d[2];
+		plain[3] = (BYTE) d[3];
+
+		if ((badpos < 0) && ((d[0] | d[1] | d[2] | d[3]) & 0x300))
+		{
+			for (k = 0; k < 4; k++)
+			{
+				if (d[k] & 0x300)
+				{
+					badpos = (int) (i * 8) + (k * 2) + ((d[k] & 0x100) ? 0 : 1);
+					break;
+				}
+			}
+		}
+
+		gcr += 5;
+		plain += 4;
+	}
+
+	return badpos;
+}
+
 int
 extract_id(BYTE * gcr_track, BYTE * id)
 {
 	BYTE header[10];
 	BYTE *gcr_ptr, *gcr_end;
 	int track, sector;
+	sync_index syncs;
 
 	track = 18;
 	sector = 0;
 	gcr_ptr = gcr_track;
 	gcr_end = gcr_track + NIB_TRACK_LENGTH;
 
+	index_syncs(gcr_track, NIB_TRACK_LENGTH, &syncs);
+
 	do
 	{
-		if (!find_sync(&gcr_ptr, gcr_end))
+		if (!find_indexed_sync(&syncs, &gcr_ptr, gcr_end))
 			return 0;
 
-		convert_4bytes_from_GCR(gcr_ptr, header);
-		convert_4bytes_from_GCR(gcr_ptr + 5, header + 4);
+		convert_block_from_GCR(gcr_ptr, header, 2);
 
 		if (header[0] == 0x08 && header[2] == 0)
 		   id[0] = header[3];
@@ -281,26 +548,13 @@ extract_cosmetic_id(BYTE * gcr_track, BYTE * id)
 	return 1;
 }
 
-BYTE
-convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track, int sector, BYTE *id)
+/* initialize sector data with Original Format Pattern */
+static void
+init_GCR_sector(BYTE *d64_sector)
 {
- 	// we should later try to repair some common GCR errors
- 	//	1) tri-bit error, in which 01110 is misinterpreted as 01000
-	// 2) low frequency error, in which 10010 is misinterpreted as 11000
-
-	BYTE header[10];        /* block header */
-	BYTE hdr_chksum;        /* header checksum */
-	BYTE blk_chksum;        /* block  checksum */
-	BYTE *gcr_ptr, *gcr_end;
-	BYTE *sectordata;
-	BYTE error_code;
-	size_t track_len;
-	int i, j;
-
-	if ((gcr_cycle == NULL) || (gcr_cycle <= gcr_start))
-		return SYNC_NOT_FOUND;
+	BYTE blk_chksum;
+	int i;
 
-	/* initialize sector data with Original Format Pattern */
 	memset(d64_sector, 0x01, 260);
 	d64_sector[0] = 0x07;   /* Block header mark */
 	d64_sector[1] = 0x4b;   /* Use Original Format Pattern */
@@ -308,44 +562,37 @@ convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track
 	for (blk_chksum = 0, i = 1; i < 257; i++)
 		blk_chksum ^= d64_sector[i + 1];
 	d64_sector[257] = blk_chksum;
+}
 
-	/* setup pointers */
-	track_len = gcr_cycle - gcr_start;
-	gcr_ptr = gcr_start;
-	gcr_end = gcr_start + track_len;
-	error_code = SECTOR_OK;
-
-	/* Check for at least one Sync */
+/* data block always follows the header, else take the first sync on the track */
+static BYTE *
+find_data_sync(BYTE *gcr_start, BYTE *gcr_ptr, BYTE *gcr_end)
+{
 	if (!find_sync(&gcr_ptr, gcr_end))
-		return SYNC_NOT_FOUND;
-
-	/* Try to find a good block header for Track/Sector */
-	error_code = HEADER_NOT_FOUND;
-
-	//for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-1; gcr_ptr++)
-	for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-10; gcr_ptr++)
 	{
-		if ((gcr_ptr[0] == 0xff) && (gcr_ptr[1] == 0x52))
-		{
-			gcr_ptr++;
-			memset(header, 0, 10);
-
-			convert_4bytes_from_GCR(gcr_ptr, header);
-			convert_4bytes_from_GCR(gcr_ptr+5, header+4);
-
-			if ((header[0] == 0x08) && (header[2] == sector) && (header[3] == track) )
-			{
-				/* this is the header we are searching for */
-				error_code = SECTOR_OK;
-				break;
-			}
-			if(verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
-				gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
-		}
+		gcr_ptr = gcr_start;
+		if (!find_sync(&gcr_ptr, gcr_end))
+			return NULL;
 	}
+	return gcr_ptr;
+}
 
-	if(error_code != SECTOR_OK)
-		return error_code;
+/*
+	Check a located block header and decode its data block.
+	gcr_ptr points to the 0x52 header byte, header holds it decoded,
+	data_ptr is the first byte after the data block sync (NULL if none).
+*/
+static BYTE
+decode_GCR_sector(BYTE *gcr_ptr, BYTE *header, BYTE *data_ptr, BYTE *d64_sector, BYTE *id)
+{
+	BYTE hdr_chksum;        /* header checksum */
+	BYTE blk_chksum;        /* block  checksum */
+	BYTE *sectordata;
+	BYTE error_code;
+	BYTE badmap[BAD_GCR_MAP_BYTES(320)];
+	int i, badpos;
+
+	error_code = SECTOR_OK;
 
 	/* Header checksum calc */
 	hdr_chksum = 0;
@@ -360,36 +607,34 @@ convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track
 		error_code = (error_code == SECTOR_OK) ? ID_MISMATCH : error_code;
 
 	/* verify that our header contains no bad GCR, since it can be false positive checksum match */
-	for(j = 0; j < 10; j++)
-	{
-		if (is_bad_gcr(gcr_ptr - 1, 10, j))
-			error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
-	}
+	if (bad_gcr_map(gcr_ptr - 1, 10, badmap))
+		error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
 
 	/* done with header checks */
 	if((error_code != SECTOR_OK) && (error_code != ID_MISMATCH))
 		return error_code;
 
-	/* check for data sector, it will always be the data following header */
-	if (!find_sync(&gcr_ptr, gcr_end))
-	{
-		gcr_ptr = gcr_start;
-		if (!find_sync(&gcr_ptr, gcr_end))
-			return DATA_NOT_FOUND;
-	}
+	if (data_ptr == NULL)
+		return DATA_NOT_FOUND;
 
-	for (i = 0, sectordata = d64_sector; i < 65; i++)
-	{
-		convert_4bytes_from_GCR(gcr_ptr, sectordata);
+	gcr_ptr = data_ptr;
+	badpos = convert_block_from_GCR(gcr_ptr, d64_sector, 65);
 
-		if(verbose>3)
+	if(verbose>3)
+	{
+		for (i = 0, sectordata = d64_sector; i < 65; i++)
+		{
 			printf("%.4x: %.2x%.2x%.2x%.2x%.2x --- %.2x%.2x%.2x%.2x\n", (i*4),
 				gcr_ptr[0], gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4],
 				sectordata[0], sectordata[1], sectordata[2], sectordata[3]);
 
-		gcr_ptr += 5;
-		sectordata += 4;
+			gcr_ptr += 5;
+			sectordata += 4;
+		}
+		if(badpos >= 0) printf("First illegal GCR quintet at %d\n", badpos);
 	}
+	else
+		gcr_ptr += 325;
 
 	/* check for Block header mark */
 	if (d64_sector[0] != 0x07)
@@ -406,19 +651,143 @@ convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track
 		error_code = (error_code == SECTOR_OK) ? BAD_DATA_CHECKSUM : error_code;
 
 	/* verify that our data contains no bad GCR, since it can be false positive checksum match */
-	for(j = 0; j < 320; j++)
+	if (bad_gcr_map(gcr_ptr - 325, 320, badmap))
+		error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
+
+	return error_code;
+}
+
+BYTE
+convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track, int sector, BYTE *id)
+{
+ 	// we should later try to repair some common GCR errors
+ 	//	1) tri-bit error, in which 01110 is misinterpreted as 01000
+	// 2) low frequency error, in which 10010 is misinterpreted as 11000
+
+	BYTE header[10];        /* block header */
+	BYTE *gcr_ptr, *gcr_end;
+	size_t track_len;
+
+	if ((gcr_cycle == NULL) || (gcr_cycle <= gcr_start))
+		return SYNC_NOT_FOUND;
+
+	init_GCR_sector(d64_sector);
+
+	/* setup pointers */
+	track_len = gcr_cycle - gcr_start;
+	gcr_ptr = gcr_start;
+	gcr_end = gcr_start + track_len;
+
+	/* Check for at least one Sync */
+	if (!find_sync(&gcr_ptr, gcr_end))
+		return SYNC_NOT_FOUND;
+
+	/* Try to find a good block header for Track/Sector */
+	//for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-1; gcr_ptr++)
+	for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-10; gcr_ptr++)
 	{
-		if (is_bad_gcr(gcr_ptr - 325, 320, j))
-			error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
+		if ((gcr_ptr[0] == 0xff) && (gcr_ptr[1] == 0x52))
+		{
+			gcr_ptr++;
+			memset(header, 0, 10);
+
+			convert_block_from_GCR(gcr_ptr, header, 2);
+
+			if ((header[0] == 0x08) && (header[2] == sector) && (header[3] == track) )
+			{
+				/* this is the header we are searching for */
+				return decode_GCR_sector(gcr_ptr, header,
+					find_data_sync(gcr_start, gcr_ptr, gcr_end), d64_sector, id);
+			}
+			if(verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
+				gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
+		}
 	}
-	return error_code;
+
+	return HEADER_NOT_FOUND;
+}
+
+/*
+	Locate every block header of a track in one pass, so sectors can be
+	converted with convert_indexed_sector() without rescanning the track.
+	For each sector the first header of 'track' is kept, the same one
+	convert_GCR_sector() would find.
+*/
+void
+index_GCR_sectors(BYTE *gcr_start, BYTE *gcr_cycle, int track, sector_index *index)
+{
+	BYTE header[8];
+	BYTE *gcr_ptr, *gcr_end;
+
+	memset(index->header_pos, 0, sizeof(index->header_pos));
+	memset(index->data_pos, 0, sizeof(index->data_pos));
+	index->gcr_start = gcr_start;
+	index->gcr_end = gcr_cycle;
+	index->track = track;
+	index->has_sync = 0;
+	index->sectors = 0;
+
+	if ((gcr_cycle == NULL) || (gcr_cycle <= gcr_start))
+		return;
+
+	gcr_ptr = gcr_start;
+	gcr_end = gcr_cycle;
+
+	if (!find_sync(&gcr_ptr, gcr_end))
+		return;
+
+	index->has_sync = 1;
+
+	for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-10; gcr_ptr++)
+	{
+		if ((gcr_ptr[0] != 0xff) || (gcr_ptr[1] != 0x52))
+			continue;
+
+		convert_block_from_GCR(gcr_ptr + 1, header, 2);
+
+		if ((header[0] != 0x08) || (header[3] != track) || (index->header_pos[header[2]]))
+			continue;
+
+		index->header_pos[header[2]] = (gcr_ptr + 1) - gcr_start;
+		memcpy(index->header[header[2]], header, 8);
+
+		gcr_ptr = find_data_sync(gcr_start, gcr_ptr + 1, gcr_end);
+		if (gcr_ptr != NULL)
+			index->data_pos[header[2]] = gcr_ptr - gcr_start;
+
+		gcr_ptr = gcr_start + index->header_pos[header[2]];
+		index->sectors++;
+	}
+}
+
+/* same as convert_GCR_sector(), using a track index built by index_GCR_sectors() */
+BYTE
+convert_indexed_sector(sector_index *index, BYTE *d64_sector, int sector, BYTE *id)
+{
+	BYTE *gcr_ptr;
+
+	if ((index->gcr_end == NULL) || (index->gcr_end <= index->gcr_start))
+		return SYNC_NOT_FOUND;
+
+	init_GCR_sector(d64_sector);
+
+	if (!index->has_sync)
+		return SYNC_NOT_FOUND;
+
+	if ((sector < 0) || (sector >= SECTOR_INDEX_MAX) || (!index->header_pos[sector]))
+		return HEADER_NOT_FOUND;
+
+	gcr_ptr = index->gcr_start + index->header_pos[sector];
+
+	return decode_GCR_sector(gcr_ptr, index->header[sector],
+		index->data_pos[sector] ? index->gcr_start + index->data_pos[sector] : NULL, d64_sector, id);
 }
 
 void
 convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * diskID, int error)
 {
 	int i;
-	BYTE buf[4], databuf[0x104], chksum;
+	BYTE databuf[0x104], chksum;
 	BYTE tempID[3];
 
 	memcpy(tempID, diskID, 3);
@@ -442,21 +811,8 @@ convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * d
 			tempID[1] ^= 0xff;
 		}
 
-		buf[0] = 0x08;	/* Header identifier */
-		buf[1] = (BYTE) (sector ^ track ^ tempID[1] ^ tempID[0]);
-		buf[2] = (BYTE) sector;
-		buf[3] = (BYTE) track;
-
-		if (error == BAD_HEADER_CHECKSUM)
-			buf[1] ^= 0xff;
-
-		convert_4bytes_to_GCR(buf, ptr);
-		ptr += 5;
-		buf[0] = tempID[1];
-		buf[1] = tempID[0];
-		buf[2] = buf[3] = 0x0f;
-		convert_4bytes_to_GCR(buf, ptr);
-		ptr += 5;
+		convert_header_to_GCR(ptr, track, sector, tempID, (error == BAD_HEADER_CHECKSUM) ? 0xff : 0);
+		ptr += 10;
 		memset(ptr, 0x55, HEADER_GAP_LENGTH);	/* Header Gap */
 		ptr += HEADER_GAP_LENGTH;
 	}
@@ -482,11 +838,8 @@ convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * d
 	databuf[0x102] = 0;	/* 2 bytes filler */
 	databuf[0x103] = 0;
 
-	for (i = 0; i < 65; i++)
-	{
-		convert_4bytes_to_GCR(databuf + (4 * i), ptr);
-		ptr += 5;
-	}
+	convert_block_to_GCR(databuf, ptr, 65);
+	ptr += 325;
 
 	memset(ptr, 0x55, sector_gap_length[track]);	 /* tail gap*/
 	ptr += sector_gap_length[track];
@@ -495,7 +848,7 @@ convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * d
 }
 
 size_t
-find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+find_track_cycle_headers(nib_context *ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
 {
 	BYTE *nib_track;	/* start of nibbled track data */
 	BYTE *start_pos;	/* start of periodic area */
@@ -503,18 +856,21 @@ find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min
 	BYTE *stop_pos;		/* maximum position allowed for cycle */
 	BYTE *data_pos;		/* cycle search variable */
 	BYTE *p1, *p2;		/* local pointers for comparisons */
+	sync_index syncs;
 
 	nib_track = *cycle_start;
-	stop_pos = nib_track + NIB_TRACK_LENGTH - gap_match_length;
+	stop_pos = nib_track + NIB_TRACK_LENGTH - ctx->gap_match_length;
 	cycle_pos = NULL;
 
+	index_syncs(nib_track, stop_pos - nib_track, &syncs);
+
 	/* try to find a normal track cycle  */
-	for (start_pos = nib_track;; find_header(&start_pos, stop_pos))
+	for (start_pos = nib_track;; find_indexed_header(&syncs, &start_pos, stop_pos))
 	{
 		if ((data_pos = start_pos + cap_min) >= stop_pos)
 			break;	/* no cycle found */
 
-		while (find_header(&data_pos, stop_pos))
+		while (find_indexed_header(&syncs, &data_pos, stop_pos))
 		{
 			p1 = start_pos;
 			cycle_pos = data_pos;
@@ -522,18 +878,18 @@ find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min
 			for (p2 = cycle_pos; p2 < stop_pos;)
 			{
 				/* try to match all remaining syncs, too */
-				if (memcmp(p1, p2, gap_match_length) != 0)
+				if (memcmp(p1, p2, ctx->gap_match_length) != 0)
 				{
 					cycle_pos = NULL;
 					break;
 				}
-				if (!find_header(&p1, stop_pos))
+				if (!find_indexed_header(&syncs, &p1, stop_pos))
 					break;
-				if (!find_header(&p2, stop_pos))
+				if (!find_indexed_header(&syncs, &p2, stop_pos))
 					break;
 			}
 
-			if ((cycle_pos != NULL) && (check_valid_data(data_pos, gap_match_length)))
+			if ((cycle_pos != NULL) && (check_valid_data(data_pos, ctx->gap_match_length)))
 			{
 				*cycle_start = start_pos;
 				*cycle_stop = cycle_pos;
@@ -549,7 +905,7 @@ find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min
 }
 
 size_t
-find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+find_track_cycle_syncs(nib_context *ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
 {
 	BYTE *nib_track;	/* start of nibbled track data */
 	BYTE *start_pos;	/* start of periodic area */
@@ -557,18 +913,21 @@ find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min,
 	BYTE *stop_pos;		/* maximum position allowed for cycle */
 	BYTE *data_pos;		/* cycle search variable */
 	BYTE *p1, *p2;		/* local pointers for comparisons */
+	sync_index syncs;
 
 	nib_track = *cycle_start;
-	stop_pos = nib_track + NIB_TRACK_LENGTH - gap_match_length;
+	stop_pos = nib_track + NIB_TRACK_LENGTH - ctx->gap_match_length;
 	cycle_pos = NULL;
 
+	index_syncs(nib_track, stop_pos - nib_track, &syncs);
+
 	/* try to find a normal track cycle  */
-	for (start_pos = nib_track;; find_sync(&start_pos, stop_pos))
+	for (start_pos = nib_track;; find_indexed_sync(&syncs, &start_pos, stop_pos))
 	{
 		if ((data_pos = start_pos + cap_min) >= stop_pos)
 			break;	/* no cycle found */
 
-		while (find_sync(&data_pos, stop_pos))
+		while (find_indexed_sync(&syncs, &data_pos, stop_pos))
 		{
 			p1 = start_pos;
 			cycle_pos = data_pos;
@@ -576,18 +935,18 @@ find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min,
 			for (p2 = cycle_pos; p2 < stop_pos;)
 			{
 				/* try to match all remaining syncs, too */
-				if (memcmp(p1, p2, gap_match_length) != 0)
+				if (memcmp(p1, p2, ctx->gap_match_length) != 0)
 				{
 					cycle_pos = NULL;
 					break;
 				}
-				if (!find_sync(&p1, stop_pos))
+				if (!find_indexed_sync(&syncs, &p1, stop_pos))
 					break;
-				if (!find_sync(&p2, stop_pos))
+				if (!find_indexed_sync(&syncs, &p2, stop_pos))
 					break;
 			}
 
-			if ((cycle_pos != NULL) && (check_valid_data(data_pos, gap_match_length)))
+			if ((cycle_pos != NULL) && (check_valid_data(data_pos, ctx->gap_match_length)))
 			{
 				*cycle_start = start_pos;
 				*cycle_stop = cycle_pos;
@@ -602,49 +961,220 @@ find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min,
 	return NIB_TRACK_LENGTH;
 }
 
+/*
+	Raw cycle search.  Every window of gap_match_length bytes is hashed once
+	(rolling hash) and assigned to a class of identical windows, remembering
+	the last position of each class that passes check_valid_data().  The
+	first p1 whose class has a valid copy at least cap_min + CAP_ALLOWANCE
+	bytes later is the same answer the old p1/p2 memcmp() double loop gave.
+	check_valid_data() looks 3 bytes past the window, so windows that close
+	to the end of the track are never valid.
+	The classes take 56 KB, too much for the stack of a worker thread.
+*/
+#define RAW_HASH_BITS 12
+#define RAW_NONE 0xffff
+
+typedef struct
+{
+	unsigned short bucket[1 << RAW_HASH_BITS];	/* first class of each hash bucket */
+	unsigned short chain[NIB_TRACK_LENGTH];		/* next class in the same bucket */
+	unsigned short cls[NIB_TRACK_LENGTH];		/* class (first position) of each window */
+	unsigned short last_valid[NIB_TRACK_LENGTH];	/* last valid position of each class */
+} raw_classes;
+
+static int
+valid_window(nib_context *ctx, BYTE *nib_track, size_t pos)
+{
+	if (pos + ctx->gap_match_length + 3 > NIB_TRACK_LENGTH)
+		return 0;
+	return check_valid_data(nib_track + pos, ctx->gap_match_length);
+}
+
 size_t
-find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+find_track_cycle_raw(nib_context *ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
 {
 	BYTE *nib_track;	/* start of nibbled track data */
-	BYTE *start_pos;	/* start of periodic area */
-	BYTE *cycle_pos;	/* start of cycle repetition */
-	BYTE *stop_pos;		/* maximum position allowed for cycle */
-	BYTE *p1, *p2;		/* local pointers for comparisons */
+	raw_classes *rc;
+	unsigned short *bucket, *chain, *cls, *last_valid;
+	unsigned int hash, power;
+	size_t len, distance, p1, p2, r;
+	int i;
 
 	nib_track = *cycle_start;
-	start_pos = nib_track;
-	stop_pos = nib_track + NIB_TRACK_LENGTH - gap_match_length;
-	cycle_pos = NULL;
+	distance = cap_min + CAP_ALLOWANCE;
 
-	/* try to find a track cycle ignoring sync  */
-	for (p1 = start_pos; p1 < stop_pos; p1++)
+	if ((ctx->gap_match_length < 0) || (ctx->gap_match_length >= NIB_TRACK_LENGTH))
+		goto none;
+	len = NIB_TRACK_LENGTH - ctx->gap_match_length;
+
+	if ((rc = (raw_classes *) malloc(sizeof(raw_classes))) == NULL)
+	{
+		printf("Out of memory for the track cycle search\n");
+		goto none;
+	}
+	bucket = rc->bucket;
+	chain = rc->chain;
+	cls = rc->cls;
+	last_valid = rc->last_valid;
+
+	memset(bucket, 0xff, sizeof(rc->bucket));
+
+	for (power = 1, hash = 0, i = 0; i < ctx->gap_match_length; i++)
 	{
-		/* now try to match it */
-		for (p2 = p1 + (cap_min + CAP_ALLOWANCE); p2 < stop_pos; p2++)
-		//for (p2 = p1 + cap_max; p2 > p1 + cap_min; p2--)
+		hash = hash * 257 + nib_track[i];
+		power *= 257;
+	}
+
+	/* classify all windows */
+	for (p2 = 0; p2 < len; p2++)
+	{
+		if (p2)
+			hash = hash * 257 + nib_track[p2 + ctx->gap_match_length - 1] - power * nib_track[p2 - 1];
+
+		i = (hash * 2654435761U) >> (32 - RAW_HASH_BITS);
+		for (r = bucket[i]; r != RAW_NONE; r = chain[r])
 		{
-			/* try to match data */
-			if (memcmp(p1, p2, gap_match_length) != 0)
-				cycle_pos = NULL;
-			else
-				cycle_pos = p2;
+			if (memcmp(nib_track + r, nib_track + p2, ctx->gap_match_length) == 0)
+				break;
+		}
+
+		if (r == RAW_NONE)
+		{
+			r = p2;
+			chain[r] = bucket[i];
+			bucket[i] = (unsigned short) r;
+			last_valid[r] = RAW_NONE;
+		}
+		cls[p2] = (unsigned short) r;
+
+		if (valid_window(ctx, nib_track, p2))
+			last_valid[r] = (unsigned short) p2;
+	}
+
+	/* earliest start with a valid repetition far enough away */
+	for (p1 = 0; p1 < len; p1++)
+	{
+		r = cls[p1];
+		if ((last_valid[r] == RAW_NONE) || (last_valid[r] < p1 + distance))
+			continue;
 
-			/* we found one! */
-			if ((cycle_pos != NULL) && (check_valid_data(cycle_pos, gap_match_length)))
+		for (p2 = p1 + distance; p2 < len; p2++)
+		{
+			if ((cls[p2] == r) && (valid_window(ctx, nib_track, p2)))
 			{
-				*cycle_start = p1;
-				*cycle_stop = cycle_pos;
-				return (cycle_pos - p1);
+				free(rc);
+				*cycle_start = nib_track + p1;
+				*cycle_stop = nib_track + p2;
+				return (p2 - p1);
 			}
 		}
 	}
+	free(rc);
 
+none:
 	/* we got nothing useful */
 	*cycle_start = nib_track;
 	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
 	return NIB_TRACK_LENGTH;
 }
 
+/*
+	Estimate the revolution length of a track in bits, for tracks that do
+	not repeat on a byte boundary (bitshifted or flux-derived data).
+	The first bits of the track are compared against the bitstream at every
+	lag in cap_min..cap_max bytes, 64 bits at a time with XOR/popcount, and
+	the lag with the fewest differing bits wins.  confidence is 0 (chance)
+	to 100 (exact repeat).  A track of a short repeating pattern matches at
+	many lags; when another lag comes within BIT_PERIOD_TIE of the best
+	one, the length can't be told and confidence is 0.  Returns 0 if the
+	buffer is too short to tell.
+*/
+static QWORD
+gcr_bits64(BYTE * data)
+{
+	QWORD word;
+	int i;
+
+	for (word = 0, i = 0; i < 8; i++)
+		word = (word << 8) | data[i];
+	return word;
+}
+
+static int
+popcount64(QWORD x)
+{
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int) ((x * 0x0101010101010101ULL) >> 56);
+}
+
+size_t
+find_track_period_bits(BYTE * data, size_t length, size_t cap_min, size_t cap_max, int *confidence)
+{
+	QWORD ref[BIT_PERIOD_WORDS];
+	QWORD prev, next;
+	size_t lag, best_lag, words, j;
+	BYTE *p;
+	int shift, diff, best_diff, second_diff, tie, limit;
+
+	*confidence = 0;
+
+	/* compare as much as fits behind the longest lag */
+	if ((!cap_min) || (length < cap_max + 9 + 64))
+		return 0;
+	words = (length - cap_max - 9) / 8;
+	if (words > BIT_PERIOD_WORDS)
+		words = BIT_PERIOD_WORDS;
+
+	for (j = 0; j < words; j++)
+		ref[j] = gcr_bits64(data + 8 * j);
+
+	best_lag = 0;
+	best_diff = second_diff = (int) (words * 64) + 1;
+	tie = (int) (words * 64 * BIT_PERIOD_TIE / 100);
+
+	for (lag = cap_min * 8; lag <= cap_max * 8; lag++)
+	{
+		p = data + (lag >> 3);
+		shift = (int) (lag & 7);
+		prev = gcr_bits64(p);
+
+		/* only the best two lags count */
+		limit = (best_diff + tie < second_diff) ? best_diff + tie + 1 : second_diff;
+
+		for (diff = 0, j = 0; (j < words) && (diff < limit); j++)
+		{
+			next = gcr_bits64(p + 8 * (j + 1));
+			if (shift)
+				diff += popcount64(ref[j] ^ ((prev << shift) | (next >> (64 - shift))));
+			else
+				diff += popcount64(ref[j] ^ prev);
+			prev = next;
+		}
+
+		if (diff < best_diff)
+		{
+			second_diff = best_diff;
+			best_diff = diff;
+			best_lag = lag;
+		}
+		else if (diff < second_diff)
+			second_diff = diff;
+	}
+
+	/* no single length stands out */
+	if (second_diff <= best_diff + tie)
+		return best_lag;
+
+	/* random data differs in half of its bits */
+	*confidence = 100 - (int) ((200 * (size_t) best_diff) / (words * 64));
+	if (*confidence < 0)
+		*confidence = 0;
+
+	return best_lag;
+}
+
 int
 check_valid_data(BYTE * data, int matchlen)
 {
@@ -676,7 +1206,7 @@ check_valid_data(BYTE * data, int matchlen)
 }
 
 BYTE *
-find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
+find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen, sync_index * syncs)
 {
 	BYTE *pos, *buffer_end, *sync_last;
 
@@ -684,7 +1214,7 @@ find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 	buffer_end = work_buffer + 2 * tracklen - 10;
 	*p_sectorlen = 0;
 
-	if (!find_sync(&pos, buffer_end))
+	if (!find_indexed_sync(syncs, &pos, buffer_end))
 		return NULL;
 
 	sync_last = pos;
@@ -692,7 +1222,7 @@ find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 	/* try to find sector 0 */
 	while (pos < buffer_end)
 	{
-		if (!find_sync(&pos, buffer_end))
+		if (!find_indexed_sync(syncs, &pos, buffer_end))
 			return NULL;
 		if (pos[0] == 0x52 && (pos[1] & 0xc0) == 0x40 &&
 		  (pos[2] & 0x0f) == 0x05 && (pos[3] & 0xfc) == 0x28)
@@ -725,7 +1255,7 @@ find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 }
 
 BYTE *
-find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
+find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen, sync_index * syncs)
 {
 	size_t gap, maxgap;
 	BYTE *pos;
@@ -737,7 +1267,7 @@ find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 	buffer_end = work_buffer + 2 * tracklen - 10;
 	*p_sectorlen = 0;
 
-	if (!find_sync(&pos, buffer_end))
+	if (!find_indexed_sync(syncs, &pos, buffer_end))
 		return NULL;
 
 	sync_last = pos;
@@ -747,7 +1277,7 @@ find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 	/* try to find biggest (sector) gap */
 	while (pos < buffer_end)
 	{
-		if (!find_header(&pos, buffer_end))
+		if (!find_indexed_header(syncs, &pos, buffer_end))
 			break;
 
 		gap = pos - sync_last;
@@ -788,11 +1318,14 @@ find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 int check_formatted(BYTE *gcrdata, size_t length)
 {
 	size_t i, run = 0;
+	BYTE badmap[BAD_GCR_MAP_BYTES(NIB_TRACK_LENGTH)];
+
+	bad_gcr_map(gcrdata, length, badmap);
 
 	/* try to find longest good gcr run */
 	for (i = 0; i < length; i++)
 	{
-		if (is_bad_gcr(gcrdata, length, i))
+		if (BAD_GCR_MAPPED(badmap, i))
 			run = 0;
 		else
 			run++;
@@ -803,6 +1336,32 @@ int check_formatted(BYTE *gcrdata, size_t length)
 	return 0;
 }
 
+/*
+   Copy length bytes to dest starting at bit position bitpos, the bits of
+   dest in front of it are kept.  dest needs room for length+1 bytes behind
+   bitpos/8 if bitpos is not on a byte boundary.
+*/
+static void
+copy_bits(BYTE * dest, size_t bitpos, BYTE * source, size_t length)
+{
+	size_t i, pos;
+	int shift;
+
+	pos = bitpos >> 3;
+	shift = (int) (bitpos & 7);
+
+	if ((!shift) || (!length))
+	{
+		memcpy(dest + pos, source, length);
+		return;
+	}
+
+	dest[pos] = (dest[pos] & (0xff << (8 - shift))) | (source[0] >> shift);
+	for (i = 1; i < length; i++)
+		dest[pos + i] = (source[i - 1] << (8 - shift)) | (source[i] >> shift);
+	dest[pos + length] = source[length - 1] << (8 - shift);
+}
+
 /*
    Try to extract one complete cycle of GCR data from an 8kB buffer.
    Align track to sector gap if possible, else align to sector 0,
@@ -812,7 +1371,7 @@ int check_formatted(BYTE *gcrdata, size_t length)
    [Return] length of copied track fragment
 */
 size_t
-extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_t cap_min, size_t cap_max)
+extract_GCR_track(nib_context *ctx, BYTE *destination, BYTE *source, BYTE *align, int track, size_t cap_min, size_t cap_max)
 {
 	BYTE work_buffer[NIB_TRACK_LENGTH*2];	/* working buffer */
 	BYTE *cycle_start;	/* start position of cycle */
@@ -826,6 +1385,10 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	size_t sector0_len;	/* length of gap before sector 0 */
 	size_t sectorgap_len;	/* length of longest gap */
 	BYTE fake_density = 0;
+	sync_index syncs;	/* sync marks of work buffer */
+	size_t period_bits;	/* revolution length in bits */
+	size_t cycle_bits = 0;	/* revolution length in bits, if not on a byte boundary */
+	int period_confidence;
 	int i ,j;
 
 	sector0_pos = NULL;
@@ -835,7 +1398,7 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	marker_pos = NULL;
 
 	/* ignore minumum capacity by RPM/density */
-	if(!cap_min_ignore)
+	if(!ctx->cap_min_ignore)
 	{
 		cap_min -= CAP_ALLOWANCE;
 		cap_max += CAP_ALLOWANCE;
@@ -848,7 +1411,7 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	/* if this track is all sync, return */
 	if(check_sync_flags(source, fake_density, NIB_TRACK_LENGTH) & BM_FF_TRACK)
 	{
-		if(verbose) printf("KILLER! ");
+		if(ctx->verbose) printf("KILLER! ");
 		memcpy(destination, source, NIB_TRACK_LENGTH);
 		return NIB_TRACK_LENGTH;
 	}
@@ -858,33 +1421,47 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	memcpy(work_buffer, cycle_start, NIB_TRACK_LENGTH);
 
 	/* find cycle */
-	if(verbose>1) printf("[H");
-	find_track_cycle_headers(&cycle_start, &cycle_stop, cap_min, cap_max);
+	if(ctx->verbose>1) printf("[H");
+	find_track_cycle_headers(ctx, &cycle_start, &cycle_stop, cap_min, cap_max);
 	track_len = cycle_stop - cycle_start;
 
 	/* second pass to find a cycle in track w/non-standard headers */
 	if ((track_len > cap_max) || (track_len < cap_min))
 	{
-		if(verbose>1) printf("/S] ");
-		find_track_cycle_syncs(&cycle_start, &cycle_stop, cap_min, cap_max);
+		if(ctx->verbose>1) printf("/S] ");
+		find_track_cycle_syncs(ctx, &cycle_start, &cycle_stop, cap_min, cap_max);
 		track_len = cycle_stop - cycle_start;
 	}
 
 	/* third pass to find a cycle in track w/non-standard headers */
 	if ((track_len > cap_max) || (track_len < cap_min))
 	{
-		if(verbose>1) printf("/R] ");
-		find_track_cycle_raw(&cycle_start, &cycle_stop, cap_min, cap_max);
+		if(ctx->verbose>1) printf("/R] ");
+		find_track_cycle_raw(ctx, &cycle_start, &cycle_stop, cap_min, cap_max);
 		track_len = cycle_stop - cycle_start;
 	}
 
+	/* last pass for tracks that don't repeat on a byte boundary */
+	if (track_len > cap_max)
+	{
+		period_bits = find_track_period_bits(source, NIB_TRACK_LENGTH, cap_min, cap_max, &period_confidence);
+		if (period_confidence >= BIT_PERIOD_CONFIDENCE)
+		{
+			if(ctx->verbose>1) printf("/B:%d.%d] ", (int) (period_bits >> 3), (int) (period_bits & 7));
+			cycle_start = source;
+			track_len = (period_bits + 7) >> 3;
+			cycle_bits = period_bits;
+		}
+	}
+
 	if (track_len <= cap_min)
 	{
-		if(verbose>1) printf("/+");
+		if(ctx->verbose>1) printf("/+");
 		track_len += (cap_max-cap_min)/2;
+		cycle_bits = 0;
 	}
 
-	if(verbose>2)
+	if(ctx->verbose>2)
 	{
 		if (track_len > cap_max)
 			printf("[LONG, max=%d<%d] ",cap_max, track_len);
@@ -892,83 +1469,88 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 			printf("[SHORT, min=%d>%d] ", cap_min, track_len);
 
 		printf("{cycle:");
-		for(i=0;i<gap_match_length;i++)
+		for(i=0;i<ctx->gap_match_length;i++)
 			printf("%.2x",cycle_start[i]);
 		printf("}");
 	}
 
-	/* copy twice the data to work buffer */
+	/* copy twice the data to work buffer, the second revolution starts right behind the bits of the first */
+	if (!cycle_bits)
+		cycle_bits = track_len << 3;
 	memcpy(work_buffer, cycle_start, track_len);
-	memcpy(work_buffer + track_len, cycle_start, track_len);
+	copy_bits(work_buffer, cycle_bits, cycle_start, track_len);
+
+	/* sector0 and gap searches run up to 10 bytes before the end */
+	index_syncs(work_buffer, 2 * track_len - 10, &syncs);
 
 	/* print sector0 offset from beginning of data (for index hole check) */
-	if(verbose>1)
+	if(ctx->verbose>1)
 	{
-		sector0_pos = find_sector0(work_buffer, track_len, &sector0_len);
+		sector0_pos = find_sector0(work_buffer, track_len, &sector0_len, &syncs);
 		printf("{sec0=%.4d;len=%d} ",(int)(sector0_pos - work_buffer), sector0_len);
 	}
 
 	/* forced track alignments */
-	if (align_map[track] != ALIGN_NONE)
+	if (ctx->align_map[track] != ALIGN_NONE)
 	{
-		if (align_map[track] == ALIGN_VMAX_CW)
+		if (ctx->align_map[track] == ALIGN_VMAX_CW)
 		{
 			*align = ALIGN_VMAX_CW;
 			marker_pos = align_vmax_cw(work_buffer, track_len);
 
 			if(!marker_pos)
-				align_map[track] = ALIGN_VMAX;
+				ctx->align_map[track] = ALIGN_VMAX;
 		}
 
-		if (align_map[track] == ALIGN_VMAX)
+		if (ctx->align_map[track] == ALIGN_VMAX)
 		{
 			*align = ALIGN_VMAX;
 			marker_pos = align_vmax_new(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_PSLAYER)
+		if (ctx->align_map[track] == ALIGN_PSLAYER)
 		{
 			*align = ALIGN_PSLAYER;
 			marker_pos = align_pirateslayer(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_RAPIDLOK)
+		if (ctx->align_map[track] == ALIGN_RAPIDLOK)
 		{
 			*align = ALIGN_RAPIDLOK;
 			marker_pos = align_rl_special(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_AUTOGAP)
+		if (ctx->align_map[track] == ALIGN_AUTOGAP)
 		{
 			*align = ALIGN_AUTOGAP;
 			marker_pos = auto_gap(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_LONGSYNC)
+		if (ctx->align_map[track] == ALIGN_LONGSYNC)
 		{
 			*align = ALIGN_LONGSYNC;
 			marker_pos = find_long_sync(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_BADGCR)
+		if (ctx->align_map[track] == ALIGN_BADGCR)
 		{
 			*align = ALIGN_BADGCR;
 			marker_pos = find_bad_gap(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_GAP)
+		if (ctx->align_map[track] == ALIGN_GAP)
 		{
 			*align = ALIGN_GAP;
-			marker_pos = find_sector_gap(work_buffer, track_len, &sectorgap_len);
+			marker_pos = find_sector_gap(work_buffer, track_len, &sectorgap_len, &syncs);
 		}
 
-		if (align_map[track] == ALIGN_SEC0)
+		if (ctx->align_map[track] == ALIGN_SEC0)
 		{
 			*align = ALIGN_SEC0;
-			marker_pos = find_sector0(work_buffer, track_len, &sector0_len);
+			marker_pos = find_sector0(work_buffer, track_len, &sector0_len, &syncs);
 		}
 
-		if (align_map[track] == ALIGN_RAW)
+		if (ctx->align_map[track] == ALIGN_RAW)
 		{
 			*align = ALIGN_RAW;
 			marker_pos = work_buffer;
@@ -1005,14 +1587,14 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	//}
 
 	/* try to guess original alignment on "normal" sized tracks */
-	sector0_pos = find_sector0(work_buffer, track_len, &sector0_len);
-	sectorgap_pos = find_sector_gap(work_buffer, track_len, &sectorgap_len);
+	sector0_pos = find_sector0(work_buffer, track_len, &sector0_len, &syncs);
+	sectorgap_pos = find_sector_gap(work_buffer, track_len, &sectorgap_len, &syncs);
 
-	if(verbose>2)
+	if(ctx->verbose>2)
 		printf("{gap=%.4d;len=%d) ", (int)(sectorgap_pos-work_buffer), (int)sectorgap_len);
 
 	if((sectorgap_pos-work_buffer == sector0_pos-work_buffer) &&
-		(sectorgap_pos != NULL) &&	(sector0_pos != NULL) && (verbose>1))
+		(sectorgap_pos != NULL) &&	(sector0_pos != NULL) && (ctx->verbose>1))
 		printf("(sec0=gap) ");
 
 	/* if (sectorgap_len >= sector0_len + 0x40) */ /* Burstnibbler's calc */
@@ -1064,14 +1646,14 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 
 aligned:
 	i=j=0;
-	if(verbose>1)
+	if(ctx->verbose>1)
 	{
-		if(verbose>1) printf("{align:");
-		while((i<gap_match_length) && (i<(int)track_len))
+		if(ctx->verbose>1) printf("{align:");
+		while((i<ctx->gap_match_length) && (i<(int)track_len))
 		{
 			if(destination[j] != 0xff)
 			{
-				if(verbose>1) printf("%.2x",destination[j]);
+				if(ctx->verbose>1) printf("%.2x",destination[j]);
 				j++; i++;
 			}
 			else j++;
@@ -1125,46 +1707,42 @@ size_t
 kill_partial_sync(BYTE * gcrdata, size_t length, size_t length_max)
 {
 	size_t sync_cnt = 0;
-	size_t sync_len[1000];
-	size_t sync_pos[1000];
-	BYTE sync_pre[1000];
-	BYTE sync_pre2[1000];
-	size_t i, locked, total=0;
+	size_t pos, end, unlocked;
+	sync_index syncs;
+	int i;
 
-	memset(sync_len, 0, sizeof(sync_len));
-	memset(sync_pos, 0, sizeof(sync_pos));
-	memset(sync_pre, 0, sizeof(sync_pre));
-	memset(sync_pre2, 0, sizeof(sync_pre2));
+	index_syncs(gcrdata, length, &syncs);
 
-	// count syncs/lengths
-	for (locked=0, i=0; i<length-1; i++)
+	/* count syncs the way a locked byte scan sees them: the byte that ends
+	   a sync can't start the next one */
+	for (i = 0, unlocked = length; i < syncs.syncs; i++)
 	{
-		if (locked)
-		{
-			if (gcrdata[i] == 0xff)
-				sync_len[sync_cnt]++;
-			else
-				locked = 0; // end of sync
-		}
-		//else if (gcrdata[i] == 0xff) // not full sync, only last 8 bits
-		else if(((gcrdata[i] & 0x01) == 0x01) && (gcrdata[i+1] == 0xff)) // 10 bits
-		{
-			locked = 1;
-			sync_cnt++;
-			sync_len[sync_cnt] = 1;
-			sync_pos[sync_cnt] = i;
-			sync_pre[sync_cnt] = gcrdata[i];
-			sync_pre2[sync_cnt] = gcrdata[i-1];
-		}
-
+		pos = syncs.start[i];
+		if (pos == unlocked)
+			pos++;
+		if (pos + 2 > syncs.after[i])
+			continue;
+
+		sync_cnt++;
+		unlocked = syncs.after[i];
 	}
 
 	if(verbose>1) printf("\nSYNCS:%d\n", sync_cnt);
-	for (i=1; i<=sync_cnt; i++)
-	{
-		if(verbose>1) printf("(%d,%d,%x%x)\n", sync_pos[i], sync_len[i], sync_pre2[i], sync_pre[i]);
 
-		gcrdata[sync_pos[i]] = sync_pre2[i];
+	for (i = 0, unlocked = length; i < syncs.syncs; i++)
+	{
+		pos = syncs.start[i];
+		if (pos == unlocked)
+			pos++;
+		if (pos + 2 > syncs.after[i])
+			continue;
+
+		end = (syncs.after[i] < length - 1) ? syncs.after[i] : length - 1;
+		if(verbose>1) printf("(%d,%d,%x%x)\n", pos, end - pos, pos ? gcrdata[pos - 1] : 0, gcrdata[pos]);
+
+		unlocked = syncs.after[i];
+		if (pos)
+			gcrdata[pos] = gcrdata[pos - 1];
 	}
 
 	return 0;
@@ -1307,6 +1885,8 @@ compare_tracks(BYTE *track1, BYTE *track2, size_t length1, size_t length2, int s
 	size_t sync_diff, shift_diff, presync_diff, gap_diff, badgcr_diff, size_diff, byte_diff;
 	size_t offset;
 	char tmpstr[256];
+	BYTE badmap1[BAD_GCR_MAP_BYTES(NIB_TRACK_LENGTH)];
+	BYTE badmap2[BAD_GCR_MAP_BYTES(NIB_TRACK_LENGTH)];
 
 	byte_match = 0;
 	byte_diff = 0;
@@ -1321,6 +1901,9 @@ compare_tracks(BYTE *track1, BYTE *track2, size_t length1, size_t length2, int s
 
 	if (length1 > 0 && length2 > 0)
 	{
+		bad_gcr_map(track1, length1, badmap1);
+		bad_gcr_map(track2, length2, badmap2);
+
 		for (j = k = 0; (j < length2) && (k < length1); j++, k++)
 		{
 			/* we ignore sync length differences */
@@ -1364,14 +1947,14 @@ compare_tracks(BYTE *track1, BYTE *track2, size_t length1, size_t length2, int s
 			}
 
 			/* we ignore bad gcr bytes */
-			if (is_bad_gcr(track1, length1, j))
+			if ((j < length1) ? BAD_GCR_MAPPED(badmap1, j) : is_bad_gcr(track1, length1, j))
 			{
 				badgcr_diff++;
 				k--;
 				continue;
 			}
 
-			if (is_bad_gcr(track2, length2, k))
+			if ((k < length2) ? BAD_GCR_MAPPED(badmap2, k) : is_bad_gcr(track2, length2, k))
 			{
 				//badgcr_diff++;
 				j--;
@@ -1463,6 +2046,7 @@ compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BY
 	BYTE secbuf1[260], secbuf2[260];
 	char tmpstr[256];
 	unsigned int crcresult1, crcresult2;
+	sector_index index1, index2;
 
 	sec_match = 0;
 	numsecs = 0;
@@ -1470,12 +2054,13 @@ compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BY
 	checksum2 = 0;
 	outputstring[0] = '\0';
 
-	crcInit();
-
 	if ( (length1 == 0) || (length2 == 0) ||
 		 (length1 == NIB_TRACK_LENGTH) || (length2 == NIB_TRACK_LENGTH))
 		return 0;
 
+	index_GCR_sectors(track1, track1+length1, track/2, &index1);
+	index_GCR_sectors(track2, track2+length2, track/2, &index2);
+
 	/* check for sector matches */
 	for (sector = 0; sector < sector_map[track/2]; sector++)
 	{
@@ -1485,8 +2070,8 @@ compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BY
 		memset(secbuf2, 0, sizeof(secbuf2));
 		tmpstr[0] = '\0';
 
-		error1 = convert_GCR_sector(track1, track1+length1, secbuf1, track/2, sector, id1);
-		error2 = convert_GCR_sector(track2, track2+length2, secbuf2, track/2, sector, id2);
+		error1 = convert_indexed_sector(&index1, secbuf1, sector, id1);
+		error2 = convert_indexed_sector(&index2, secbuf2, sector, id2);
 
 		/* compare data returned */
 		checksum1 = 0;
@@ -1610,13 +2195,16 @@ check_errors(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorst
 	int errors, sector;
 	char tmpstr[16];
 	BYTE secbuf[260], errorcode;
+	sector_index index;
 
 	errors = 0;
 	errorstring[0] = '\0';
 
+	index_GCR_sectors(gcrdata, gcrdata + length, (track/2), &index);
+
 	for (sector = 0; sector < sector_map[track/2]; sector++)
 	{
-		errorcode = convert_GCR_sector(gcrdata, gcrdata + length, secbuf, (track/2), sector, id);
+		errorcode = convert_indexed_sector(&index, secbuf, sector, id);
 
 		if (errorcode != SECTOR_OK)
 		{
@@ -1635,14 +2223,17 @@ check_empty(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstr
 	int i, empty, sector, errorcode;
 	char tmpstr[16], temp_errorstring[256];
 	BYTE secbuf[260];
+	sector_index index;
 
 	empty = 0;
 	errorstring[0] = '\0';
 	temp_errorstring[0] = '\0';
 
+	index_GCR_sectors(gcrdata, gcrdata + length, (track / 2), &index);
+
 	for (sector = 0; sector < sector_map[track / 2]; sector++)
 	{
-		errorcode = convert_GCR_sector(gcrdata, gcrdata + length, secbuf, (track / 2), sector, id);
+		errorcode = convert_indexed_sector(&index, secbuf, sector, id);
 
 		if (errorcode == SECTOR_OK)
 		{
@@ -1711,6 +2302,52 @@ is_bad_gcr(BYTE * gcrdata, size_t length, size_t pos)
 	return (mask >= 7);
 }
 
+/*
+ * Build a bitmap of is_bad_gcr() for every position of a track in one pass,
+ * including the wrap from the last byte to the first.
+ * 8 bytes are tested at once: a bit is set in 'run' where it and the two
+ * bits before it in the bitstream are all zero.
+ * map must hold BAD_GCR_MAP_BYTES(length) bytes.  Returns the bad GCR count.
+ */
+size_t
+bad_gcr_map(BYTE * gcrdata, size_t length, BYTE * map)
+{
+	QWORD data, zero, run;
+	BYTE last, bits;
+	size_t i, k, n, total;
+
+	if (!length)
+		return 0;
+
+	total = 0;
+	last = gcrdata[length - 1];
+
+	for (i = 0; i < length; i += 8)
+	{
+		n = (length - i < 8) ? length - i : 8;
+
+		for (data = 0, k = 0; k < 8; k++)
+			data = (data << 8) | ((k < n) ? gcrdata[i + k] : 0xff);
+
+		zero = ~data;
+		run = zero &
+			((zero >> 1) | ((QWORD) (~last & 1) << 63)) &
+			((zero >> 2) | ((QWORD) (~last & 3) << 62));
+
+		/* high bit of each nonzero byte, gathered into one byte */
+		run = (((run & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | run) & 0x8080808080808080ULL;
+		bits = (BYTE) (((run >> 7) * 0x0102040810204080ULL) >> 56);
+		bits &= (BYTE) (0xff << (8 - n));
+
+		map[i >> 3] = bits;
+		for (; bits; bits &= bits - 1)
+			total++;
+
+		last = gcrdata[i + n - 1];
+	}
+	return total;
+}
+
 /*
  * Check and "correct" bad GCR bits:
  * substitute bad GCR bytes by 0x00 until next good GCR byte
@@ -1723,10 +2360,8 @@ is_bad_gcr(BYTE * gcrdata, size_t length, size_t pos)
  * is not this precise and it fails the protection checks sometimes.
  */
 
-extern int fix_gcr;
-
 size_t
-check_bad_gcr(BYTE * gcrdata, size_t length)
+check_bad_gcr(nib_context *ctx, BYTE * gcrdata, size_t length)
 {
 	/* state machine definitions */
 	enum ebadgcr { S_BADGCR_OK, S_BADGCR_ONCE_BAD, S_BADGCR_LOST };
@@ -1736,6 +2371,7 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 	size_t n_badgcr;
 	size_t firstbad, lastbad;
 	BYTE origdata[0x2000];
+	BYTE badmap[BAD_GCR_MAP_BYTES(0x2000)];
 
 	/* if empty we are all "bad" GCR */
 	if(!length)
@@ -1747,10 +2383,14 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 	sbadgcr = S_BADGCR_OK;
 	memcpy(origdata,gcrdata,length);
 
+	/* fixes below only touch gcrdata[lastpos], which is already behind us,
+	   except that position 1 has to see a fixed up byte 0 */
+	bad_gcr_map(gcrdata, length, badmap);
+
 	for (i = 0; i < length - 1; i++)
 	{
-		b_badgcr = is_bad_gcr(gcrdata, length, i);
-		n_badgcr = is_bad_gcr(gcrdata, length, i + 1);
+		b_badgcr = (i == 1) ? is_bad_gcr(gcrdata, length, i) : (BAD_GCR_MAPPED(badmap, i) != 0);
+		n_badgcr = (BAD_GCR_MAPPED(badmap, i + 1) != 0);
 
 		switch (sbadgcr)
 		{
@@ -1759,7 +2399,7 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				{
 					total++;
 
-					if(fix_gcr > 2)
+					if(ctx->fix_gcr > 2)
 					{
 						sbadgcr = S_BADGCR_LOST;  /* most aggressive */
 						gcrdata[lastpos] = 0x00;
@@ -1773,7 +2413,7 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				}
 				else
 				{
-					if((firstbad) && (verbose>1))
+					if((firstbad) && (ctx->verbose>1))
 					{
 						if(memcmp(origdata+firstbad,gcrdata+firstbad,i-firstbad))
 						{
@@ -1791,16 +2431,16 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				break;
 
 			case S_BADGCR_ONCE_BAD:
-				if ((b_badgcr) || ((fix_gcr>3) && (n_badgcr)) )
+				if ((b_badgcr) || ((ctx->fix_gcr>3) && (n_badgcr)) )
 				{
 					total++;
 					sbadgcr = S_BADGCR_LOST;
 
-					if(fix_gcr > 1)
+					if(ctx->fix_gcr > 1)
 					{
 						fix_first_gcr(gcrdata, length, lastpos);
 					}
-					else if (fix_gcr > 2)
+					else if (ctx->fix_gcr > 2)
 					{
 						gcrdata[lastpos] = 0x00;
 					}
@@ -1810,11 +2450,11 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				break;
 
 			case S_BADGCR_LOST:
-				if ((b_badgcr) || ((fix_gcr>3) && (n_badgcr)) )
+				if ((b_badgcr) || ((ctx->fix_gcr>3) && (n_badgcr)) )
 				{
 					total++;
 
-					if (fix_gcr)
+					if (ctx->fix_gcr)
 					{
 						gcrdata[lastpos] = 0x00;
 					}
@@ -1823,11 +2463,11 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				{
 					sbadgcr = S_BADGCR_OK;
 
-					if(fix_gcr > 1)
+					if(ctx->fix_gcr > 1)
 					{
 						fix_last_gcr(gcrdata, length, lastpos);
 					}
-					else if(fix_gcr > 2)
+					else if(ctx->fix_gcr > 2)
 					{
 						gcrdata[lastpos] = 0x00;
 					}
@@ -16,6 +16,7 @@
 
 #define BYTE unsigned char
 #define DWORD unsigned int
+#define QWORD unsigned long long
 #define TRUE 1
 #define FALSE 0
 #define MAX_TRACKS_1541 42 /* tracks are referenced 1-42 instead of 0-41 */
@@ -37,10 +38,21 @@
 
 #define SECTOR_SIZE ((SYNC_LENGTH) + (HEADER_LENGTH) + (HEADER_GAP_LENGTH) + (SYNC_LENGTH) + (DATA_LENGTH))
 
+/* bad GCR bitmap, one bit per GCR byte, MSB first */
+#define BAD_GCR_MAP_BYTES(length) (((length) + 7) >> 3)
+#define BAD_GCR_MAPPED(map, pos) ((map)[(pos) >> 3] & (0x80 >> ((pos) & 7)))
+
 /* NIB format constants */
 #define NIB_TRACK_LENGTH 0x2000
 #define NIB_HEADER_SIZE 0xFF
 
+/* NBZ v2: container header, NIB header, one entry per track, then the tracks compressed one by one */
+#define NBZ_MAGIC "MNIB-1541-NBZ"
+#define NBZ_VERSION 2
+#define NBZ_HEADER_SIZE 0x10
+#define NBZ_ENTRY_SIZE 0x10
+#define NBZ_MAX_TRACK_SIZE (NIB_TRACK_LENGTH + (NIB_TRACK_LENGTH / 256) + 1)	/* LZ worst case */
+
 /*
     number of GCR bytes until NO SYNC error
     timer counts down from $d000 to $8000 (20480 cycles)
@@ -82,6 +94,11 @@ speed zone divisors are 13, 14, 15, 16 for densities 3, 2, 1, 0 respectively
     This keeps us from getting errors in the track cycle detection */
 #define CAP_ALLOWANCE 0xff
 
+/* bit period estimation: 64 bit words compared per lag, minimum confidence to use it */
+#define BIT_PERIOD_WORDS 128
+#define BIT_PERIOD_CONFIDENCE 90
+#define BIT_PERIOD_TIE 2	/* percent of the bits compared */
+
 /* minimum amount of good sequential GCR for formatted track */
 #define GCR_MIN_FORMATTED 16
 /*#define GCR_MIN_FORMATTED 64 */	/* chessmaster track 29 */
@@ -119,6 +136,57 @@ speed zone divisors are 13, 14, 15, 16 for densities 3, 2, 1, 0 respectively
 #define REDUCE_GAP		0x2
 #define REDUCE_BAD		0x4
 
+/* block header locations of one track, see index_GCR_sectors() */
+#define SECTOR_INDEX_MAX 256
+
+typedef struct
+{
+	BYTE *gcr_start;
+	BYTE *gcr_end;
+	int track;
+	int has_sync;
+	int sectors;								/* headers found for this track */
+	size_t header_pos[SECTOR_INDEX_MAX];	/* offset of 0x52 header byte, 0 if not found */
+	size_t data_pos[SECTOR_INDEX_MAX];		/* offset behind data block sync, 0 if not found */
+	BYTE header[SECTOR_INDEX_MAX][8];		/* decoded header: id, chksum, sector, track, id2, id1, 0x0f, 0x0f */
+} sector_index;
+
+/* sync marks of a buffer up to 2*NIB_TRACK_LENGTH, see index_syncs()
+   each sync takes at least two bytes, and any of them can be a header */
+#define SYNC_INDEX_MAX NIB_TRACK_LENGTH
+
+typedef struct
+{
+	BYTE *gcr_start;
+	size_t length;
+	int syncs;
+	int headers;
+	unsigned short start[SYNC_INDEX_MAX];		/* byte holding the first sync bits */
+	unsigned short after[SYNC_INDEX_MAX];		/* first byte after the sync */
+	unsigned short header[SYNC_INDEX_MAX];		/* syncs followed by a 0x52 header byte */
+} sync_index;
+
+/* processing state of one image, see init_context() */
+typedef struct
+{
+	int verbose;
+	int fix_gcr;
+	int gap_match_length;
+	int cap_min_ignore;
+	int fattrack;
+	int reduce_sync;
+	int increase_sync;
+	int rpm_real;
+	int workers;
+	int sync_align_buffer;
+	BYTE fillbyte;
+	size_t capacity[4];
+	size_t capacity_min[4];
+	size_t capacity_max[4];
+	BYTE align_map[MAX_TRACKS_1541 + 1];
+	BYTE reduce_map[MAX_TRACKS_1541 + 1];
+} nib_context;
+
 /* global variables */
 extern BYTE sector_map[];
 extern BYTE sector_gap_length[];
@@ -128,8 +196,6 @@ extern BYTE reduce_map[];
 extern size_t capacity[];
 extern size_t capacity_min[];
 extern size_t capacity_max[];\
-extern int gap_match_length;
-extern int cap_min_ignore;
 extern int verbose;
 
 /* enums */
@@ -138,20 +204,30 @@ extern char alignments[][20];
 /* prototypes */
 int find_sync(BYTE ** gcr_pptr, BYTE * gcr_end);
 int find_header(BYTE ** gcr_pptr, BYTE * gcr_end);
+void index_syncs(BYTE * gcr_start, size_t length, sync_index * syncs);
+int find_indexed_sync(sync_index * syncs, BYTE ** gcr_pptr, BYTE * gcr_end);
+int find_indexed_header(sync_index * syncs, BYTE ** gcr_pptr, BYTE * gcr_end);
 void convert_4bytes_to_GCR(BYTE * buffer, BYTE * ptr);
+void convert_block_to_GCR(BYTE * buffer, BYTE * ptr, size_t groups);
+void convert_header_to_GCR(BYTE * ptr, int track, int sector, BYTE * diskID, BYTE chksum_xor);
 int convert_4bytes_from_GCR(BYTE * gcr, BYTE * plain);
+int convert_block_from_GCR(BYTE * gcr, BYTE * plain, size_t groups);
+void init_GCR_tables(void);
 int extract_id(BYTE * gcr_track, BYTE * id);
 int extract_cosmetic_id(BYTE * gcr_track, BYTE * id);
-size_t find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
-size_t find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
-size_t find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
+size_t find_track_cycle_headers(nib_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
+size_t find_track_cycle_syncs(nib_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
+size_t find_track_cycle_raw(nib_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
+size_t find_track_period_bits(BYTE * data, size_t length, size_t cap_min, size_t cap_max, int *confidence);
 BYTE convert_GCR_sector(BYTE * gcr_start, BYTE * gcr_end, BYTE * d64_sector, int track, int sector, BYTE * id);
+void index_GCR_sectors(BYTE * gcr_start, BYTE * gcr_cycle, int track, sector_index * index);
+BYTE convert_indexed_sector(sector_index * index, BYTE * d64_sector, int sector, BYTE * id);
 void convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * diskID, int error);
-BYTE * find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen);
-BYTE * find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen);
-size_t extract_GCR_track(BYTE * destination, BYTE * source, BYTE *align, int halftrack, size_t cap_min, size_t cap_max);
+BYTE * find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen, sync_index * syncs);
+BYTE * find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen, sync_index * syncs);
+size_t extract_GCR_track(nib_context * ctx, BYTE * destination, BYTE * source, BYTE *align, int halftrack, size_t cap_min, size_t cap_max);
 int replace_bytes(BYTE * buffer, size_t length, BYTE srcbyte, BYTE dstbyte);
-size_t check_bad_gcr(BYTE * gcrdata, size_t length);
+size_t check_bad_gcr(nib_context * ctx, BYTE * gcrdata, size_t length);
 BYTE check_sync_flags(BYTE * gcrdata, int density, size_t length);
 void bitshift(BYTE * gcrdata, size_t length, int bits);
 size_t check_errors(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring);
@@ -165,6 +241,7 @@ size_t kill_partial_sync(BYTE * gcrdata, size_t length, size_t length_max);
 size_t strip_gaps(BYTE * buffer, size_t length);
 size_t reduce_gaps(BYTE * buffer, size_t length, size_t length_max);
 size_t is_bad_gcr(BYTE * gcrdata, size_t length, size_t pos);
+size_t bad_gcr_map(BYTE * gcrdata, size_t length, BYTE * map);
 int check_formatted(BYTE * gcrdata, size_t length);
 int check_valid_data(BYTE * data, int matchlen);
 char topetscii(char s);
@@ -101,6 +101,8 @@
 #include <time.h>
 #include <ctype.h>
 
+#include "lz.h"
+
 
 /*************************************************************************
 * _LZ_StringCompare() - Return maximum length string match.
@@ -117,6 +119,22 @@ static unsigned int _LZ_StringCompare( unsigned char * str1,
 }
 
 
+/*************************************************************************
+* _LZ_Hash() - Hash the three bytes at str for the chains of
+* LZ_CompressHash().
+*************************************************************************/
+
+static unsigned int _LZ_Hash( unsigned char * str )
+{
+    unsigned int x;
+
+    x = ((unsigned int) str[0] << 16) | ((unsigned int) str[1] << 8) |
+        (unsigned int) str[2];
+
+    return ((x * 2654435761U) >> (32 - LZ_HASH_BITS)) & (LZ_HASH_SIZE - 1);
+}
+
+
 /*************************************************************************
 * _LZ_WriteVarSize() - Write unsigned integer with variable number of
 * bytes depending on value.
@@ -154,10 +172,12 @@ static int _LZ_WriteVarSize( unsigned int x, unsigned char * buf )
 
 /*************************************************************************
 * _LZ_ReadVarSize() - Read unsigned integer with variable number of
-* bytes depending on value.
+* bytes depending on value. Returns 0 if it does not end before end or
+* is longer than five bytes.
 *************************************************************************/
 
-static int _LZ_ReadVarSize( unsigned int * x, unsigned char * buf )
+static int _LZ_ReadVarSize( unsigned int * x, unsigned char * buf,
+  unsigned char * end )
 {
     unsigned int y, b, num_bytes;
 
@@ -166,6 +186,10 @@ static int _LZ_ReadVarSize( unsigned int * x, unsigned char * buf )
     num_bytes = 0;
     do
     {
+        if( (buf >= end) || (num_bytes == 5) )
+        {
+            return 0;
+        }
         b = (unsigned int) (*buf ++);
         y = (y << 7) | (b & 0x0000007f);
         ++ num_bytes;
@@ -322,62 +346,59 @@ int LZ_Compress( unsigned char *in, unsigned char *out, unsigned int insize )
 
 
 /*************************************************************************
-* LZ_CompressFast() - Compress a block of data using an LZ77 coder.
+* LZ_CompressHash() - Compress a block of data using an LZ77 coder, with
+* hash chains of bounded depth for the string search.
 *  in     - Input (uncompressed) buffer.
 *  out    - Output (compressed) buffer. This buffer must be 0.4% larger
 *           than the input buffer, plus one byte.
 *  insize - Number of input bytes.
 *  work   - Pointer to a temporary buffer (internal working buffer), which
-*           must be able to hold (insize+65536) unsigned integers.
-* The function returns the size of the compressed data.
+*           must be able to hold LZ_WORK_SIZE(insize) unsigned integers.
+*           It can be reused for any number of calls.
+*  depth  - Number of earlier positions to try at most for each match.
+*           Higher values give better compression, lower values are
+*           faster (LZ_DEFAULT_DEPTH is a good trade-off).
+* Matches may overlap the data they produce, so a run of one byte codes
+* as a single reference. The output is read by LZ_Uncompress().
+* The function returns the size of the compressed data, or -1 if there is
+* no working buffer.
 *************************************************************************/
 
-int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
+int LZ_CompressHash( unsigned char *in, unsigned char *out,
+  unsigned int insize, unsigned int *work, int depth )
 {
     unsigned char marker, symbol;
-    unsigned int  inpos, outpos, bytesleft, i, index, symbols;
-    unsigned int  offset, bestoffset;
-    unsigned int  maxlength, length, bestlength;
-    unsigned int  histogram[ 256 ], *lastindex, *jumptable;
+    unsigned int  inpos, outpos, bytesleft, i, index, hash, next;
+    unsigned int  bestoffset;
+    unsigned int  length, bestlength;
+    unsigned int  histogram[ 256 ], *head, *chain;
     unsigned char *ptr1, *ptr2;
-    unsigned int *work;
+    int           tries;
 
     /* Do we have anything to compress? */
     if( insize < 1 )
     {
         return 0;
     }
-
-	if(!(work = calloc(insize+65536, sizeof(unsigned int))))
-	{
-		printf("Could not allocate compression buffer\n");
-		exit(0);
-	}
-
-    /* Assign arrays to the working area */
-    lastindex = work;
-    jumptable = &work[ 65536 ];
-
-    /* Build a "jump table". Here is how the jump table works:
-       jumptable[i] points to the nearest previous occurrence of the same
-       symbol pair as in[i]:in[i+1], so in[i] == in[jumptable[i]] and
-       in[i+1] == in[jumptable[i]+1], and so on... Following the jump table
-       gives a dramatic boost for the string search'n'match loop compared
-       to doing a brute force search. The jump table is built in O(n) time,
-       so it is a cheap operation in terms of time, but it is expensice in
-       terms of memory consumption. */
-    for( i = 0; i < 65536; ++ i )
+    if( work == NULL )
     {
-        lastindex[ i ] = 0xffffffff;
+        return -1;
     }
-    for( i = 0; i < insize-1; ++ i )
+    if( depth < 1 )
     {
-        symbols = (((unsigned int)in[i]) << 8) | ((unsigned int)in[i+1]);
-        index = lastindex[ symbols ];
-        lastindex[ symbols ] = i;
-        jumptable[ i ] = index;
+        depth = 1;
+    }
+
+    /* Assign arrays to the working area. head[h] is the last position
+       whose next three bytes hash to h, chain[i] the position before i
+       with the same hash. Positions are added as the coder passes them,
+       so only earlier data is ever searched. */
+    head = work;
+    chain = &work[ LZ_HASH_SIZE ];
+    for( i = 0; i < LZ_HASH_SIZE; ++ i )
+    {
+        head[ i ] = 0xffffffff;
     }
-    jumptable[ insize-1 ] = 0xffffffff;
 
     /* Create histogram */
     for( i = 0; i < 256; ++ i )
@@ -405,19 +426,29 @@ int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
     /* Start of compression */
     inpos = 0;
     outpos = 1;
+    next = 0;
 
     /* Main compression loop */
     bytesleft = insize;
-    do
+    while( bytesleft > 3 )
     {
+        /* Add the positions passed since the last search to the chains */
+        for( ; next < inpos; ++ next )
+        {
+            hash = _LZ_Hash( &in[ next ] );
+            chain[ next ] = head[ hash ];
+            head[ hash ] = next;
+        }
+
         /* Get pointer to current position */
         ptr1 = &in[ inpos ];
 
-        /* Search history window for maximum length string match */
+        /* Search the chain for maximum length string match */
         bestlength = 3;
         bestoffset = 0;
-        index = jumptable[ inpos ];
-        while( (index != 0xffffffff) && ((inpos - index) < LZ_MAX_OFFSET) )
+        index = head[ _LZ_Hash( ptr1 ) ];
+        for( tries = depth; (tries > 0) && (index != 0xffffffff) &&
+             ((inpos - index) < LZ_MAX_OFFSET); -- tries )
         {
             /* Get pointer to candidate string */
             ptr2 = &in[ index ];
@@ -425,23 +456,25 @@ int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
             /* Quickly determine if this is a candidate (for speed) */
             if( ptr2[ bestlength ] == ptr1[ bestlength ] )
             {
-                /* Determine maximum length for this offset */
-                offset = inpos - index;
-                maxlength = (bytesleft < offset ? bytesleft : offset);
-
                 /* Count maximum length match at this offset */
-                length = _LZ_StringCompare( ptr1, ptr2, 2, maxlength );
+                length = _LZ_StringCompare( ptr1, ptr2, 0, bytesleft );
 
                 /* Better match than any previous match? */
                 if( length > bestlength )
                 {
                     bestlength = length;
-                    bestoffset = offset;
+                    bestoffset = inpos - index;
+
+                    /* Nothing left to improve */
+                    if( bestlength == bytesleft )
+                    {
+                        break;
+                    }
                 }
             }
 
-            /* Get next possible index from jump table */
-            index = jumptable[ index ];
+            /* Get next possible index from the chain */
+            index = chain[ index ];
         }
 
         /* Was there a good enough match? */
@@ -469,7 +502,6 @@ int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
             -- bytesleft;
         }
     }
-    while( bytesleft > 3 );
 
     /* Dump remaining bytes, if any */
     while( inpos < insize )
@@ -486,24 +518,55 @@ int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
         ++ inpos;
     }
 
-	free(work);
+    return outpos;
+}
 
-	return outpos;
+
+/*************************************************************************
+* LZ_CompressFast() - Compress a block of data using an LZ77 coder.
+*  in     - Input (uncompressed) buffer.
+*  out    - Output (compressed) buffer. This buffer must be 0.4% larger
+*           than the input buffer, plus one byte.
+*  insize - Number of input bytes.
+* Same as LZ_CompressHash() with LZ_DEFAULT_DEPTH and a working buffer of
+* its own. The function returns the size of the compressed data, or -1 if
+* the working buffer could not be allocated.
+*************************************************************************/
+
+int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
+{
+    unsigned int *work;
+    int          outsize;
+
+    if( !(work = (unsigned int *) malloc( LZ_WORK_SIZE( insize ) * sizeof(unsigned int) )) )
+    {
+        return -1;
+    }
+
+    outsize = LZ_CompressHash( in, out, insize, work, LZ_DEFAULT_DEPTH );
+
+    free( work );
+    return outsize;
 }
 
 
 /*************************************************************************
 * LZ_Uncompress() - Uncompress a block of data using an LZ77 decoder.
 *  in      - Input (compressed) buffer.
-*  out     - Output (uncompressed) buffer. This buffer must be large
-*            enough to hold the uncompressed data.
+*  out     - Output (uncompressed) buffer.
 *  insize  - Number of input bytes.
+*  outsize - Size of the output buffer, nothing is written beyond it.
+* The function returns the size of the uncompressed data, or one of the
+* negative LZ_ERROR_ codes if the input is damaged.
 *************************************************************************/
 
-int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize )
+int LZ_Uncompress( unsigned char *in, unsigned char *out,
+  unsigned int insize, unsigned int outsize )
 {
     unsigned char marker, symbol;
-    unsigned int  i, inpos, outpos, length, offset;
+    unsigned char *src, *dst;
+    unsigned int  inpos, outpos, length, offset, chunk;
+    int           num_bytes;
 
     /* Do we have anything to uncompress? */
     if( insize < 1 )
@@ -517,39 +580,79 @@ int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize )
 
     /* Main decompression loop */
     outpos = 0;
-    do
+    while( inpos < insize )
     {
         symbol = in[ inpos ++ ];
         if( symbol == marker )
         {
             /* We had a marker byte */
+            if( inpos >= insize )
+            {
+                return LZ_ERROR_INPUT;
+            }
             if( in[ inpos ] == 0 )
             {
                 /* It was a single occurrence of the marker byte */
+                if( outpos >= outsize )
+                {
+                    return LZ_ERROR_OUTPUT;
+                }
                 out[ outpos ++ ] = marker;
                 ++ inpos;
             }
             else
             {
                 /* Extract true length and offset */
-                inpos += _LZ_ReadVarSize( &length, &in[ inpos ] );
-                inpos += _LZ_ReadVarSize( &offset, &in[ inpos ] );
+                if( !(num_bytes = _LZ_ReadVarSize( &length, &in[ inpos ], &in[ insize ] )) )
+                {
+                    return LZ_ERROR_INPUT;
+                }
+                inpos += num_bytes;
+                if( !(num_bytes = _LZ_ReadVarSize( &offset, &in[ inpos ], &in[ insize ] )) )
+                {
+                    return LZ_ERROR_INPUT;
+                }
+                inpos += num_bytes;
+
+                if( (offset == 0) || (offset > outpos) )
+                {
+                    return LZ_ERROR_OFFSET;
+                }
+                if( length > outsize - outpos )
+                {
+                    return LZ_ERROR_OUTPUT;
+                }
 
-                /* Copy corresponding data from history window */
-                for( i = 0; i < length; ++ i )
+                /* Copy corresponding data from history window. If the
+                   match overlaps its own output, it repeats the last
+                   'offset' bytes: every block copied doubles the data
+                   that can be copied in one go (a pattern fill). */
+                src = &out[ outpos - offset ];
+                dst = &out[ outpos ];
+                outpos += length;
+                while( length > 0 )
                 {
-                    out[ outpos ] = out[ outpos - offset ];
-                    ++ outpos;
+                    chunk = (unsigned int) (dst - src);
+                    if( chunk > length )
+                    {
+                        chunk = length;
+                    }
+                    memcpy( dst, src, chunk );
+                    dst += chunk;
+                    length -= chunk;
                 }
             }
         }
         else
         {
             /* No marker, plain copy */
+            if( outpos >= outsize )
+            {
+                return LZ_ERROR_OUTPUT;
+            }
             out[ outpos ++ ] = symbol;
         }
     }
-    while( inpos < insize );
 
     return outpos;
 }
@@ -37,13 +37,40 @@ extern "C" {
 #endif
 
 
+/*************************************************************************
+* Working buffer of LZ_CompressHash()
+*************************************************************************/
+
+/* Size of the hash table at the start of the working buffer */
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/* Number of unsigned ints in a working buffer for insize bytes */
+#define LZ_WORK_SIZE(insize) (LZ_HASH_SIZE + (insize))
+
+/* Chain depth used by LZ_CompressFast() */
+#define LZ_DEFAULT_DEPTH 32
+
+
+/*************************************************************************
+* Errors of LZ_Uncompress()
+*************************************************************************/
+
+#define LZ_ERROR_INPUT  -1	/* truncated or invalid code */
+#define LZ_ERROR_OFFSET -2	/* reference before the start of the output */
+#define LZ_ERROR_OUTPUT -3	/* output does not fit into the buffer */
+
+
 /*************************************************************************
 * Function prototypes
 *************************************************************************/
 
 int LZ_Compress( unsigned char *in, unsigned char *out, unsigned int insize );
 int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize);
-int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize );
+int LZ_CompressHash( unsigned char *in, unsigned char *out,
+  unsigned int insize, unsigned int *work, int depth );
+int LZ_Uncompress( unsigned char *in, unsigned char *out,
+  unsigned int insize, unsigned int outsize );
 
 
 #ifdef __cplusplus
@@ -15,16 +15,55 @@
 #include "nibtools.h"
 #include "lz.h"
 #include "prot.h"
+#include "thread.h"
+
+#if defined(_MSC_VER)
+#include <io.h>
+#else
+#include <dirent.h>
+#endif
 
 int _dowildcard = 1;
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_density[MAX_HALFTRACKS_1541 + 2];
-BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
-size_t track_length[MAX_HALFTRACKS_1541 + 2];
-int file_buffer_size;
+/* everything one conversion works on, so several images can be converted at once */
+typedef struct
+{
+	nib_context ctx;
+	BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+	BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+	BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+	BYTE track_density[MAX_HALFTRACKS_1541 + 2];
+	BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
+	size_t track_length[MAX_HALFTRACKS_1541 + 2];
+	int file_buffer_size;
+} conv_image;
+
+/* one line of a batch run */
+typedef struct
+{
+	char inname[256];
+	char outname[256];
+	int result;
+} batch_entry;
+
+#define BATCH_FAILED	0
+#define BATCH_OK		1
+#define BATCH_EXISTS	2
+#define BATCH_DUPLICATE	3
+
+typedef struct
+{
+	batch_entry *entries;
+	int workers;
+} batch_job;
+
+int convert_image(conv_image *image, char *inname, char *outname);
+int batch_convert(char *listname, char *outtemplate, char *summaryname);
+
+conv_image image;
+int batch=0;
+int stream=0;
+char *summaryname=NULL;
 int start_track, end_track, track_inc;
 int reduce_sync, reduce_badgcr, reduce_gap;
 int fix_gcr, align, force_align;
@@ -56,6 +95,8 @@ int old_g64=0;
 int read_killer=1;
 int backwards=0;
 int nb2cycle=0;
+int workers=1;
+nib_context ctx;
 
 int ARCH_MAINDECL
 main(int argc, char **argv)
@@ -80,24 +121,44 @@ main(int argc, char **argv)
 
 	/* default is to reduce sync */
 	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
-	//memset(track_length, 0, MAX_TRACKS_1541+1);
-	for(t=0; t<MAX_TRACKS_1541+1; t++)
-		track_length[t] = NIB_TRACK_LENGTH; // I do not recall why this was done, but left at MAX
 
 	fprintf(stdout,
 		"nibconv - converts a CBM disk image from one format to another.\n"
 		AUTHOR VERSION "\n");
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
-
 	while (--argc && (*(++argv)[0] == '-'))
-		parseargs(argv);
+	{
+		switch ((*argv)[1])
+		{
+		case 'L':
+			batch = 1;
+			if((*argv)[2]) summaryname = &(*argv)[2];
+			printf("* Batch conversion\n");
+			break;
+
+		case 's':
+			stream = 1;
+			printf("* Streaming NIB to G64 conversion\n");
+			break;
+
+		default:
+			parseargs(argv);
+			break;
+		}
+	}
+
+	init_context(&ctx);
 
 	if(argc < 1)	usage();
 
+	if(skip_halftracks) track_inc = 2;
+
+	if(batch)
+	{
+		if(argc < 2) usage();
+		return (batch_convert(argv[0], argv[1], summaryname)) ? 0 : 1;
+	}
+
 	strcpy(inname, argv[0]);
 
 	if(argc < 2)
@@ -123,60 +184,87 @@ main(int argc, char **argv)
 		if(getchar() != 'y') exit(0);
 	}
 
+	image.ctx = ctx;
+	//memset(track_length, 0, MAX_TRACKS_1541+1);
+	for(t=0; t<MAX_TRACKS_1541+1; t++)
+		image.track_length[t] = NIB_TRACK_LENGTH; // I do not recall why this was done, but left at MAX
+
+	if(!(convert_image(&image, inname, outname))) exit(0);
+
+	return 0;
+}
+
+/* converts one image file into another format, returns 0 on failure */
+int
+convert_image(conv_image *image, char *inname, char *outname)
+{
+	nib_context *ctx = &image->ctx;
+	BYTE *track_buffer = image->track_buffer;
+	BYTE *track_density = image->track_density;
+	BYTE *track_alignment = image->track_alignment;
+	size_t *track_length = image->track_length;
+	track_image input;
+	int result;
+
+	/* NIB to G64 can be done a track at a time, images that need all tracks at once are loaded below */
+	if( (stream) && (compare_extension(outname, "G64")) &&
+		((compare_extension(inname, "NIB")) || (compare_extension(inname, "NBZ"))) &&
+		(open_image(&input, ctx, inname, track_buffer, track_density, track_length, track_alignment)) )
+	{
+		result = stream_g64(ctx, &input, outname);
+		close_image(&input);
+		return result;
+	}
+
 	/* convert */
 	if (compare_extension(inname, "D64"))
 	{
-		if(!(read_d64(inname, track_buffer, track_density, track_length))) exit(0);
+		if(!(read_d64(ctx, inname, track_buffer, track_density, track_length))) return 0;
 		//skip_halftracks=1;
 	}
 	else if (compare_extension(inname, "G64"))
 	{
-		if(!(read_g64(inname, track_buffer, track_density, track_length))) exit(0);
-		if(sync_align_buffer) sync_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_g64(ctx, inname, track_buffer, track_density, track_length))) return 0;
+		if(ctx->sync_align_buffer) sync_tracks(ctx, track_buffer, track_density, track_length, track_alignment);
 	}
 	else if (compare_extension(inname, "NBZ"))
 	{
-		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(inname, compressed_buffer))) exit(0);
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
+		if(!(read_nib_file(ctx, inname, image->file_buffer, sizeof(image->file_buffer), track_buffer, track_density, track_length))) return 0;
 		if( (compare_extension(outname, "G64")) || (compare_extension(outname, "D64")) )
-			align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+			align_tracks(ctx, track_buffer, track_density, track_length, track_alignment);
+		search_fat_tracks(ctx, track_buffer, track_density, track_length);
 	}
 	else if (compare_extension(inname, "NIB"))
 	{
-		if(!(file_buffer_size = load_file(inname, file_buffer))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
+		if(!(read_nib_file(ctx, inname, image->file_buffer, sizeof(image->file_buffer), track_buffer, track_density, track_length))) return 0;
 		if( (compare_extension(outname, "G64")) || (compare_extension(outname, "D64")) )
-			align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+			align_tracks(ctx, track_buffer, track_density, track_length, track_alignment);
+		search_fat_tracks(ctx, track_buffer, track_density, track_length);
 	}
 	else if (compare_extension(inname, "NB2"))
 	{
 
-		if(!(read_nb2(inname, track_buffer, track_density, track_length, nb2cycle))) exit(0);
+		if(!(read_nb2(ctx, inname, track_buffer, track_density, track_length, nb2cycle))) return 0;
 		if( (compare_extension(outname, "G64")) || (compare_extension(outname, "D64")) )
-			align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+			align_tracks(ctx, track_buffer, track_density, track_length, track_alignment);
+		search_fat_tracks(ctx, track_buffer, track_density, track_length);
 	}
 	else
 	{
 		printf("Unknown input file type\n");
-		exit(0);
+		return 0;
 	}
 
 	if (compare_extension(outname, "D64"))
 	{
-		if(!(write_d64(outname, track_buffer, track_density, track_length))) exit(0);
+		if(!(write_d64(outname, track_buffer, track_density, track_length))) return 0;
 		printf("\nWARNING!\nConverting to D64 is a lossy conversion.\n");
 		printf("All individual sector header and gap information is lost.\n");
 		printf("It is suggested you use the G64 format for most disks.\n");
 	}
 	else if (compare_extension(outname, "G64"))
 	{
-		if(skip_halftracks) track_inc = 2;
-		if(!(write_g64(outname, track_buffer, track_density, track_length))) exit(0);
+		if(!(write_g64(ctx, outname, track_buffer, track_density, track_length))) return 0;
 
 		if (compare_extension(inname, "D64"))
 		{
@@ -195,33 +283,294 @@ main(int argc, char **argv)
 		if( (compare_extension(inname, "D64")) ||
 			(compare_extension(inname, "G64")))
 		{
-			rig_tracks(track_buffer, track_density, track_length, track_alignment);
+			rig_tracks(ctx, track_buffer, track_density, track_length, track_alignment);
 		}
 
-		if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) exit(0);
+		if(!(image->file_buffer_size = write_nib(image->file_buffer, track_buffer, track_density, track_length))) return 0;
 
 		if (compare_extension(outname, "NBZ"))
 		{
-			if(!(file_buffer_size = LZ_CompressFast(file_buffer, compressed_buffer, file_buffer_size))) exit(0);
-			if(!(save_file(outname, compressed_buffer, file_buffer_size))) exit(0);
+			if(!(image->file_buffer_size = pack_nbz(ctx, image->file_buffer, image->file_buffer_size, image->compressed_buffer))) return 0;
+			if(!(save_file(outname, image->compressed_buffer, image->file_buffer_size))) return 0;
 		}
 		else
 		{
-			if(!(save_file(outname, file_buffer, file_buffer_size))) exit(0);
+			if(!(save_file(outname, image->file_buffer, image->file_buffer_size))) return 0;
 		}
 	}
 	else if (compare_extension(outname, "NB2"))
 	{
 		printf("Output to NB2 format makes no sense from this input file.\n");
-		exit(0);
+		return 0;
 	}
 	else
 	{
 		printf("Unknown output file type\n");
-		exit(0);
+		return 0;
 	}
 
-	return 0;
+	return 1;
+}
+
+static int
+batch_image(char *filename)
+{
+	return ( (compare_extension(filename, "NIB")) || (compare_extension(filename, "NBZ")) ||
+		(compare_extension(filename, "NB2")) || (compare_extension(filename, "G64")) ||
+		(compare_extension(filename, "D64")) );
+}
+
+static int
+batch_add(batch_entry **entries, int *count, int *size, char *inname)
+{
+	if(strlen(inname) >= sizeof((*entries)->inname))
+	{
+		printf("Filename too long: %s\n", inname);
+		return 1;
+	}
+
+	if(*count == *size)
+	{
+		*size = (*size) ? (*size) * 2 : 256;
+		if(!(*entries = realloc(*entries, *size * sizeof(batch_entry))))
+		{
+			printf("Could not allocate memory for file list\n");
+			return 0;
+		}
+	}
+
+	memset(&(*entries)[*count], 0, sizeof(batch_entry));
+	strcpy((*entries)[*count].inname, inname);
+	(*count)++;
+	return 1;
+}
+
+static int
+batch_compare_in(const void *a, const void *b)
+{
+	return strcmp(((const batch_entry *) a)->inname, ((const batch_entry *) b)->inname);
+}
+
+static int
+batch_compare(const void *a, const void *b)
+{
+	const batch_entry *e1 = *(const batch_entry **) a;
+	const batch_entry *e2 = *(const batch_entry **) b;
+	int c;
+
+	if((c = strcmp(e1->outname, e2->outname)) != 0)
+		return c;
+	return (e1 < e2) ? -1 : (e1 > e2);
+}
+
+/* reads input names from a directory, or else from a list file with one name per line */
+static int
+batch_list(char *listname, batch_entry **entries)
+{
+	char line[0x200];
+	char *end;
+	FILE *fp;
+	int count = 0, size = 0;
+#if defined(_MSC_VER)
+	struct _finddata_t found;
+	intptr_t dir;
+
+	sprintf(line, "%.255s/*.*", listname);
+	if((dir = _findfirst(line, &found)) != -1)
+	{
+		do
+		{
+			if((found.attrib & _A_SUBDIR) || (!batch_image(found.name))) continue;
+			sprintf(line, "%.255s/%.255s", listname, found.name);
+			if(!batch_add(entries, &count, &size, line)) break;
+		} while (_findnext(dir, &found) == 0);
+		_findclose(dir);
+
+		/* directory order is arbitrary, keep runs repeatable */
+		qsort(*entries, count, sizeof(batch_entry), batch_compare_in);
+		return count;
+	}
+#else
+	struct dirent *found;
+	DIR *dir;
+
+	if((dir = opendir(listname)) != NULL)
+	{
+		while((found = readdir(dir)) != NULL)
+		{
+			if(!batch_image(found->d_name)) continue;
+			sprintf(line, "%.255s/%.255s", listname, found->d_name);
+			if(!batch_add(entries, &count, &size, line)) break;
+		}
+		closedir(dir);
+
+		/* directory order is arbitrary, keep runs repeatable */
+		qsort(*entries, count, sizeof(batch_entry), batch_compare_in);
+		return count;
+	}
+#endif
+
+	if((fp = fopen(listname, "r")) == NULL)
+	{
+		printf("Couldn't open file list %s!\n", listname);
+		return 0;
+	}
+
+	while(fgets(line, sizeof(line), fp))
+	{
+		end = line + strlen(line);
+		while((end > line) && ((end[-1] == '\n') || (end[-1] == '\r') || (end[-1] == ' ')))
+			*(--end) = '\0';
+
+		if((!line[0]) || (line[0] == '#')) continue;
+		if(!batch_add(entries, &count, &size, line)) break;
+	}
+	fclose(fp);
+	return count;
+}
+
+/* output name is the template with '%s' replaced by the input name without path and extension */
+static int
+batch_outname(char *outname, char *outtemplate, char *inname)
+{
+	char base[256];
+	char *pos, *dotpos;
+
+	if((pos = strrchr(inname, '/')) != NULL) inname = pos + 1;
+	if((pos = strrchr(inname, '\\')) != NULL) inname = pos + 1;
+
+	strcpy(base, inname);
+	dotpos = strrchr(base, '.');
+	if (dotpos != NULL) *dotpos = '\0';
+
+	pos = strstr(outtemplate, "%s");
+	if(strlen(outtemplate) - 2 + strlen(base) >= 256)
+	{
+		printf("Output name for %s is too long, skipped\n", inname);
+		outname[0] = '\0';
+		return 0;
+	}
+
+	sprintf(outname, "%.*s%s%s", (int)(pos - outtemplate), outtemplate, base, pos + 2);
+	return 1;
+}
+
+static void
+batch_image_job(void *arg, int job)
+{
+	batch_job *bjob = (batch_job *) arg;
+	batch_entry *entry = &bjob->entries[job];
+	conv_image *conv;
+	FILE *fp;
+	int t;
+
+	/* no output name or another input writes the same image */
+	if((entry->result == BATCH_DUPLICATE) || (!entry->outname[0]))
+		return;
+
+	/* never ask, an existing image is left alone */
+	if( (fp=fopen(entry->outname,"r")) )
+	{
+		fclose(fp);
+		entry->result = BATCH_EXISTS;
+		return;
+	}
+
+	if(!(conv = calloc(1, sizeof(conv_image))))
+	{
+		printf("Could not allocate memory for %s\n", entry->inname);
+		entry->result = BATCH_FAILED;
+		return;
+	}
+
+	conv->ctx = ctx;
+	if(bjob->workers > 1) conv->ctx.workers = 1;
+	for(t=0; t<MAX_TRACKS_1541+1; t++)
+		conv->track_length[t] = NIB_TRACK_LENGTH;
+
+	printf("Converting %s -> %s\n\n", entry->inname, entry->outname);
+	entry->result = (convert_image(conv, entry->inname, entry->outname)) ? BATCH_OK : BATCH_FAILED;
+	free(conv);
+}
+
+/* converts all images of a list file or directory, images are spread over the worker threads */
+int
+batch_convert(char *listname, char *outtemplate, char *summaryname)
+{
+	static const char *results[] = { "FAILED", "OK", "EXISTS", "DUPLICATE" };
+	batch_entry *entries = NULL, **sorted;
+	batch_job bjob;
+	FILE *summary = stdout;
+	int i, count, total[4] = { 0, 0, 0, 0 };
+
+	if(!strstr(outtemplate, "%s"))
+	{
+		printf("Output template must contain '%%s' for the input name\n");
+		return 0;
+	}
+
+	if(!(count = batch_list(listname, &entries)))
+	{
+		printf("No images to convert\n");
+		free(entries);
+		return 0;
+	}
+
+	/* an entry without an output name stays failed */
+	for(i = 0; i < count; i++)
+	{
+		entries[i].result = BATCH_FAILED;
+		batch_outname(entries[i].outname, outtemplate, entries[i].inname);
+	}
+
+	/* two inputs for one output would overwrite each other, only the first is converted */
+	if((sorted = malloc(count * sizeof(batch_entry *))) != NULL)
+	{
+		for(i = 0; i < count; i++)
+			sorted[i] = &entries[i];
+		qsort(sorted, count, sizeof(batch_entry *), batch_compare);
+		for(i = 1; i < count; i++)
+			if((sorted[i]->outname[0]) && (!strcmp(sorted[i]->outname, sorted[i-1]->outname)))
+				sorted[i]->result = BATCH_DUPLICATE;
+		free(sorted);
+	}
+
+	bjob.entries = entries;
+	bjob.workers = ctx.workers;
+
+	/* images share the align_map defaults, but the RapidLok handler keeps state of its own */
+	if(rapidlok_aligned(&ctx))
+		bjob.workers = 1;
+
+	printf("Converting %d images with %d threads\n\n", count, bjob.workers);
+	init_GCR_tables();
+	run_jobs(batch_image_job, &bjob, count, bjob.workers);
+
+	if( (summaryname) && ((summary = fopen(summaryname, "w")) == NULL) )
+	{
+		printf("Couldn't create summary file %s!\n", summaryname);
+		summary = stdout;
+	}
+
+	if(summary == stdout) printf("\n");
+	for(i = 0; i < count; i++)
+	{
+		total[entries[i].result]++;
+		fprintf(summary, "%-9s %s -> %s\n", results[entries[i].result], entries[i].inname,
+			(entries[i].outname[0]) ? entries[i].outname : "(output name too long)");
+	}
+	fprintf(summary, "%d images: %d converted, %d failed, %d existing, %d duplicate\n",
+		count, total[BATCH_OK], total[BATCH_FAILED], total[BATCH_EXISTS], total[BATCH_DUPLICATE]);
+
+	if(summary != stdout)
+	{
+		fclose(summary);
+		printf("\n%d images: %d converted, %d failed, %d existing, %d duplicate\n",
+			count, total[BATCH_OK], total[BATCH_FAILED], total[BATCH_EXISTS], total[BATCH_DUPLICATE]);
+	}
+
+	free(entries);
+	return (total[BATCH_FAILED] == 0);
 }
 
 void
@@ -229,11 +578,16 @@ usage(void)
 {
 	printf(
 	"usage: nibconv [options] <infile>.ext1 <outfile>.ext2\n"
+	"       nibconv [options] -L[summary] <listfile or directory> <outfile template>\n"
 	"\nsupported file extensions for ext1:\n"
 	"NIB, NB2, D64, G64\n"
 	"\nsupported file extensions for ext2:\n"
 	"D64, G64\n"
-	"\noptions:\n");
+	"\nbatch mode converts all images listed in a file or found in a directory,\n"
+	"'%%s' in the template is replaced by each input name (e.g. out/%%s.g64)\n"
+	"\noptions:\n"
+	" -L[file]: Batch conversion, write summary to 'file'\n"
+	" -s: Convert NIB/NBZ to G64 one track at a time, using little memory\n");
 
 	switchusage();
 	exit(1);
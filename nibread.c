@@ -15,6 +15,8 @@
 #include "gcr.h"
 #include "nibtools.h"
 #include "lz.h"
+#include "thread.h"
+#include "telemetry.h"
 
 int _dowildcard = 1;
 
@@ -70,6 +72,11 @@ int fattrack=0;
 int old_g64=0;
 int backwards=0;
 int nb2cycle=0;
+int workers=1;
+int pipeline=0;
+int benchmark=0;
+int benchmark_writes=0;
+nib_context ctx;
 
 BYTE density_map;
 float motor_speed;
@@ -94,10 +101,7 @@ main(int argc, char *argv[])
 	if (argc < 2)
 		usage();
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
+	/* the static buffers start zeroed, clearing them again would only make all of them resident */
 
 #ifdef DJGPP
 	fd = 1;
@@ -155,6 +159,18 @@ main(int argc, char *argv[])
 		case 's':
 			break;
 
+		case 'N':
+			pipeline = 1;
+			printf("* Analyze each track while reading the next one\n");
+			break;
+
+		case 'J':
+			workers = atoi(&(*argv)[2]);
+			if(!workers) workers = cpu_count();
+			if(workers > MAX_WORKER_THREADS) workers = MAX_WORKER_THREADS;
+			printf("* Process tracks with %d threads\n", workers);
+			break;
+
 		case 'j':
 			printf("* 1541/1571 Index Hole Sensor (SC+ compatible)\n");
 			Use_SCPlus_IHS = 1;
@@ -276,6 +292,19 @@ main(int argc, char *argv[])
 			cap_min_ignore = 1;
 			break;
 
+		case 'W':
+			timing_file = &(*argv)[2];
+			printf("* Log track timing to %s\n", timing_file);
+			break;
+
+		case 'X':
+			if ((*argv)[2] == 'w')
+				benchmark_writes = 1;
+			benchmark = atoi(&(*argv)[2 + benchmark_writes]);
+			if (!benchmark) benchmark = 100;
+			printf("* Benchmark transfers %d times%s\n", benchmark, (benchmark_writes) ? ", writing track 41.5" : "");
+			break;
+
 		default:
 			usage();
 			break;
@@ -283,29 +312,41 @@ main(int argc, char *argv[])
 	}
 	printf("\n");
 
-	if(argc < 1) usage();
-	strcpy(filename, argv[0]);
+	init_context(&ctx);
+
+	/* the benchmark needs no image */
+	if((argc < 1) && (!benchmark)) usage();
+	strcpy(filename, (argc < 1) ? "" : argv[0]);
 
-	if( (fp=fopen(filename,"r")) )
+	if( (!benchmark) && (fp=fopen(filename,"r")) )
 	{
 		fclose(fp);
 		printf("File exists - Overwrite? (y/N)");
 		if(getchar() != 'y') exit(0);
 	}
 
+	/* -@sim:<image> runs on a virtual drive, see simdrive.c */
+	if (!strncmp(cbm_adapter, "sim:", 4))
+	{
+		if (!sim_open(cbm_adapter + 4))
+			exit(0);
+	}
 #ifdef DJGPP
-	calibrate();
-	if (!detect_ports(reset))
-		return 0;
+	else
+	{
+		calibrate();
+		if (!detect_ports(reset))
+			return 0;
+	}
 #elif defined(OPENCBM_42)
 	/* remain compatible with OpenCBM < 0.4.99 */
-	if (cbm_driver_open(&fd, 0) != 0)
+	else if (cbm_driver_open(&fd, 0) != 0)
 	{
 		printf("Is your X-cable properly configured?\n");
 		exit(0);
 	}
 #else /* assume > 0.4.99 */
-	if (cbm_driver_open_ex(&fd, cbm_adapter) != 0)
+	else if (cbm_driver_open_ex(&fd, cbm_adapter) != 0)
 	{
 		printf("Is your X-cable properly configured?\n");
 		exit(0);
@@ -332,6 +373,12 @@ main(int argc, char *argv[])
 		exit(0);
 	}
 
+	if (benchmark)
+	{
+		benchmark_transfers(fd, benchmark, benchmark_writes);
+		exit(0);
+	}
+
 	if(align_report)
 		TrackAlignmentReport(fd);
 
@@ -351,6 +398,9 @@ main(int argc, char *argv[])
 	fprintf(fplog, "%s\n", VERSION);
 	fprintf(fplog, "'%s'\n", argcache);
 
+	if ((timing_file) && (!open_timing(timing_file, "nibread")))
+		exit(2);
+
 	if(strrchr(filename, '.') == NULL)  strcat(filename, ".nbz");
 
 	if((compare_extension(filename, "D64")) || (compare_extension(filename, "G64")))
@@ -405,6 +455,7 @@ main(int argc, char *argv[])
 	motor_on(fd);
 	step_to_halftrack(fd, 18*2);
 
+	close_timing();
 	if(fplog) fclose(fplog);
 
 	exit(0);
@@ -475,7 +526,7 @@ int disk2file(CBM_FILE fd, char *filename)
 	{
 		if(!(read_floppy(fd, track_buffer, track_density, track_length))) return 0;
 		if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) return 0;
-		if(!(file_buffer_size = LZ_CompressFast(file_buffer, compressed_buffer, file_buffer_size))) return 0;
+		if(!(file_buffer_size = pack_nbz(&ctx, file_buffer, file_buffer_size, compressed_buffer))) return 0;
 		if(!(save_file(filename, compressed_buffer, file_buffer_size))) return 0;
 
 		if(interactive_mode)
@@ -497,7 +548,7 @@ int disk2file(CBM_FILE fd, char *filename)
 
 				if(!(read_floppy(fd, track_buffer, track_density, track_length))) return 0;
 				if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) return 0;
-				if(!(file_buffer_size = LZ_CompressFast(file_buffer, compressed_buffer, file_buffer_size))) return 0;
+				if(!(file_buffer_size = pack_nbz(&ctx, file_buffer, file_buffer_size, compressed_buffer))) return 0;
 				if(!(save_file(newfilename, compressed_buffer, file_buffer_size))) return 0;
 			}
 		}
@@ -511,6 +562,7 @@ usage(void)
 {
 	printf("usage: nibread [options] <filename>\n\n"
 		 " -@x: Use OpenCBM device 'x' (xa1541, xum1541:0, xum1541:1, etc.)\n"
+		 " -@sim:<image>[,rpm=n,...]: Use a virtual drive with <image> as the disk\n"
 	     " -D[n]: Use drive #[n]\n"
 	     " -e[n]: Retry reading tracks with errors [n] times\n"
 	     " -S[n]: Override starting track\n"
@@ -525,6 +577,11 @@ usage(void)
 	     " -V: Verbose (output more detailed track data)\n"
 	     " -h: Read halftracks\n"
 	     " -t: Extended parallel port tests\n"
+	     " -N: Analyze each track while the drive reads the next one\n"
+	     " -W<file>: Log the time of each track step to <file> (JSON Lines, or CSV for *.csv)\n"
+	     " -X[n]: Benchmark transfers over the cable [n] times, then exit (default: 100)\n"
+	     " -Xw[n]: Benchmark with track writes too (destroys track 41.5)\n"
+	     " -J[n]: Process tracks with 'n' threads (default: all CPUs)\n"
 	     " -j: Use Index Hole Sensor  (1541/1571 SC+ compatible IHS)\n"
 	     " -x: Track Alignment Report (1541/1571 SC+ compatible IHS)\n"
 	     " -y: Deep Bitrate Analysis  (1541/1571 SC+ compatible IHS)\n"
@@ -26,13 +26,11 @@
 
 int _dowildcard = 1;
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_density[MAX_HALFTRACKS_1541 + 2];
 BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
 size_t track_length[MAX_HALFTRACKS_1541 + 2];
-int file_buffer_size;
 int start_track, end_track, track_inc;
 int reduce_sync, reduce_badgcr, reduce_gap;
 int fix_gcr, align, force_align;
@@ -64,10 +62,12 @@ int old_g64=0;
 int read_killer=1;
 int backwards=0;
 int nb2cycle=0;
+int workers=1;
+nib_context ctx;
 
 /* local prototypes */
 int repair(void);
-BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector, BYTE *id);
+BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector, BYTE *id, sector_index *index);
 
 int ARCH_MAINDECL
 main(int argc, char **argv)
@@ -92,10 +92,7 @@ main(int argc, char **argv)
 		"nibrepair - converts a damaged NIB/NB2/G64 to a new 'repaired' G64 file.\n"
 		AUTHOR VERSION "\n");
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
+	/* the static buffers start zeroed, clearing them again would only make all of them resident */
 
 	/* default is to reduce sync */
 	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
@@ -103,6 +100,8 @@ main(int argc, char **argv)
 	while (--argc && (*(++argv)[0] == '-'))
 		parseargs(argv);
 
+	init_context(&ctx);
+
 	if(argc < 1)	usage();
 	strcpy(inname, argv[0]);
 
@@ -116,31 +115,27 @@ main(int argc, char **argv)
 	/* convert */
 	if (compare_extension(inname, "G64"))
 	{
-		if(!(read_g64(inname, track_buffer, track_density, track_length))) exit(0);
-		if(sync_align_buffer)	sync_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_g64(&ctx, inname, track_buffer, track_density, track_length))) exit(0);
+		if(ctx.sync_align_buffer)	sync_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
 	}
 	else if (compare_extension(inname, "NBZ"))
 	{
-		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(inname, compressed_buffer))) exit(0);
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_nib_file(&ctx, inname, file_buffer, sizeof(file_buffer), track_buffer, track_density, track_length))) exit(0);
+		align_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
 	}
 	else if (compare_extension(inname, "NIB"))
 	{
-		if(!(file_buffer_size = load_file(inname, file_buffer))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_nib_file(&ctx, inname, file_buffer, sizeof(file_buffer), track_buffer, track_density, track_length))) exit(0);
+		align_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
 	}
 	else if (compare_extension(inname, "NB2"))
 	{
-		if(!(read_nb2(inname, track_buffer, track_density, track_length, nb2cycle))) exit(0);
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_nb2(&ctx, inname, track_buffer, track_density, track_length, nb2cycle))) exit(0);
+		align_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
 	}
 	else if (compare_extension(inname, "D64"))
 	{
-		if(!(read_d64(inname, track_buffer, track_density, track_length))) exit(0);
+		if(!(read_d64(&ctx, inname, track_buffer, track_density, track_length))) exit(0);
 	}
 	else
 	{
@@ -151,7 +146,7 @@ main(int argc, char **argv)
 	if(skip_halftracks) track_inc = 2;
 
 	repair();
-	write_g64(outname, track_buffer, track_density, track_length);
+	write_g64(&ctx, outname, track_buffer, track_density, track_length);
 
 	return 0;
 }
@@ -162,6 +157,7 @@ int repair(void)
 	int blockindex = 0;
 	BYTE id[3];
 	BYTE errorinfo[MAXBLOCKSONDISK], errorcode;
+	sector_index index;
 
 	printf("\nScanning for errors...\n");
 
@@ -174,19 +170,23 @@ int repair(void)
 
 	for (track = start_track; track <= 35*2 /*end_track*/; track += track_inc)
 	{
+		/* repairs patch bytes in place, so header positions stay valid */
+		index_GCR_sectors(track_buffer + (track * NIB_TRACK_LENGTH),
+			track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track], track/2, &index);
+
 		for (sector = 0; sector < sector_map[track/2]; sector++)
 		{
 				//firstpass
 				errorcode = repair_GCR_sector(track_buffer + (track * NIB_TRACK_LENGTH),
 																		track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-																		track/2, sector, id);
+																		track/2, sector, id, &index);
 
 				//secondpass
 				if(errorcode != SECTOR_OK)
 				{
 					errorcode = repair_GCR_sector(track_buffer + (track * NIB_TRACK_LENGTH),
 																		track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-																		track/2, sector, id);
+																		track/2, sector, id, &index);
 				}
 
 				errorinfo[blockindex] = errorcode;
@@ -221,7 +221,7 @@ int repair(void)
 	return 0;
 }
 
-BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector, BYTE *id)
+BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector, BYTE *id, sector_index *index)
 {
 
 	/* Try to repair some common GCR errors
@@ -236,11 +236,11 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 	BYTE hdr_chksum;	/* header checksum */
 	BYTE blk_chksum;	/* block  checksum */
 	BYTE *gcr_ptr, *gcr_end, *gcr_last;
-	BYTE *sectordata;
 	BYTE error_code;
     int i, j;
     size_t track_len;
     BYTE d64_sector[260];
+    BYTE badmap[BAD_GCR_MAP_BYTES(320)];
     int answer;
 
 	error_code = SECTOR_OK;
@@ -269,58 +269,56 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
             gcr_last = gcr_ptr;
    }
 
-	/* Try to find block header for Track/Sector */
 	/* Try to find a good block header for Track/Sector */
-	error_code = HEADER_NOT_FOUND;
-
-	for (gcr_ptr = gcr_start; gcr_ptr < gcr_end - 10; gcr_ptr++)
+	if (!index->header_pos[sector])
 	{
-		if ((gcr_ptr[0] == 0xff) && (gcr_ptr[1] == 0x52))
+		/* the index keeps only good headers, show the damaged ones */
+		if(ctx.verbose)
 		{
-			gcr_ptr++;
-			memset(header, 0, 10);
-			convert_4bytes_from_GCR(gcr_ptr, header);
-			convert_4bytes_from_GCR(gcr_ptr+5, header+4);
-
-			if ((header[0] == 0x08) &&
-				(header[2] == sector) &&
-				(header[3] == track) )
+			for (gcr_ptr = gcr_start; gcr_ptr < gcr_end - 10; gcr_ptr++)
 			{
-				/* this is the header we are searching for */
-				error_code = SECTOR_OK;
-				break;
-			}
+				if ((gcr_ptr[0] != 0xff) || (gcr_ptr[1] != 0x52))
+					continue;
 
-			if((header[3]>35)&(verbose)) printf(" Header damaged - Track %d out of range\n", header[3]);
-			if((header[2]>21)&(verbose)) printf(" Header damaged - Sector %d out of range\n", header[2]);
+				convert_block_from_GCR(gcr_ptr + 1, header, 2);
+				if ((header[0] == 0x08) && (header[3] == track))
+					continue;
 
-			if(verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
-				gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
+				if(header[3]>35) printf(" Header damaged - Track %d out of range\n", header[3]);
+				if(header[2]>21) printf(" Header damaged - Sector %d out of range\n", header[2]);
+
+				if(ctx.verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
+					gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], gcr_ptr[6], header[0], header[3], header[2]);
+			}
 		}
+		return HEADER_NOT_FOUND;
 	}
 
-	if(error_code != SECTOR_OK)
-		return error_code;
+	/* decode again, an earlier pass may have patched it */
+	gcr_ptr = gcr_start + index->header_pos[sector];
+	memset(header, 0, 10);
+	convert_block_from_GCR(gcr_ptr, header, 2);
+
+	if(ctx.verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
+		gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5],
+		index->header[sector][0], index->header[sector][3], index->header[sector][2]);
 
-	/* Header checksum */
+	/* Header checksum, header[1] is the XOR of sector, track and ID */
 	hdr_chksum = 0;
-	for (i = 1; i <= 4; i++)
+	for (i = 2; i <= 5; i++)
 		hdr_chksum = hdr_chksum ^ header[i];
 
-	if (hdr_chksum != header[5])
+	if (hdr_chksum != header[1])
 	{
-		printf("T%dS%d Bad Header Checksum $%.2x != $%.2x - Repair (Y/n)? ", track, sector, hdr_chksum, header[5]);
+		printf("T%dS%d Bad Header Checksum $%.2x != $%.2x - Repair (Y/n)? ", track, sector, hdr_chksum, header[1]);
 		fflush(stdin);
 		answer = getchar();
 
 		if(answer != 'n')
 		{
 			/* patch back */
-			header[5] = hdr_chksum;
-			gcr_ptr--;
-			convert_4bytes_from_GCR(header, gcr_ptr);
-			convert_4bytes_from_GCR(header + 4, gcr_ptr + 5);
-			gcr_ptr++;
+			header[1] = hdr_chksum;
+			convert_block_to_GCR(header, gcr_ptr, 2);
 			printf("Repaired\n");
 		}
 		else
@@ -330,26 +328,25 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 	}
 
 	/* verify that our header contains no bad GCR, since it can be false positive checksum match */
-	for(j = 0; j < 10; j++)
-		if (is_bad_gcr(gcr_ptr - 1, 10, j)) error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
+	if (bad_gcr_map(gcr_ptr - 1, 10, badmap)) error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
 
 	/* check for data sector */
 	if (!find_sync(&gcr_ptr, gcr_end))
 		return (DATA_NOT_FOUND);
 
-	for (i = 0, sectordata = d64_sector; i < 65; i++)
-	{
-		if (gcr_ptr >= gcr_end - 5)
-			return (DATA_NOT_FOUND);  /* short sector */
+	if (gcr_ptr + 325 >= gcr_end)
+		return (DATA_NOT_FOUND);  /* short sector */
 
-		convert_4bytes_from_GCR(gcr_ptr, sectordata);
-		gcr_ptr += 5;
-		sectordata += 4;
-	}
+	convert_block_from_GCR(gcr_ptr, d64_sector, 65);
+	gcr_ptr += 325;
 
 	/* check for correct disk ID */
 	if (header[5] != id[0] || header[4] != id[1])
+	{
+		if(ctx.verbose) printf("T%dS%d Header damaged - ID $%.2x%.2x != $%.2x%.2x\n",
+			track, sector, header[5], header[4], id[0], id[1]);
 		error_code = (error_code == SECTOR_OK) ? ID_MISMATCH : error_code;
+	}
 
 	/* check for Block header mark */
 	if (d64_sector[0] != 0x07)
@@ -370,12 +367,8 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 			/* patch back */
 			d64_sector[257] = blk_chksum;
 			gcr_ptr -= 325;
-			for (i = 0, sectordata = d64_sector; i < 65; i++)
-			{
-				convert_4bytes_to_GCR(sectordata, gcr_ptr);
-				gcr_ptr += 5;
-				sectordata += 4;
-			}
+			convert_block_to_GCR(d64_sector, gcr_ptr, 65);
+			gcr_ptr += 325;
 			printf("Checksum Patched\n");
 		}
 		else if(answer == 'd')
@@ -401,8 +394,7 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 	}
 
 	/* verify that our data contains no bad GCR, since it can be false positive checksum match */
-	for(j = 0; j < 320; j++)
-		if (is_bad_gcr(gcr_ptr - 325, 320, j)) error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
+	if (bad_gcr_map(gcr_ptr - 325, 320, badmap)) error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
 
 	return (error_code);
 }
@@ -21,6 +21,7 @@ int _dowildcard = 1;
 char bitrate_range[4] = { 43 * 2, 31 * 2, 25 * 2, 18 * 2 };
 
 int load_image(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int load_image_range(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, int from, int to);
 int compare_disks(void);
 int scandisk(void);
 int raw_track_info(BYTE *gcrdata, size_t length);
@@ -28,7 +29,6 @@ int dump_headers(BYTE * gcrdata, size_t length);
 size_t check_fat(int track);
 size_t check_rapidlok(int track);
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_buffer2[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
@@ -44,9 +44,8 @@ size_t rapidlok_tracks[MAX_HALFTRACKS_1541 + 2];
 size_t badgcr_tracks[MAX_HALFTRACKS_1541 + 2];
 
 int start_track, end_track, track_inc;
-int imagetype, mode;
+int imagetype, mode, dir_only, sector_list;
 int align, force_align;
-int file_buffer_size;
 int fix_gcr;
 int reduce_sync;
 int reduce_badgcr;
@@ -79,12 +78,49 @@ int old_g64=0;
 int read_killer=1;
 int backwards=0;
 int nb2cycle=0;
+int workers=1;
+nib_context ctx;
 
-unsigned char md5_hash_result[16];
-unsigned char md5_dir_hash_result[16];
-unsigned char md5_hash_result2[16];
-unsigned char md5_dir_hash_result2[16];
-int crc, crc_dir, crc2, crc2_dir;
+disk_digest digest, digest2;
+int crc;
+
+static void
+print_md5(char *label, unsigned char *hash)
+{
+	int i;
+
+	printf("%s0x", label);
+	for (i = 0; i < 16; i++)
+		printf("%02x", hash[i]);
+	printf("\n");
+}
+
+/* CRC32 of every decoded sector, or only those that differ from a second disk */
+static void
+print_sectors(disk_digest *digest, disk_digest *other)
+{
+	int track, sector, index;
+
+	index = 0;
+	for (track = start_track; track <= 35*2; track += 2)
+	{
+		for (sector = 0; (sector < sector_map[track/2]) && (index < digest->sectors); sector++, index++)
+		{
+			if (other)
+			{
+				if (digest->sector_crc[index] != other->sector_crc[index])
+					printf("T%dS%d differs: 0x%08X != 0x%08X\n", track/2, sector,
+						digest->sector_crc[index], other->sector_crc[index]);
+				continue;
+			}
+
+			printf("T%.2dS%.2d\t0x%08X", track/2, sector, digest->sector_crc[index]);
+			if (digest->sector_error[index] != SECTOR_OK)
+				printf("\t(error $%.2x)", digest->sector_error[index]);
+			printf("\n");
+		}
+	}
+}
 
 int ARCH_MAINDECL
 main(int argc, char *argv[])
@@ -116,17 +152,32 @@ main(int argc, char *argv[])
 	if (argc < 2)
 		usage();
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
-	memset(track_buffer2, 0x00, sizeof(track_buffer2));
+	/* the static buffers start zeroed, clearing them again would only make all of them resident */
 
 	/* default is to reduce sync */
 	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
 
 	while (--argc && (*(++argv)[0] == '-'))
-		parseargs(argv);
+	{
+		switch ((*argv)[1])
+		{
+		case 'q':
+			dir_only = 1;
+			printf("* BAM/DIR CRC only\n");
+			break;
+
+		case 'l':
+			sector_list = 1;
+			printf("* List the CRC of every sector\n");
+			break;
+
+		default:
+			parseargs(argv);
+			break;
+		}
+	}
+
+	init_context(&ctx);
 
 	if (argc < 0)	usage();
 	strcpy(file1, argv[0]);
@@ -148,94 +199,79 @@ main(int argc, char *argv[])
 		/* disk 1 */
 		//if(verbose) printf("1: %s\n", file1);
 
-		crc_dir = crc_dir_track(track_buffer, track_length);
-		if(verbose) printf("BAM/DIR CRC:\t\t\t0x%X\n", crc_dir);
-		crc = crc_all_tracks(track_buffer, track_length);
-		if(verbose) printf("Full CRC:\t\t\t0x%X\n", crc);
-
-		//memset(md5_dir_hash_result, 0 , sizeof(md5_dir_hash_result));
-		//md5_dir_track(track_buffer, track_length, md5_dir_hash_result);
-		//if(verbose) printf("BAM/DIR MD5:\t\t\t0x");
-		//for (i = 0; i < 16; i++)
-		// 	if(verbose) printf ("%02x", md5_dir_hash_result[i]);
-		//if(verbose) printf("\n");
-
-		//memset(md5_hash_result, 0 , sizeof(md5_hash_result));
-		//md5_all_tracks(track_buffer, track_length, md5_hash_result);
-		//if(verbose) printf("Full MD5:\t\t\t0x");
-		//for (i = 0; i < 16; i++)
-		//	if(verbose) printf ("%02x", md5_hash_result[i]);
-		//if(verbose) printf("\n");
+		digest_disk(track_buffer, track_length, &digest);
+		if(verbose)
+		{
+			printf("BAM/DIR CRC:\t\t\t0x%X\n", digest.dir_crc);
+			if(digest.sectors != digest.valid) printf("[%d/%d sectors] ", digest.valid, digest.sectors);
+			printf("Full CRC:\t\t\t0x%X\n", digest.all_crc);
+			print_md5("BAM/DIR MD5:\t\t\t", digest.dir_md5);
+			print_md5("Full MD5:\t\t\t", digest.all_md5);
+		}
 
 		/* disk 2 */
 		//if(verbose) printf("2: %s\n", file2);
 
-		crc2_dir = crc_dir_track(track_buffer2, track_length2);
-		if(verbose) printf("BAM/DIR CRC:\t\t\t0x%X\n", crc2_dir);
-		crc2 = crc_all_tracks(track_buffer2, track_length2);
-		if(verbose) printf("Full CRC:\t\t\t0x%X\n", crc2);
-
-		//memset(md5_dir_hash_result2, 0 , sizeof(md5_dir_hash_result2));
-		//md5_dir_track(track_buffer2, track_length2, md5_dir_hash_result2);
-		//if(verbose) printf("BAM/DIR MD5:\t\t\t0x");
-		//for (i = 0; i < 16; i++)
-		// 	if(verbose) printf ("%02x", md5_dir_hash_result2[i]);
-		//if(verbose) printf("\n");
-
-		//memset(md5_hash_result2, 0 , sizeof(md5_hash_result2));
-		//md5_all_tracks(track_buffer2, track_length2, md5_hash_result2);
-		//if(verbose) printf("Full MD5:\t\t\t0x");
-		//for (i = 0; i < 16; i++)
-		//	if(verbose) printf ("%02x", md5_hash_result2[i]);
-		//if(verbose) printf("\n\n");
+		digest_disk(track_buffer2, track_length2, &digest2);
+		if(verbose)
+		{
+			printf("BAM/DIR CRC:\t\t\t0x%X\n", digest2.dir_crc);
+			if(digest2.sectors != digest2.valid) printf("[%d/%d sectors] ", digest2.valid, digest2.sectors);
+			printf("Full CRC:\t\t\t0x%X\n", digest2.all_crc);
+			print_md5("BAM/DIR MD5:\t\t\t", digest2.dir_md5);
+			print_md5("Full MD5:\t\t\t", digest2.all_md5);
+			printf("\n");
+		}
 
 		/* compare summary */
-		if(crc_dir == crc2_dir)
-			printf("BAM/DIR CRC matches : 0x%X\n", crc_dir);
+		if(digest.dir_crc == digest2.dir_crc)
+			printf("BAM/DIR CRC matches : 0x%X\n", digest.dir_crc);
 		else
-			printf("BAM/DIR CRC does not match! 0x%X != 0x%X\n", crc_dir, crc2_dir);
+			printf("BAM/DIR CRC does not match! 0x%X != 0x%X\n", digest.dir_crc, digest2.dir_crc);
 
-		//if( memcmp(md5_dir_hash_result, md5_dir_hash_result2, 16 ) == 0)
-		//	printf("BAM/DIR MD5 matches: 0x%s\n", md5_dir_hash_result);
-		//else
-		//	printf("BAM/DIR MD5 does not match! 0x%s != 0x%s\n", md5_dir_hash_result, md5_dir_hash_result2);
+		if(digest.all_crc == digest2.all_crc)
+			printf("All decodable sectors have CRC matches: 0x%X\n", digest.all_crc);
+		else
+			printf("All decodable sectors do not have CRC matches! 0x%X != 0x%X\n", digest.all_crc, digest2.all_crc);
 
-		if(crc == crc2)
-			printf("All decodable sectors have CRC matches: 0x%X\n", crc);
+		if(memcmp(digest.all_md5, digest2.all_md5, 16) == 0)
+			print_md5("All decodable sectors have MD5 matches: ", digest.all_md5);
 		else
-			printf("All decodable sectors do not have CRC matches! 0x%X != 0x%X\n", crc, crc2);
+			printf("All decodable sectors do not have MD5 matches!\n");
+
+		if(sector_list) print_sectors(&digest, &digest2);
+	}
+	else if (dir_only) 	// only read the directory track
+	{
+		if(!load_image_range(file1, track_buffer, track_density, track_length, 18 * 2, 18 * 2)) exit(0);
 
-		//if( memcmp(md5_hash_result, md5_hash_result2, 16 ) == 0 )
-		///	printf("All decodable sectors have MD5 matches: 0x%s\n", md5_hash_result);
-		//else
-		//	printf("All decodable sectors do not have MD5 matches! 0x%s != 0x%s\n", md5_hash_result, md5_hash_result2);
+		printf("%s\n", file1);
+
+		crc = crc_dir_track(track_buffer, track_length);
+		printf("BAM/DIR CRC:\t0x%X\n", crc);
 	}
 	else 	// just scan for errors, etc.
 	{
-		if(!load_image(file1, track_buffer, track_density, track_length)) exit(0);
+		/* a track range only needs its own tracks, and those the full CRC covers */
+		if((start_track != 1 * 2) || (end_track != 42 * 2))
+		{
+			if(!load_image_range(file1, track_buffer, track_density, track_length,
+				start_track, (end_track > 35 * 2) ? end_track : 35 * 2)) exit(0);
+		}
+		else if(!load_image(file1, track_buffer, track_density, track_length)) exit(0);
 
 		scandisk();
 
 		printf("%s\n", file1);
 
-		crc = crc_dir_track(track_buffer, track_length);
-		printf("BAM/DIR CRC:\t0x%X\n", crc);
-		crc = crc_all_tracks(track_buffer, track_length);
-		printf("Full CRC:\t0x%X\n", crc);
-
-		//memset(md5_hash_result, 0 , sizeof(md5_hash_result));
-		//md5_dir_track(track_buffer, track_length, md5_hash_result);
-		//printf("BAM/DIR MD5:\t0x");
-		//for (i = 0; i < 16; i++)
-		// 	printf ("%02x", md5_hash_result[i]);
-		//printf("\n");
-
-		//memset(md5_hash_result, 0 , sizeof(md5_hash_result));
-		//md5_all_tracks(track_buffer, track_length, md5_hash_result);
-		//printf("Full MD5:\t0x");
-		//for (i = 0; i < 16; i++)
-		//	printf ("%02x", md5_hash_result[i]);
-		//printf("\n");
+		digest_disk(track_buffer, track_length, &digest);
+		printf("BAM/DIR CRC:\t0x%X\n", digest.dir_crc);
+		if((verbose) && (digest.sectors != digest.valid)) printf("[%d/%d sectors] ", digest.valid, digest.sectors);
+		printf("Full CRC:\t0x%X\n", digest.all_crc);
+		print_md5("BAM/DIR MD5:\t", digest.dir_md5);
+		print_md5("Full MD5:\t", digest.all_md5);
+
+		if(sector_list) print_sectors(&digest, NULL);
 	}
 
 	exit(0);
@@ -245,34 +281,30 @@ int load_image(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *
 {
 	if (compare_extension(filename, "D64"))
 	{
-		if(!(read_d64(filename, track_buffer, track_density, track_length))) return 0;
+		if(!(read_d64(&ctx, filename, track_buffer, track_density, track_length))) return 0;
 	}
 	else if (compare_extension(filename, "G64"))
 	{
-		if(!(read_g64(filename, track_buffer, track_density, track_length))) return 0;
-		if(sync_align_buffer) sync_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_g64(&ctx, filename, track_buffer, track_density, track_length))) return 0;
+		if(ctx.sync_align_buffer) sync_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
 	}
 	else if (compare_extension(filename, "NBZ"))
 	{
-		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(filename, compressed_buffer))) return 0;
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		if(fattrack!=99) search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nib_file(&ctx, filename, file_buffer, sizeof(file_buffer), track_buffer, track_density, track_length))) return 0;
+		align_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
+		if(ctx.fattrack!=99) search_fat_tracks(&ctx, track_buffer, track_density, track_length);
 	}
 	else if (compare_extension(filename, "NIB"))
 	{
-		if(!(file_buffer_size = load_file(filename, file_buffer))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		if(fattrack!=99) search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nib_file(&ctx, filename, file_buffer, sizeof(file_buffer), track_buffer, track_density, track_length))) return 0;
+		align_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
+		if(ctx.fattrack!=99) search_fat_tracks(&ctx, track_buffer, track_density, track_length);
 	}
 	else if (compare_extension(filename, "NB2"))
 	{
-		if(!(read_nb2(filename, track_buffer, track_density, track_length, nb2cycle))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		if(fattrack!=99) search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nb2(&ctx, filename, track_buffer, track_density, track_length, nb2cycle))) return 0;
+		align_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
+		if(ctx.fattrack!=99) search_fat_tracks(&ctx, track_buffer, track_density, track_length);
 	}
 	else
 	{
@@ -282,6 +314,44 @@ int load_image(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *
 	return 1;
 }
 
+/* reads only the halftracks from..to and the directory track, if the image allows it */
+int load_image_range(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, int from, int to)
+{
+	track_image image;
+	int track;
+
+	if(!open_image(&image, &ctx, filename, track_buffer, track_density, track_length, track_alignment))
+		return load_image(filename, track_buffer, track_density, track_length);
+
+	for (track = from; track <= to; track++)
+	{
+		if(!image_track(&image, track))
+		{
+			close_image(&image);
+			return 0;
+		}
+	}
+
+	if(!image_track(&image, 18 * 2))
+	{
+		close_image(&image);
+		return 0;
+	}
+
+	close_image(&image);
+
+	/* fat tracks can only be found among the tracks read, image_track() copied a given one */
+	if(image.type != IMAGE_G64)
+	{
+		if(!ctx.fattrack)
+			search_fat_tracks(&ctx, track_buffer, track_density, track_length);
+		else if(ctx.fattrack != 99)
+			printf("Handle FAT track on %d\n", ctx.fattrack / 2);
+	}
+
+	return 1;
+}
+
 int
 compare_disks(void)
 {
@@ -551,7 +621,7 @@ scandisk(void)
 
 			// detect bad GCR '000' bits
 			badgcr_tracks[track] =
-			  check_bad_gcr(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track]);
+			  check_bad_gcr(&ctx, track_buffer + (NIB_TRACK_LENGTH * track), track_length[track]);
 
 			if (badgcr_tracks[track])
 			{
@@ -571,7 +641,7 @@ scandisk(void)
 			*/
 
 			/* check for FAT track */
-			if(fattrack!=99)
+			if(ctx.fattrack!=99)
 			{
 				if (track < end_track - track_inc)
 				{
@@ -619,7 +689,7 @@ scandisk(void)
 		printf("\n");
 
 		// process and dump to disk for manual compare
-		//track_length[track] = compress_halftrack(track, track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], track_length[track]);
+		//track_length[track] = compress_halftrack(&ctx, track, track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], track_length[track]);
 		sprintf(testfilename, "raw/tr%.1fd%d", (float) track/2, (track_density[track] & 3));
 		if(NULL != (trkout = fopen(testfilename, "w")))
 		{
@@ -642,17 +712,19 @@ dump_headers(BYTE * gcrdata, size_t length)
 {
 	BYTE header[10];
 	BYTE *gcr_ptr, *gcr_end;
+	sync_index syncs;
 
 	gcr_ptr = gcrdata;
 	gcr_end = gcrdata + length;
 
+	index_syncs(gcrdata, length, &syncs);
+
 	do
 	{
-		if (!find_sync(&gcr_ptr, gcr_end))
+		if (!find_indexed_sync(&syncs, &gcr_ptr, gcr_end))
 			return 0;
 
-		convert_4bytes_from_GCR(gcr_ptr, header);
-		convert_4bytes_from_GCR(gcr_ptr + 5, header + 4);
+		convert_block_from_GCR(gcr_ptr, header, 2);
 
 		if(header[0] == 0x08) // only parse headers
 			printf("\n%.2x %.2x %.2x %.2x = typ:%.2x -- blh:%.2x -- trk:%d -- sec:%d -- id:%c%c",
@@ -680,29 +752,29 @@ raw_track_info(BYTE * gcrdata, size_t length)
 	*/
 	size_t bad_cnt = 0;
 	size_t bad_len[NIB_TRACK_LENGTH];
-	size_t i, locked;
+	BYTE badmap[BAD_GCR_MAP_BYTES(NIB_TRACK_LENGTH)];
+	sync_index syncs;
+	size_t i, locked, unlocked;
+	int n;
 
 	memset(sync_len, 0, sizeof(sync_len));
 	/* memset(gap_len, 0, sizeof(gap_len)); */
 	memset(bad_len, 0, sizeof(bad_len));
 
-	/* count syncs/lengths */
-	for (locked = 0, i = 0; i < length - 1; i++)
+	/* count syncs/lengths, only full 10 bit syncs */
+	index_syncs(gcrdata, length, &syncs);
+
+	for (n = 0, unlocked = length; n < syncs.syncs; n++)
 	{
-		if (locked)
-		{
-			if (gcrdata[i] == 0xff)
-				sync_len[sync_cnt]++;
-			else
-				locked = 0;
-		}
-		//else if (gcrdata[i] == 0xff) /* not full sync, only last 8 bits */
-		else if(((gcrdata[i] & 0x03) == 0x03) && (gcrdata[i+1] == 0xff))
-		{
-			locked = 1;
-			sync_cnt++;
-			sync_len[sync_cnt] = 1;
-		}
+		i = syncs.start[n];
+		if ((i == unlocked) || ((gcrdata[i] & 0x03) != 0x03))
+			i++;
+		if (i + 2 > syncs.after[n])
+			continue;
+
+		sync_cnt++;
+		sync_len[sync_cnt] = ((syncs.after[n] < length - 1) ? syncs.after[n] : length - 1) - i;
+		unlocked = syncs.after[n];
 	}
 
 	printf("\nSYNCS:%d (", sync_cnt);
@@ -736,16 +808,18 @@ raw_track_info(BYTE * gcrdata, size_t length)
 	*/
 
 	/* count bad gcr lengths */
+	bad_gcr_map(gcrdata, length, badmap);
+
 	for (locked = 0, i = 0; i < length - 1; i++)
 	{
 		if (locked)
 		{
-			if (is_bad_gcr(gcrdata, length, i))
+			if (BAD_GCR_MAPPED(badmap, i))
 				bad_len[bad_cnt]++;
 			else
 				locked = 0;
 		}
-		else if (is_bad_gcr(gcrdata, length, i))
+		else if (BAD_GCR_MAPPED(badmap, i))
 		{
 			locked = 1;
 			bad_cnt++;
@@ -875,7 +949,11 @@ size_t check_rapidlok(int track)
 void
 usage(void)
 {
-	printf("usage: nibscan [options] <filename1> [filename2]\n\n");
+	printf("usage: nibscan [options] <filename1> [filename2]\n"
+	"       nibscan [options] -q <filename>\n\n"
+	" -q: Only calculate the BAM/DIR CRC (reads only track 18)\n"
+	" -l: List the CRC32 of every sector, or the sectors that differ when comparing\n"
+	" With -S/-E only the selected tracks are read from NIB, NBZ and G64 images\n\n");
 	switchusage();
 	exit(1);
 }
@@ -31,6 +31,7 @@
 #define IMAGE_D64		1
 #define IMAGE_G64		2
 #define IMAGE_NB2		3
+#define IMAGE_NBZ		4
 
 #define BM_MATCH		0x10 /* not used but exists in very old images */
 #define BM_NO_CYCLE		0x20
@@ -107,9 +108,72 @@ extern int fattrack;
 extern int old_g64;
 extern int backwards;
 extern int nb2cycle;
+extern int workers;
 
 #include "ihs.h"
 
+/* tracks of any length, see store_track() */
+typedef struct
+{
+	struct track_chunk *chunks;
+	struct job_lock *lock;
+	BYTE *data[MAX_HALFTRACKS_1541 + 2];
+	size_t length[MAX_HALFTRACKS_1541 + 2];
+} track_store;
+
+/* file mapped into memory, see map_file() */
+typedef struct
+{
+	BYTE *data;
+	size_t size;
+	int mapped;
+} mapped_file;
+
+/* image opened for reading single tracks, see open_image() */
+typedef struct
+{
+	nib_context *ctx;
+	mapped_file map;
+	int type;
+	DWORD offset[MAX_HALFTRACKS_1541 + 2];
+	DWORD length[MAX_HALFTRACKS_1541 + 2];
+	DWORD crc[MAX_HALFTRACKS_1541 + 2];
+	BYTE density[MAX_HALFTRACKS_1541 + 2];
+	BYTE loaded[MAX_HALFTRACKS_1541 + 2];
+	BYTE *track_buffer;
+	BYTE *track_density;
+	size_t *track_length;
+	BYTE *track_alignment;
+} track_image;
+
+/* hashes of the decoded sectors, see digest_disk() */
+typedef struct
+{
+	unsigned int dir_crc;
+	unsigned int all_crc;
+	unsigned char dir_md5[16];
+	unsigned char all_md5[16];
+	unsigned int sector_crc[BLOCKSONDISK];
+	BYTE sector_error[BLOCKSONDISK];
+	int sectors;
+	int valid;
+} disk_digest;
+
+/* replaces the cable and the drive when set, see simdrive.c */
+typedef struct
+{
+	unsigned char (*read)(void);
+	void (*write)(unsigned char c);
+	int (*read_n)(unsigned char *buffer, unsigned int length);
+	int (*write_n)(unsigned char *buffer, unsigned int length);
+	int (*read_track)(unsigned char *buffer, unsigned int length);
+	int (*write_track)(unsigned char *buffer, unsigned int length);
+	int (*upload)(unsigned char *code, unsigned int length);
+	void (*status)(char *buffer, int size);
+} drive_transport;
+
+extern drive_transport *transport;
+
 /* common */
 void usage(void);
 
@@ -124,24 +188,40 @@ int writeimage(CBM_FILE fd);
 /* fileio.c */
 void parseargs(char *argv[]);
 void switchusage(void);
-int load_file(char *filename, BYTE *file_buffer);
+void init_context(nib_context *ctx);
+int load_file(char *filename, BYTE *file_buffer, int file_buffer_size);
+int map_file(char *filename, mapped_file *map);
+void unmap_file(mapped_file *map);
+int read_nib_file(nib_context *ctx, char *filename, BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 int save_file(char *filename, BYTE *file_buffer, int length);
 int read_nib(BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, size_t cycle);
-int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int read_nb2(nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, size_t cycle);
+int read_g64(nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int read_d64(nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 int write_nib(BYTE*file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int write_g64(nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int init_store(track_store *store);
+BYTE *store_track(track_store *store, int index, BYTE *data, size_t length);
+void free_store(track_store *store);
+int pack_nbz(nib_context *ctx, BYTE *file_buffer, int file_buffer_size, BYTE *compressed_buffer);
+int unpack_nbz(nib_context *ctx, BYTE *compressed_buffer, int compressed_size, BYTE *file_buffer, int file_buffer_size);
+int unpack_nbz_track(BYTE *compressed_buffer, int size, int index, BYTE *track_data);
 int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE track_density, size_t track_length);
-int align_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
-int rig_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
-int sync_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
+size_t compress_halftrack(nib_context *ctx, int halftrack, BYTE *track_buffer, BYTE track_density, size_t track_length);
+int rapidlok_aligned(nib_context *ctx);
+int align_tracks(nib_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
+int open_image(track_image *image, nib_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density,
+	size_t *track_length, BYTE *track_alignment);
+int image_track(track_image *image, int halftrack);
+BYTE *track_view(track_image *image, int halftrack, size_t *length);
+void close_image(track_image *image);
+int stream_g64(nib_context *ctx, track_image *image, char *filename);
+int rig_tracks(nib_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
+int sync_tracks(nib_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
 int write_dword(FILE * fd, DWORD * buf, int num);
+int digest_disk(BYTE *track_buffer, size_t *track_length, disk_digest *digest);
 unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length);
-unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length);
 unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned char *result);
-unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned char *result);
 
 /* read.c */
 BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer);
@@ -151,6 +231,7 @@ int write_nb2(CBM_FILE fd, char * filename);
 void get_disk_id(CBM_FILE fd);
 BYTE scan_density(CBM_FILE fd);
 int TrackAlignmentReport(CBM_FILE fd);
+void benchmark_transfers(CBM_FILE fd, int iterations, int writes);
 
 /* write.c */
 void master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
@@ -189,6 +270,10 @@ void motor_on(CBM_FILE fd);
 void motor_off(CBM_FILE fd);
 void step_to_halftrack(CBM_FILE fd, int halftrack);
 int verify_floppy(CBM_FILE fd);
+
+/* simdrive.c */
+int sim_open(char *spec);
+
 #ifdef DJGPP
 #include <unistd.h>
 int find_par_port(CBM_FILE fd);
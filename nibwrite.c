@@ -16,6 +16,7 @@
 #include "nibtools.h"
 #include "prot.h"
 #include "lz.h"
+#include "telemetry.h"
 
 int _dowildcard = 1;
 
@@ -23,14 +24,12 @@ char bitrate_range[4] = { 43 * 2, 31 * 2, 25 * 2, 18 * 2 };
 char bitrate_value[4] = { 0x00, 0x20, 0x40, 0x60 };
 char density_branch[4] = { 0xb1, 0xb5, 0xb7, 0xb9 };
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_density[MAX_HALFTRACKS_1541 + 2];
 BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
 size_t track_length[MAX_HALFTRACKS_1541 + 2];
 
-int file_buffer_size;
 int start_track, end_track, track_inc;
 int reduce_sync;
 int fix_gcr, aggressive_gcr;
@@ -69,6 +68,8 @@ int read_killer=1;
 int extended_parallel_test=0;
 int backwards=0;
 int nb2cycle=0;
+int workers=1;
+nib_context ctx;
 
 CBM_FILE fd;
 FILE *fplog;
@@ -111,10 +112,7 @@ main(int argc, char *argv[])
 	mode = MODE_WRITE_DISK;
 	align = ALIGN_NONE;
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
+	/* the static buffers start zeroed, clearing them again would only make all of them resident */
 
 	/* default is to reduce sync */
 	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
@@ -128,7 +126,21 @@ main(int argc, char *argv[])
 	}
 
 	while (--argc && (*(++argv)[0] == '-'))
-		parseargs(argv);
+	{
+		switch ((*argv)[1])
+		{
+		case 'W':
+			timing_file = &(*argv)[2];
+			printf("* Log track timing to %s\n", timing_file);
+			break;
+
+		default:
+			parseargs(argv);
+			break;
+		}
+	}
+
+	init_context(&ctx);
 
 	printf("\n");
 	if (argc > 0)	strcpy(filename, argv[0]);
@@ -142,19 +154,31 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if ((timing_file) && (!open_timing(timing_file, "nibwrite")))
+		exit(0);
+
+	/* -@sim:<image> runs on a virtual drive, see simdrive.c */
+	if (!strncmp(cbm_adapter, "sim:", 4))
+	{
+		if (!sim_open(cbm_adapter + 4))
+			exit(0);
+	}
 #ifdef DJGPP
-	calibrate();
-	if (!detect_ports(reset))
-		return 0;
+	else
+	{
+		calibrate();
+		if (!detect_ports(reset))
+			return 0;
+	}
 #elif defined(OPENCBM_42)
 	/* remain compatible with OpenCBM < 0.4.99 */
-	if (cbm_driver_open(&fd, 0) != 0)
+	else if (cbm_driver_open(&fd, 0) != 0)
 	{
 		printf("Is your X-cable properly configured?\n");
 		exit(0);
 	}
 #else /* assume > 0.4.99 */
-	if (cbm_driver_open_ex(&fd, cbm_adapter) != 0)
+	else if (cbm_driver_open_ex(&fd, cbm_adapter) != 0)
 	{
 		printf("Is your X-cable properly configured?\n");
 		exit(0);
@@ -200,6 +224,7 @@ main(int argc, char *argv[])
 	motor_on(fd);
 	step_to_halftrack(fd, 18 * 2);
 
+	close_timing();
 	exit(0);
 }
 
@@ -208,36 +233,32 @@ int loadimage(char *filename)
 	/* read and remaster disk */
 	if (compare_extension(filename, "D64"))
 	{
-		if(!(read_d64(filename, track_buffer, track_density, track_length))) return 0;
+		if(!(read_d64(&ctx, filename, track_buffer, track_density, track_length))) return 0;
 	}
 	else if (compare_extension(filename, "G64"))
 	{
-		if(!(read_g64(filename, track_buffer, track_density, track_length))) return 0;
-		if(sync_align_buffer) sync_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_g64(&ctx, filename, track_buffer, track_density, track_length))) return 0;
+		if(ctx.sync_align_buffer) sync_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
+		search_fat_tracks(&ctx, track_buffer, track_density, track_length);
 
 	}
 	else if (compare_extension(filename, "NBZ"))
 	{
-		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(filename, compressed_buffer))) return 0;
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nib_file(&ctx, filename, file_buffer, sizeof(file_buffer), track_buffer, track_density, track_length))) return 0;
+		align_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
+		search_fat_tracks(&ctx, track_buffer, track_density, track_length);
 	}
 	else if (compare_extension(filename, "NIB"))
 	{
-		if(!(file_buffer_size = load_file(filename, file_buffer))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nib_file(&ctx, filename, file_buffer, sizeof(file_buffer), track_buffer, track_density, track_length))) return 0;
+		align_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
+		search_fat_tracks(&ctx, track_buffer, track_density, track_length);
 	}
 	else if (compare_extension(filename, "NB2"))
 	{
-		if(!(read_nb2(filename, track_buffer, track_density, track_length, nb2cycle))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nb2(&ctx, filename, track_buffer, track_density, track_length, nb2cycle))) return 0;
+		align_tracks(&ctx, track_buffer, track_density, track_length, track_alignment);
+		search_fat_tracks(&ctx, track_buffer, track_density, track_length);
 	}
 	else
 	{
@@ -256,13 +277,13 @@ int writeimage(CBM_FILE fd)
 	if(auto_capacity_adjust)
 		adjust_target(fd);
 
-	if(fattrack)
+	if(ctx.fattrack)
 	{
-		printf("File contains possible FAT track on T%d - Attempt to write? (y/N)",fattrack/2);
-		if(getchar() != 'y') fattrack=0;
+		printf("File contains possible FAT track on T%d - Attempt to write? (y/N)",ctx.fattrack/2);
+		if(getchar() != 'y') ctx.fattrack=0;
 	}
 
-	if((fattrack)&&(fattrack!=99))
+	if((ctx.fattrack)&&(ctx.fattrack!=99))
 		unformat_disk(fd);
 
 	//if(align_disk)
@@ -284,6 +305,7 @@ usage(void)
 {
 	printf("usage: nibwrite [options] <filename>\n\n"
 		 " -@x: Use OpenCBM device 'x' (xa1541, xum1541:0, xum1541:1, etc.)\n"
+		 " -@sim:<image>[,rpm=n,...]: Use a virtual drive with <image> as the disk\n"
 	     " -D[n]: Use drive #[n]\n"
 	     " -S[n]: Override starting track\n"
 	     " -E[n]: Override ending track\n"
@@ -292,6 +314,7 @@ usage(void)
 	     " -t: Enable timer-based track alignment\n"
 	     " -c: Disable automatic capacity adjustment\n"
 	     " -u: Unformat disk. (writes all 0 bits to surface)\n"
+	     " -W<file>: Log the time of each track step to <file> (JSON Lines, or CSV for *.csv)\n"
 	     );
 
 	switchusage();
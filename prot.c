@@ -9,74 +9,78 @@
 #include "gcr.h"
 #include "prot.h"
 
-extern int fattrack;
-
 /* I don't like this kludge, but it is necessary to fix old files that lacked halftracks */
-void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+/* compares a halftrack with the one two halftracks up, returns 1 if they hold the same data */
+int is_fat_track(nib_context *ctx, int track, BYTE *data, size_t length, BYTE *next, size_t next_length)
 {
-	int track, numfats=0;
-	size_t match=0;
+	size_t match;
 	char errorstring[0x1000];
 
-	if(!fattrack) /* autodetect fat tracks */
+	if (length == 0 || next_length == 0 || length == 8192 || next_length == 8192)
+		return 0;
+
+	match = compare_tracks(data, next, length, next_length, 1, errorstring);
+
+	if(ctx->verbose>1) printf("%4.1f: %d\n",(float)track/2,match);
+
+	if ((length-match<=20) /* 32-34 happens on empty formatted disks */
+		||
+		((track>=70)&&(length-match<=40)) ) /* much more likely on track 35 */
+	{
+		printf("Likely fat track found on T%d/%d (diff=%d)\n",track/2,(track/2)+1,(int)length-match);
+		return 1;
+	}
+	return 0;
+}
+
+void search_fat_tracks(nib_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	int track, numfats=0;
+
+	if(!ctx->fattrack) /* autodetect fat tracks */
 	{
-		if(verbose) printf("Searching for fat tracks...\n");
+		if(ctx->verbose) printf("Searching for fat tracks...\n");
 		for (track=2; track<=MAX_HALFTRACKS_1541-1; track+=2)
 		{
-			if (track_length[track] > 0 && track_length[track+2] > 0 &&
-				track_length[track] != 8192 && track_length[track+2] != 8192)
+			if (is_fat_track(ctx, track, track_buffer + (track * NIB_TRACK_LENGTH), track_length[track],
+				track_buffer + ((track+2) * NIB_TRACK_LENGTH), track_length[track+2]))
 			{
-				match = compare_tracks(
-				  track_buffer + (track * NIB_TRACK_LENGTH),
-				  track_buffer + ((track+2) * NIB_TRACK_LENGTH),
-				  track_length[track],
-				  track_length[track+2], 1, errorstring);
-
-				if(verbose>1) printf("%4.1f: %d\n",(float)track/2,match);
-
-				if ((track_length[track]-match<=20) /* 32-34 happens on empty formatted disks */
-					||
-					((track>=70)&&(track_length[track]-match<=40)) ) /* much more likely on track 35 */
+				if(!numfats)
 				{
-					printf("Likely fat track found on T%d/%d (diff=%d)\n",track/2,(track/2)+1,(int)track_length[track]-match);
-
-					if(!numfats)
-					{
-						fattrack=track;
-						memcpy(track_buffer + ((track+1) * NIB_TRACK_LENGTH),
-												track_buffer + (track * NIB_TRACK_LENGTH),
-												NIB_TRACK_LENGTH);
+					ctx->fattrack=track;
+					memcpy(track_buffer + ((track+1) * NIB_TRACK_LENGTH),
+											track_buffer + (track * NIB_TRACK_LENGTH),
+											NIB_TRACK_LENGTH);
 
-						track_length[track+1] = track_length[track];
-						track_density[track+1] = track_density[track];
-					}
-					else
-					{
-						printf("These are likely not fat tracks, just repeat data - Ignoring\n");
-						fattrack=0;
-					}
-					numfats++;
+					track_length[track+1] = track_length[track];
+					track_density[track+1] = track_density[track];
 				}
+				else
+				{
+					printf("These are likely not fat tracks, just repeat data - Ignoring\n");
+					ctx->fattrack=0;
+				}
+				numfats++;
 			}
 		}
 	}
-	else if(fattrack!=99) /* manually overridden */
+	else if(ctx->fattrack!=99) /* manually overridden */
 	{
-		printf("Handle FAT track on %d\n",fattrack/2);
+		printf("Handle FAT track on %d\n",ctx->fattrack/2);
 
-		memcpy(track_buffer + ((fattrack+1) * NIB_TRACK_LENGTH),
-			track_buffer + (fattrack * NIB_TRACK_LENGTH),
+		memcpy(track_buffer + ((ctx->fattrack+1) * NIB_TRACK_LENGTH),
+			track_buffer + (ctx->fattrack * NIB_TRACK_LENGTH),
 			NIB_TRACK_LENGTH);
 
-		track_length[fattrack+1] = track_length[fattrack];
-		track_density[fattrack+1] = track_density[fattrack];
+		track_length[ctx->fattrack+1] = track_length[ctx->fattrack];
+		track_density[ctx->fattrack+1] = track_density[ctx->fattrack];
 
-		memcpy(track_buffer + ((fattrack+2) * NIB_TRACK_LENGTH),
-			track_buffer + (fattrack * NIB_TRACK_LENGTH),
+		memcpy(track_buffer + ((ctx->fattrack+2) * NIB_TRACK_LENGTH),
+			track_buffer + (ctx->fattrack * NIB_TRACK_LENGTH),
 			NIB_TRACK_LENGTH);
 
-		track_length[fattrack+2] = track_length[fattrack];
-		track_density[fattrack+2] = track_density[fattrack];
+		track_length[ctx->fattrack+2] = track_length[ctx->fattrack];
+		track_density[ctx->fattrack+2] = track_density[ctx->fattrack];
 	}
 }
 
@@ -809,6 +813,7 @@ BYTE *
 find_bad_gap(BYTE * work_buffer, size_t tracklen)
 {
 	BYTE *pos, *buffer_end, *key_temp, *key;
+	BYTE badmap[BAD_GCR_MAP_BYTES(NIB_TRACK_LENGTH + 1)];
 	int run, longest;
 
 	run = 0;
@@ -817,11 +822,12 @@ find_bad_gap(BYTE * work_buffer, size_t tracklen)
 	buffer_end = work_buffer + tracklen + 1;
 	key = key_temp = NULL;
 
+	bad_gcr_map(work_buffer, buffer_end - work_buffer, badmap);
+
 	/* try to find longest bad gcr run */
 	while (pos < buffer_end)
 	{
-		if (is_bad_gcr(work_buffer, buffer_end - work_buffer,
-		  pos - work_buffer))
+		if (BAD_GCR_MAPPED(badmap, pos - work_buffer))
 		{
 			// mark next GCR byte
 			key_temp = pos + 1;
@@ -1,5 +1,6 @@
 /* prot.h */
-void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int is_fat_track(nib_context *ctx, int track, BYTE *data, size_t length, BYTE *next, size_t next_length);
+void search_fat_tracks(nib_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 size_t sync_align(BYTE *buffer, int length);
 void shift_buffer_left(BYTE * buffer, int length, int n);
 void shift_buffer_right(BYTE * buffer, int length, int n);
@@ -8,31 +8,130 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdarg.h>
 
 #include "mnibarch.h"
 #include "gcr.h"
 #include "nibtools.h"
+#include "thread.h"
+#include "telemetry.h"
 
 static BYTE diskid[3];
 extern int drivetype;
+extern int pipeline;
+extern nib_context ctx;
 
-BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
+/* output of one track, held back while the track is in the read pipeline */
+typedef struct
+{
+	int held;
+	char *text[2];
+	size_t length[2];
+	size_t size[2];
+} track_report;
+
+#define REPORT_SCREEN	0
+#define REPORT_LOG		1
+
+static void
+report_add(track_report *report, int where, const char *format, va_list args)
+{
+	char line[0x1100];	/* room for an errorstring and some text around it */
+	char *text;
+	size_t length, size;
+
+	if ((!report) || (!report->held))
+	{
+		vfprintf((where == REPORT_LOG) ? fplog : stdout, format, args);
+		return;
+	}
+
+	vsprintf(line, format, args);
+	length = strlen(line);
+
+	if (report->length[where] + length + 1 > report->size[where])
+	{
+		size = (report->length[where] + length + 1) * 2;
+		if (!(text = (char *) realloc(report->text[where], size)))
+		{
+			/* out of order is better than lost */
+			fputs(line, (where == REPORT_LOG) ? fplog : stdout);
+			return;
+		}
+		report->text[where] = text;
+		report->size[where] = size;
+	}
+
+	memcpy(report->text[where] + report->length[where], line, length + 1);
+	report->length[where] += length;
+}
+
+/* printf() for a track */
+static void
+say(track_report *report, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	report_add(report, REPORT_SCREEN, format, args);
+	va_end(args);
+}
+
+/* fprintf(fplog, ...) for a track */
+static void
+note(track_report *report, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	report_add(report, REPORT_LOG, format, args);
+	va_end(args);
+}
+
+/* print what was held back and go back to printing directly */
+static void
+release_report(track_report *report)
+{
+	if (report->length[REPORT_SCREEN])
+		fputs(report->text[REPORT_SCREEN], stdout);
+	if (report->length[REPORT_LOG])
+		fputs(report->text[REPORT_LOG], fplog);
+	fflush(stdout);
+
+	free(report->text[REPORT_SCREEN]);
+	free(report->text[REPORT_LOG]);
+	memset(report, 0, sizeof(track_report));
+}
+
+/*
+	Reads a halftrack.  'known' is the density of an earlier read of this
+	halftrack, which saves scanning it again when the head comes back to it,
+	or -1.
+*/
+static BYTE
+capture_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer, int known, track_report *report)
 {
 	BYTE density;
-    int i, newtrack;
+    int i;
+	double start;
 	static int lasttrack = -1;
 	static BYTE last_density = -1;
 
-	newtrack = (lasttrack == halftrack) ? 0 : 1;
-	lasttrack = halftrack;
+	if(lasttrack != halftrack)
+	{
+		start = timing_now();
+		step_to_halftrack(fd, halftrack);
+		log_timing(halftrack, "step", 0, start, 0, "ok");
+	}
 
-	if(newtrack)
+	if((lasttrack != halftrack) && (known < 0))
 	{
-		printf("\n%4.1f: ", (float) halftrack / 2);
-		fprintf(fplog, "\n%4.1f: ", (float) halftrack / 2);
+		lasttrack = halftrack;
 
-		step_to_halftrack(fd, halftrack);
+		say(report, "\n%4.1f: ", (float) halftrack / 2);
+		note(report, "\n%4.1f: ", (float) halftrack / 2);
 
+		start = timing_now();
 		if(force_density)
 			density = speed_map[halftrack/2];
 		else if (Use_SCPlus_IHS)
@@ -46,36 +145,38 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 		set_bitrate(fd, density&3);
 		send_mnib_cmd(fd, FL_SCANKILLER, NULL, 0);
 		density |= burst_read(fd);
+		log_timing(halftrack, "scan", 0, start, 0, (density & BM_FF_TRACK) ? "killer" : (density & BM_NO_SYNC) ? "nosync" : "ok");
 	}
 	else
 	{
-		// this is the same track we just read
-		density = last_density;
-		printf("\n      ");
-		fprintf(fplog, "\n      ");
+		// this is a track we read before
+		density = (lasttrack == halftrack) ? last_density : (BYTE) known;
+		lasttrack = halftrack;
+		say(report, "\n      ");
+		note(report, "\n      ");
 	}
 
 	/* output current density */
-	printf("(%d",density&3);
-	fprintf(fplog,"(%d",density&3);
+	say(report, "(%d",density&3);
+	note(report, "(%d",density&3);
 
 	if ( (density&3) != speed_map[halftrack/2])
-		printf("!=%d", speed_map[halftrack/2]);
+		say(report, "!=%d", speed_map[halftrack/2]);
 
 	if(density & BM_FF_TRACK)
 	{
-		printf(" KILLER");
-		fprintf(fplog, " KILLER!");
+		say(report, " KILLER");
+		note(report, " KILLER!");
 	}
 
 	if(density & BM_NO_SYNC)
 	{
-		printf(" NOSYNC!");
-		fprintf(fplog," NOSYNC!");
+		say(report, " NOSYNC!");
+		note(report, " NOSYNC!");
 	}
 
-	printf(") ");
-	fprintf(fplog,") ");
+	say(report, ") ");
+	note(report, ") ");
 
 	// bail if we don't want to read killer tracks
 	// some drives/disks timeout
@@ -88,13 +189,14 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 	if((density) != last_density)
 	{
 		set_density(fd, density&3);
-		if(verbose>2) printf("[D]");
+		if(verbose>2) say(report, "[D]");
 		last_density = density;
 	}
 
 	for (i = 0; i < 3; i++)
 	{
 		// read track
+		start = timing_now();
 		if((ihs) && (!(density & BM_NO_SYNC)))
 			send_mnib_cmd(fd, FL_READIHS, NULL, 0);
 		else if (Use_SCPlus_IHS) // "-j"
@@ -109,12 +211,16 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 		burst_read(fd);
 
 		if (burst_read_track(fd, buffer, NIB_TRACK_LENGTH))
+		{
+			log_timing(halftrack, "read", i, start, NIB_TRACK_LENGTH, "ok");
 			break;
+		}
 		else
 		{
+			log_timing(halftrack, "read", i, start, 0, "timeout");
 			// If we got a timeout, reset the port before retrying.
-			printf("!");
-			fprintf(fplog,"(timeout) ");
+			say(report, "!");
+			note(report, "(timeout) ");
 			fflush(stdout);
 			burst_read(fd);
 			//delay(500);
@@ -125,6 +231,7 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 
 	if(i == 3)
 	{
+		if(report) release_report(report);
 		printf("\n\nNo good read of track due to timeouts.  Aborting!\n");
 		exit(1);
 	}
@@ -132,136 +239,204 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 	return (density);
 }
 
-BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
+BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 {
-	BYTE buffer1[NIB_TRACK_LENGTH];
-	BYTE buffer2[NIB_TRACK_LENGTH];
-	BYTE cbuffer1[NIB_TRACK_LENGTH];
-	BYTE cbuffer2[NIB_TRACK_LENGTH];
+	return capture_halftrack(fd, halftrack, buffer, -1, NULL);
+}
+
+/* paranoia_read_halftrack() of one track */
+typedef struct
+{
+	int halftrack;
+	size_t pass;		/* read of the first pass */
+	int result;
+	double start;
+	BYTE denso;
+	size_t leno, best, errors;
+	BYTE bufo[NIB_TRACK_LENGTH];
+	BYTE cbufo[NIB_TRACK_LENGTH];
 	BYTE bbuffer[NIB_TRACK_LENGTH];
-	BYTE *cbufn, *cbufo, *bufn, *bufo;
-	BYTE align;
-	size_t leno, lenn, gcr_comp;
-	BYTE denso, densn;
-	size_t i, l, badgcr, retries, errors, best;
 	char errorstring[0x1000];
+	track_report report;
+} track_read;
 
-	badgcr = 0;
-	errors = 0;
-	retries = 3;
-	best = NIB_TRACK_LENGTH;
-	denso = 0;
-	densn = 0;
-	leno = 0;
-	lenn = 0;
-	bufn = buffer1;
-	bufo = buffer2;
-	cbufn = cbuffer1;
-	cbufo = cbuffer2;
-
-	errorstring[0] = '\0';
-
-	// First pass at normal track read
-	for (l = 0; l <= error_retries; l ++)
-	{
-		memset(bufo, 0, NIB_TRACK_LENGTH);
-		denso = read_halftrack(fd, halftrack, bufo);
-
-		// if we have a killer track, exit processing
-		if(denso & BM_FF_TRACK)
-		{
-			printf("[Killer Track] ");
-			fprintf(fplog, "[Killer Track] %s (%d)", errorstring, leno);
-			memcpy(buffer, bufo, NIB_TRACK_LENGTH);
-			return (denso);
-		}
+#define READ_AGAIN	0
+#define READ_GOOD	1
+#define READ_FINAL	2	/* killer or unformatted, keep as read */
 
-		// Find track cycle and length
-		memset(cbufo, 0, NIB_TRACK_LENGTH);
-		leno = extract_GCR_track(cbufo, bufo, &align, halftrack/2, capacity_min[denso & 3], capacity_max[denso & 3]);
+/* how a pass or a track ended, for the timing log */
+static char *read_result[] = { "errors", "good", "final" };
 
-		printf("%d ", leno);
-		fprintf(fplog, "%d ", leno);
+static void
+begin_read(track_read *tr, int halftrack, int held)
+{
+	tr->halftrack = halftrack;
+	tr->start = timing_now();
+	tr->pass = 0;
+	tr->result = READ_AGAIN;
+	tr->denso = 0;
+	tr->leno = 0;
+	tr->best = NIB_TRACK_LENGTH;
+	tr->errors = 0;
+	tr->errorstring[0] = '\0';
+	memset(&tr->report, 0, sizeof(track_report));
+	tr->report.held = held;
+}
 
-		// If we get nothing we are on an empty track (unformatted)
-		if (!leno)
-		{
-			printf("[Unformatted Track] ");
-			fprintf(fplog, "[Unformatted Track] %s (%d)", errorstring, leno);
-			memcpy(buffer, bufo, NIB_TRACK_LENGTH);
-			return (denso);
-		}
+/* the drive side of a read of the first pass */
+static void
+capture_read(CBM_FILE fd, track_read *tr, int known)
+{
+	memset(tr->bufo, 0, NIB_TRACK_LENGTH);
+	tr->denso = capture_halftrack(fd, tr->halftrack, tr->bufo, known, &tr->report);
+}
 
-		/* keep best track cycle in case we don't get another good one
-			1) disk is destroyed during reading)
-			2) subsequest reads show no valid cycle
-		*/
-		if(leno < best)
-		{
-			best = leno;
-			memcpy(bbuffer, bufo, NIB_TRACK_LENGTH);
-		}
+/* the host side of a read of the first pass, tells whether to read again */
+static int
+analyze_read(track_read *tr)
+{
+	BYTE align;
+	int halftrack = tr->halftrack;
+	BYTE denso = tr->denso;
+	double start;
 
-		// if we get less than what a track holds,
-		// try again, probably bad read or a bad GCR match
-		if (leno < capacity_min[denso & 3] - CAP_ALLOWANCE)
-		{
-			printf("Short Read! ");
-			fprintf(fplog, "[%d<%d!] ", leno, capacity_min[denso & 3] - CAP_ALLOWANCE);
-			//if(l < (error_retries - 3)) l = error_retries - 3;
-			//continue;
-		}
+	// if we have a killer track, exit processing
+	if(denso & BM_FF_TRACK)
+	{
+		say(&tr->report, "[Killer Track] ");
+		note(&tr->report, "[Killer Track] %s (%d)", tr->errorstring, tr->leno);
+		return READ_FINAL;
+	}
 
-		// if we get more than capacity
-		// try again to make sure it's intentional
-		if (leno > capacity_max[denso & 3] + CAP_ALLOWANCE)
-		{
-			printf("Long Read! ");
-			fprintf(fplog, "[%d>%d!] ", leno, capacity_max[denso & 3] + CAP_ALLOWANCE);
-			//if(l < (error_retries - 3)) l = error_retries - 3;
-			//continue;
-		}
+	// Find track cycle and length
+	memset(tr->cbufo, 0, NIB_TRACK_LENGTH);
+	start = timing_now();
+	tr->leno = extract_GCR_track(&ctx, tr->cbufo, tr->bufo, &align, halftrack/2, ctx.capacity_min[denso & 3], ctx.capacity_max[denso & 3]);
+	log_timing(halftrack, "extract", (int)tr->pass, start, tr->leno, (tr->leno) ? "ok" : "unformatted");
 
-		// check for CBM DOS errors
-		errors = check_errors(cbufo, leno, halftrack, diskid, errorstring);
-		fprintf(fplog, "%s", errorstring);
+	say(&tr->report, "%d ", tr->leno);
+	note(&tr->report, "%d ", tr->leno);
 
-		// If there are a lot of errors, the track probably doesn't contain
-		// any CBM sectors (protection)
-		if(!errors)
-			printf("[CBM OK]");
-		else if ((errors == sector_map[halftrack/2]) || (halftrack > 70))
-			printf("[NDOS] ");
-		else
-			printf("%s", errorstring);
+	// If we get nothing we are on an empty track (unformatted)
+	if (!tr->leno)
+	{
+		say(&tr->report, "[Unformatted Track] ");
+		note(&tr->report, "[Unformatted Track] %s (%d)", tr->errorstring, tr->leno);
+		return READ_FINAL;
+	}
 
-		// if we got all good sectors we dont retry
-		if (errors == 0) break;
+	/* keep best track cycle in case we don't get another good one
+		1) disk is destroyed during reading)
+		2) subsequest reads show no valid cycle
+	*/
+	if(tr->leno < tr->best)
+	{
+		tr->best = tr->leno;
+		memcpy(tr->bbuffer, tr->bufo, NIB_TRACK_LENGTH);
+	}
 
-		// all bad sectors (protection) and we have a valid cycle
-		if ((errors == sector_map[halftrack/2]) &&
-			(leno < NIB_TRACK_LENGTH) && (l > 0) )
-			break;
+	// if we get less than what a track holds,
+	// try again, probably bad read or a bad GCR match
+	if (tr->leno < ctx.capacity_min[denso & 3] - CAP_ALLOWANCE)
+	{
+		say(&tr->report, "Short Read! ");
+		note(&tr->report, "[%d<%d!] ", tr->leno, ctx.capacity_min[denso & 3] - CAP_ALLOWANCE);
+		//if(l < (error_retries - 3)) l = error_retries - 3;
+		//continue;
+	}
 
-		// all bad sectors (protection) and no cycle, we limit retries
-		//if ((errors == sector_map[halftrack/2]) && (leno == NIB_TRACK_LENGTH))
-		//{
-		//	if(l < (error_retries - 1))	l = error_retries - 1;
-		//}
+	// if we get more than capacity
+	// try again to make sure it's intentional
+	if (tr->leno > ctx.capacity_max[denso & 3] + CAP_ALLOWANCE)
+	{
+		say(&tr->report, "Long Read! ");
+		note(&tr->report, "[%d>%d!] ", tr->leno, ctx.capacity_max[denso & 3] + CAP_ALLOWANCE);
+		//if(l < (error_retries - 3)) l = error_retries - 3;
+		//continue;
+	}
+
+	// check for CBM DOS errors
+	tr->errors = check_errors(tr->cbufo, tr->leno, halftrack, diskid, tr->errorstring);
+	note(&tr->report, "%s", tr->errorstring);
+
+	// If there are a lot of errors, the track probably doesn't contain
+	// any CBM sectors (protection)
+	if(!tr->errors)
+		say(&tr->report, "[CBM OK]");
+	else if ((tr->errors == sector_map[halftrack/2]) || (halftrack > 70))
+		say(&tr->report, "[NDOS] ");
+	else
+		say(&tr->report, "%s", tr->errorstring);
+
+	// if we got all good sectors we dont retry
+	if (tr->errors == 0) return READ_GOOD;
+
+	// all bad sectors (protection) and we have a valid cycle
+	if ((tr->errors == sector_map[halftrack/2]) &&
+		(tr->leno < NIB_TRACK_LENGTH) && (tr->pass > 0) )
+		return READ_GOOD;
+
+	// all bad sectors (protection) and no cycle, we limit retries
+	//if ((errors == sector_map[halftrack/2]) && (leno == NIB_TRACK_LENGTH))
+	//{
+	//	if(l < (error_retries - 1))	l = error_retries - 1;
+	//}
+
+	return READ_AGAIN;
+}
+
+static void
+analyze_job(void *arg, int job)
+{
+	track_read *tr = (track_read *) arg;
+
+	tr->result = analyze_read(tr);
+}
+
+/* retries and verify reads after the first read was analyzed */
+static BYTE
+finish_read(CBM_FILE fd, track_read *tr, BYTE * buffer)
+{
+	BYTE bufn[NIB_TRACK_LENGTH];
+	BYTE cbufn[NIB_TRACK_LENGTH];
+	BYTE align;
+	size_t lenn, gcr_comp;
+	BYTE densn;
+	size_t i, badgcr, retries;
+	int halftrack = tr->halftrack;
+	double start;
+
+	retries = 3;
+
+	// the rest of the first pass
+	while ((tr->result == READ_AGAIN) && (tr->pass < error_retries))
+	{
+		tr->pass++;
+		start = timing_now();
+		capture_read(fd, tr, tr->denso);
+		tr->result = analyze_read(tr);
+		log_timing(halftrack, "retry", (int)tr->pass, start, tr->leno, read_result[tr->result]);
+	}
+
+	if (tr->result == READ_FINAL)
+	{
+		memcpy(buffer, tr->bufo, NIB_TRACK_LENGTH);
+		log_timing(halftrack, "track", (int)tr->pass, tr->start, tr->leno, read_result[tr->result]);
+		return (tr->denso);
 	}
 
 	/* keep best cycle if ended with none */
-	if((leno == NIB_TRACK_LENGTH) && (best < leno))
+	if((tr->leno == NIB_TRACK_LENGTH) && (tr->best < tr->leno))
 	{
-		printf(" (reverted) ");
-		memcpy(bufo, bbuffer, NIB_TRACK_LENGTH);
+		say(&tr->report, " (reverted) ");
+		memcpy(tr->bufo, tr->bbuffer, NIB_TRACK_LENGTH);
 	}
 
 	// Fix bad GCR in track for compare
-	if ((badgcr = check_bad_gcr(cbufo, leno)) != 0)
+	if ((badgcr = check_bad_gcr(&ctx, tr->cbufo, tr->leno)) != 0)
 	{
-		if(verbose) printf(" (weakgcr:%d) ", badgcr);
-		fprintf(fplog, " (weakgcr:%d) ", badgcr);
+		if(verbose) say(&tr->report, " (weakgcr:%d) ", badgcr);
+		note(&tr->report, " (weakgcr:%d) ", badgcr);
 	}
 
 	if(track_match)
@@ -269,57 +444,118 @@ BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 		// Try to verify our read
 
 		// Don't bother to compare unformatted or bad data
-		if (leno == NIB_TRACK_LENGTH) retries = 0;
+		if (tr->leno == NIB_TRACK_LENGTH) retries = 0;
 
 		// normal data, verify
 		for (i = 0; i < retries; i++)
 		{
+			start = timing_now();
 			memset(bufn, 0, NIB_TRACK_LENGTH);
-			densn = read_halftrack(fd, halftrack, bufn);
+			densn = capture_halftrack(fd, halftrack, bufn, tr->denso, &tr->report);
 
 			memset(cbufn, 0, NIB_TRACK_LENGTH);
-			lenn = extract_GCR_track(cbufn, bufn, &align, halftrack/2, capacity_min[densn & 3], capacity_max[densn & 3]);
+			lenn = extract_GCR_track(&ctx, cbufn, bufn, &align, halftrack/2, ctx.capacity_min[densn & 3], ctx.capacity_max[densn & 3]);
 
-			printf("%d ", lenn);
-			fprintf(fplog, "%d ", lenn);
+			say(&tr->report, "%d ", lenn);
+			note(&tr->report, "%d ", lenn);
 
 			// Fix bad GCR in track for compare
-			if ((badgcr = check_bad_gcr(cbufn, lenn)) != 0)
+			if ((badgcr = check_bad_gcr(&ctx, cbufn, lenn)) != 0)
 			{
 				//printf("(weakgcr:%d)", badgcr);
 				//fprintf(fplog, "(weakgcr:%d) ", badgcr);
 			}
 
 			// compare raw gcr data
-			gcr_comp = compare_tracks(cbufo, cbufn, leno, lenn, 1, errorstring);
-			printf("[VERIFY] (%.4d/%.4d) ",(int)gcr_comp,leno);
-			fprintf(fplog, "[VERIFY] match:%.4d ", (int)gcr_comp);
+			gcr_comp = compare_tracks(tr->cbufo, cbufn, tr->leno, lenn, 1, tr->errorstring);
+			say(&tr->report, "[VERIFY] (%.4d/%.4d) ",(int)gcr_comp,tr->leno);
+			note(&tr->report, "[VERIFY] match:%.4d ", (int)gcr_comp);
 			if(gcr_comp <= lenn-10)
 			{
-				if(verbose) printf("OK ");
+				if(verbose) say(&tr->report, "OK ");
+				log_timing(halftrack, "verify", (int)i, start, lenn, "match");
 				break;
 			}
 
 			// compare sector data
-			if (compare_sectors(cbufo, cbufn, leno, lenn, diskid, diskid, halftrack, errorstring) == sector_map[halftrack/2])
+			if (compare_sectors(tr->cbufo, cbufn, tr->leno, lenn, diskid, diskid, halftrack, tr->errorstring) == sector_map[halftrack/2])
 			{
-				if(verbose) printf(" - sector match ");
-				fprintf(fplog, " - sector match ");
+				if(verbose) say(&tr->report, " - sector match ");
+				note(&tr->report, " - sector match ");
+				log_timing(halftrack, "verify", (int)i, start, lenn, "sector match");
 				break;
 			}
 			else
 			{
-				if(verbose) printf(" - NO sector match ");
-				fprintf(fplog, " - NO sector match ");
-				fprintf(fplog, "%s", errorstring);
-				if(verbose) printf("%s", errorstring);
+				log_timing(halftrack, "verify", (int)i, start, lenn, "mismatch");
+				if(verbose) say(&tr->report, " - NO sector match ");
+				note(&tr->report, " - NO sector match ");
+				note(&tr->report, "%s", tr->errorstring);
+				if(verbose) say(&tr->report, "%s", tr->errorstring);
 			}
 		}
 	}
 
-	fprintf(fplog, "%s (%d)", errorstring, leno);
-	memcpy(buffer, bufo, NIB_TRACK_LENGTH);
-	return denso;
+	note(&tr->report, "%s (%d)", tr->errorstring, tr->leno);
+	memcpy(buffer, tr->bufo, NIB_TRACK_LENGTH);
+	log_timing(halftrack, "track", (int)tr->pass, tr->start, tr->leno, read_result[tr->result]);
+	return tr->denso;
+}
+
+BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
+{
+	static track_read tr;
+
+	begin_read(&tr, halftrack, 0);
+	capture_read(fd, &tr, -1);
+	tr.result = analyze_read(&tr);
+	return finish_read(fd, &tr, buffer);
+}
+
+/*
+	Two stage read: a worker analyzes the first read of a track while the
+	drive steps to the next track and reads it.  Only if the analysis asks
+	for more reads or a verify does the head go back.  The output of each
+	track is held back until the track is done, so it stays in order.
+	Retries of a track come after the read of the next one, so weak bits
+	may read back different from a sequential read.
+*/
+static void
+read_pipelined(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density)
+{
+	static track_read reads[2];
+	track_read *current = &reads[0], *next = &reads[1], *done;
+	job_thread *thread;
+	int track;
+
+	if (start_track > end_track)
+		return;
+
+	/* the worker decodes GCR, its tables are set up once before it starts */
+	init_GCR_tables();
+
+	begin_read(current, start_track, 1);
+	capture_read(fd, current, -1);
+
+	for (track = start_track; track <= end_track; track += track_inc)
+	{
+		thread = start_job(analyze_job, current, 0);
+
+		if (track + track_inc <= end_track)
+		{
+			begin_read(next, track + track_inc, 1);
+			capture_read(fd, next, -1);
+		}
+
+		wait_job(thread);
+
+		track_density[track] = finish_read(fd, current, track_buffer + (track * NIB_TRACK_LENGTH));
+		release_report(&current->report);
+
+		done = current;
+		current = next;
+		next = done;
+	}
 }
 
 int
@@ -333,9 +569,15 @@ read_floppy(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 
 	if(!rawmode) get_disk_id(fd);
 
-	//for (track = end_track; track >= start_track; track -= track_inc)
-	for (track = start_track; track <= end_track; track += track_inc)
-		track_density[track] = paranoia_read_halftrack(fd, track, track_buffer + (track * NIB_TRACK_LENGTH));
+	/* the GCR routines print right away when verbose, that can't wait */
+	if ((pipeline) && (!ctx.verbose))
+		read_pipelined(fd, track_buffer, track_density);
+	else
+	{
+		//for (track = end_track; track >= start_track; track -= track_inc)
+		for (track = start_track; track <= end_track; track += track_inc)
+			track_density[track] = paranoia_read_halftrack(fd, track, track_buffer + (track * NIB_TRACK_LENGTH));
+	}
 
 	step_to_halftrack(fd, 18*2);
 	printf("\n");
@@ -350,6 +592,7 @@ int write_nb2(CBM_FILE fd, char * filename)
 	BYTE pass_density;
 	BYTE buffer[NIB_TRACK_LENGTH];
 	char header[0x100];
+	double start;
 
 	printf("\n");
 	fprintf(fplog,"\n");
@@ -399,13 +642,18 @@ int write_nb2(CBM_FILE fd, char * filename)
 			{
 				for (i = 0; i < 10; i++)
 				{
+					start = timing_now();
 					send_mnib_cmd(fd, FL_READWOSYNC, NULL, 0);
 					burst_read(fd);
 
 					if (burst_read_track(fd, buffer, NIB_TRACK_LENGTH))
+					{
+						log_timing(track, "read", i, start, NIB_TRACK_LENGTH, "ok");
 						break;
+					}
 					else
 					{
+						log_timing(track, "read", i, start, 0, "timeout");
 						// If we got a timeout, reset the port before retrying.
 						//putchar('?');
 						fflush(stdout);
@@ -671,3 +919,194 @@ int TrackAlignmentReport(CBM_FILE fd)
 
 	exit(1);
 }
+
+/* transfer benchmark, one kind and size of transfer */
+typedef struct
+{
+	char *name;
+	unsigned int size;
+	int runs;
+	int timeouts;
+	int errors;			/* data differs from the first good run */
+	double total;		/* ms of the good runs */
+	double *ms;
+} transfer_bench;
+
+static int
+compare_ms(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest rank, over the good runs */
+static double
+percentile_ms(transfer_bench *tb, int percent)
+{
+	int good = tb->runs - tb->timeouts, rank;
+
+	rank = (good * percent + 99) / 100;
+	if (rank < 1) rank = 1;
+	return tb->ms[rank - 1];
+}
+
+static void
+report_bench(transfer_bench *tb)
+{
+	int good = tb->runs - tb->timeouts;
+
+	printf("%-18s %5u %5d %8d %6d", tb->name, tb->size, tb->runs, tb->timeouts, tb->errors);
+	if (!good)
+	{
+		printf("       -       -       -       -       -\n");
+		return;
+	}
+
+	qsort(tb->ms, good, sizeof(double), compare_ms);
+	printf(" %7.1f %7.2f %7.2f %7.2f %7.2f\n",
+		(tb->total > 0) ? (double)tb->size * good / tb->total : 0.0,
+		percentile_ms(tb, 50), percentile_ms(tb, 90), percentile_ms(tb, 99), tb->ms[good - 1]);
+}
+
+/* time one transfer, 'ok' is what the burst call returned */
+static int
+add_bench(transfer_bench *tb, double start, int ok, BYTE *data, BYTE *first)
+{
+	double ms = clock_ms() - start;
+
+	tb->runs++;
+	if (!ok)
+	{
+		tb->timeouts++;
+		return 0;
+	}
+
+	if (first)
+	{
+		if (tb->runs == tb->timeouts + 1)
+			memcpy(first, data, tb->size);
+		else if (memcmp(first, data, tb->size))
+			tb->errors++;
+	}
+
+	tb->ms[tb->runs - tb->timeouts - 1] = ms;
+	tb->total += ms;
+	return 1;
+}
+
+/*
+	Times each kind of burst transfer over the link the drive code uses,
+	SRQ or parallel; run again with -P to time the parallel link of a 1571.
+	A run is timed from the command to the last byte, the way the imaging
+	routines use it.  Reads of the track are bound by the disk, writes go
+	to track 41.5, which gets destroyed.
+*/
+void
+benchmark_transfers(CBM_FILE fd, int iterations, int writes)
+{
+	static unsigned int write_size[] = { 0x400, 0x1000, 0x1c00 };
+	transfer_bench bench[6];
+	BYTE buffer[NIB_TRACK_LENGTH], first[NIB_TRACK_LENGTH], pattern[NIB_TRACK_LENGTH];
+	double start;
+	int i, j, count;
+
+	memset(bench, 0, sizeof(bench));
+	bench[0].name = "burst_read_n";
+	bench[0].size = 0x100 + 1;
+	bench[1].name = "burst_read_n";
+	bench[1].size = (0x800 - 0x300) + 1;
+	bench[2].name = "burst_read_track";
+	bench[2].size = NIB_TRACK_LENGTH;
+	count = 3;
+
+	if (writes)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			bench[count].name = "burst_write_track";
+			bench[count].size = write_size[j];
+			count++;
+		}
+	}
+
+	for (j = 0; j < count; j++)
+	{
+		if ((bench[j].ms = (double *) malloc(iterations * sizeof(double))) == NULL)
+		{
+			printf("Out of memory for the benchmark\n");
+			exit(2);
+		}
+	}
+
+	printf("Benchmarking transfers over %s, %d runs each\n",
+		(use_floppycode_srq) ? "SRQ" : "parallel", iterations);
+
+	/* FL_TEST and FL_VERIFY_CODE send a fixed block and a $00 */
+	for (i = 0; i < iterations; i++)
+	{
+		start = clock_ms();
+		send_mnib_cmd(fd, FL_TEST, NULL, 0);
+		add_bench(&bench[0], start, burst_read_n(fd, buffer, bench[0].size), buffer, first);
+	}
+
+	for (i = 0; i < iterations; i++)
+	{
+		start = clock_ms();
+		send_mnib_cmd(fd, FL_VERIFY_CODE, NULL, 0);
+		add_bench(&bench[1], start, burst_read_n(fd, buffer, bench[1].size), buffer, first);
+	}
+
+	motor_on(fd);
+	step_to_halftrack(fd, 18 * 2);
+	set_density(fd, speed_map[18]);
+
+	for (i = 0; i < iterations; i++)
+	{
+		start = clock_ms();
+		send_mnib_cmd(fd, FL_READWOSYNC, NULL, 0);
+		burst_read(fd);
+		if (!add_bench(&bench[2], start, burst_read_track(fd, buffer, NIB_TRACK_LENGTH), buffer, NULL))
+		{
+			// If we got a timeout, reset the port before the next run.
+			burst_read(fd);
+			burst_read(fd);
+		}
+	}
+
+	if (writes)
+	{
+		printf("Track 41.5 will be destroyed!\n");
+		step_to_halftrack(fd, 83);
+		set_density(fd, 2);
+
+		/* no $00, the parallel drive code would end the write there */
+		memset(pattern, 0x55, sizeof(pattern));
+
+		for (j = 3; j < count; j++)
+		{
+			for (i = 0; i < iterations; i++)
+			{
+				start = clock_ms();
+				send_mnib_cmd(fd, FL_WRITE, NULL, 0);
+				burst_write(fd, 0x03);	/* don't wait for the index hole */
+				burst_write(fd, 0x00);	/* nor for a sync */
+				if (!add_bench(&bench[j], start, burst_write_track(fd, pattern, bench[j].size), pattern, NULL))
+				{
+					burst_read(fd);
+					test_par_port(fd);
+				}
+			}
+		}
+	}
+
+	step_to_halftrack(fd, 18 * 2);
+
+	printf("\n%-18s %5s %5s %8s %6s %7s %7s %7s %7s %7s\n",
+		"transfer", "bytes", "runs", "timeouts", "errors", "kB/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	for (j = 0; j < count; j++)
+	{
+		report_bench(&bench[j]);
+		free(bench[j].ms);
+	}
+}
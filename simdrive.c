@@ -0,0 +1,689 @@
+/*
+ * NIBTOOL virtual drive
+ *
+ * Takes the place of the cable and the 1541/1571 running the nibtools drive
+ * code, so nibread and nibwrite can run without hardware:
+ *
+ *	-@sim:<image>[,option=n,...]
+ *
+ * The image (NIB, NBZ, G64 or D64) is the disk in the drive.  Options:
+ *
+ *	rpm=n		rotation speed (default 300)
+ *	rate=n		transfer rate in bytes per second (default: no limit)
+ *	latency=n	microseconds added to every transfer (default 0)
+ *	timeout=n	one in n track transfers times out (default 0, never)
+ *	noise=n		bits flipped at random in every track read
+ *	seed=n		seed for timeouts and noise
+ *	drive=n		1541 (default) or 1571
+ *
+ * The drive has an index hole sensor, the hole is where the image track
+ * starts.  Weak bits ($00 bytes on the disk) read back as random bytes.
+ * The disk turns on a virtual clock that only advances with the drive's own
+ * work, so where a read starts depends on what was asked before, not on the
+ * speed of the host.
+ * Writes change the disk in memory only, the image file is never touched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mnibarch.h"
+#include "gcr.h"
+#include "nibtools.h"
+
+#define SIM_HALFTRACKS	(MAX_HALFTRACKS_1541 + 2)
+#define SIM_STEP_US	5000	/* per halftrack, see _step_dest */
+
+/* what burst_read_track/burst_write_track will move */
+#define SIM_IDLE	0
+#define SIM_READ	1
+#define SIM_WRITE	2
+#define SIM_PROBE	3	/* index hole sensor check, all $00 when there is one */
+
+static BYTE sim_buffer[SIM_HALFTRACKS * NIB_TRACK_LENGTH];
+static BYTE sim_density[SIM_HALFTRACKS];
+static size_t sim_length[SIM_HALFTRACKS];
+static BYTE sim_alignment[SIM_HALFTRACKS];
+
+static BYTE sim_code[0x800 - 0x300];
+static BYTE sim_out[0x600];
+static int sim_head, sim_tail;
+static BYTE sim_cmd[32];
+static int sim_cmdlen;
+
+static int halftrack = 36;
+static BYTE via_1c00;
+static int running;
+static int pending = SIM_IDLE;
+static size_t start;	/* where the pending transfer begins on the track */
+static int timed_out;
+static double clock_us;
+static double owed_us;
+
+static int sim_rpm = 300;
+static long sim_rate;
+static long sim_latency;
+static int sim_timeout;
+static int sim_noise;
+static unsigned int disk_seed = 1, cable_seed = 2;
+static int sim_drivetype = 1541;
+
+/* xorshift, the disk and the cable draw from their own sequences */
+static unsigned int
+sim_random(unsigned int *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/* real time spent on the cable, slept off in whole milliseconds */
+static void
+sim_transfer(unsigned int bytes)
+{
+	owed_us += sim_latency;
+	if (sim_rate)
+		owed_us += (double) bytes * 1000000 / sim_rate;
+
+	if (owed_us >= 1000)
+	{
+		delay((int) (owed_us / 1000));
+		owed_us -= (int) (owed_us / 1000) * 1000;
+	}
+}
+
+static BYTE
+bitrate(void)
+{
+	return (via_1c00 >> 5) & 3;
+}
+
+/* bytes in one revolution when written at the current bitrate */
+static size_t
+revolution(void)
+{
+	static const long density_bytes[] = { DENSITY0, DENSITY1, DENSITY2, DENSITY3 };
+	size_t length;
+
+	length = density_bytes[bitrate()] / sim_rpm;
+	if (length > NIB_TRACK_LENGTH)
+		length = NIB_TRACK_LENGTH;
+	return length;
+}
+
+/* microseconds one byte of the current track takes to pass the head */
+static double
+byte_time(void)
+{
+	size_t length = sim_length[halftrack];
+
+	if (!length)
+		length = revolution();
+	return 60000000.0 / sim_rpm / length;
+}
+
+static size_t
+position(void)
+{
+	size_t length = sim_length[halftrack];
+
+	if (!length)
+		return 0;
+	return (size_t) (clock_us / byte_time()) % length;
+}
+
+static BYTE
+track_byte(size_t pos)
+{
+	size_t length = sim_length[halftrack];
+
+	return sim_buffer[halftrack * NIB_TRACK_LENGTH + pos % length];
+}
+
+/* a sync (10 or more one bits) ends right before pos */
+static int
+sync_ends(size_t pos)
+{
+	size_t length = sim_length[halftrack];
+
+	pos += length;
+	return (track_byte(pos - 1) == 0xff) && ((track_byte(pos - 2) & 0x03) == 0x03) &&
+		(track_byte(pos) != 0xff);
+}
+
+/* bytes to wait from pos until the drive sees what it waits for, -1 if never */
+static long
+wait_sync(size_t pos)
+{
+	size_t i;
+
+	for (i = 0; i < sim_length[halftrack]; i++)
+		if (sync_ends(pos + i))
+			return (long) i;
+	return -1;
+}
+
+static long
+wait_marker(size_t pos, BYTE marker)
+{
+	size_t i;
+
+	for (i = 0; i < sim_length[halftrack]; i++)
+		if (track_byte(pos + i) == marker)
+			return (long) i + 1;
+	return -1;
+}
+
+static BYTE
+scan_killer(void)
+{
+	size_t i, bytes = 0;
+
+	if ((!sim_length[halftrack]) || (wait_sync(0) < 0))
+	{
+		for (i = 0; i < sim_length[halftrack]; i++)
+			if (track_byte(i) != 0xff)
+				break;
+		/* nothing but sync never ends one */
+		if ((sim_length[halftrack]) && (i == sim_length[halftrack]))
+			return BM_FF_TRACK;
+		return BM_NO_SYNC;
+	}
+
+	for (i = 0; i < sim_length[halftrack]; i++)
+		if (track_byte(i) != 0xff)
+			bytes++;
+	return (bytes < 0x100) ? BM_FF_TRACK : 0;
+}
+
+static void
+send(BYTE value)
+{
+	if (sim_tail < (int) sizeof(sim_out))
+		sim_out[sim_tail++] = value;
+}
+
+/* the drive code handles one complete command, see _command_table */
+static void
+execute(BYTE cmd, BYTE *args)
+{
+	size_t i, length;
+	long wait;
+	BYTE ack = 0;
+
+	if ((use_floppycode_ihs) && (cmd >= FL_IHS_ON))
+	{
+		/* the index hole is where the image track starts */
+		switch (cmd)
+		{
+		case FL_IHS_READ_SCP:
+			cmd = FL_READIHS;
+			break;
+
+		case FL_IHS_PRESENT:
+			send(0);
+			pending = SIM_PROBE;
+			return;
+
+		default:
+			/* FL_DBR_ANALYSIS and FL_READ_MEM are not emulated */
+			send(0);
+			return;
+		}
+	}
+
+	switch (cmd)
+	{
+	case FL_STEPTO:
+		if ((args[0]) && (args[0] < SIM_HALFTRACKS))
+		{
+			clock_us += abs(args[0] - halftrack) * SIM_STEP_US;
+			halftrack = args[0];
+		}
+		break;
+
+	case FL_MOTOR:
+		via_1c00 = (via_1c00 & args[0]) | args[1];
+		break;
+
+	case FL_DENSITY:
+		/* the first argument patches the read loop, the rest sets the bitrate */
+		via_1c00 = (via_1c00 & args[1]) | args[2];
+		break;
+
+	case FL_RESET:
+		/* the drive leaves our code for DOS */
+		running = 0;
+		return;
+
+	case FL_READWOSYNC:
+	case FL_READNORMAL:
+	case FL_READIHS:
+	case FL_READMARKER:
+		send(0);
+		pending = SIM_READ;
+		timed_out = 0;
+		start = position();
+		if (!sim_length[halftrack])
+			return;
+
+		if (cmd == FL_READIHS)
+			wait = (long) (sim_length[halftrack] - start);
+		else if (cmd == FL_READNORMAL)
+			wait = wait_sync(start);
+		else if (cmd == FL_READMARKER)
+			wait = wait_marker(start, args[0]);
+		else
+			wait = 0;
+
+		/* the drive waits forever, the host runs into its timeout */
+		if (wait < 0)
+			timed_out = 1;
+		else
+		{
+			clock_us += wait * byte_time();
+			start = (start + wait) % sim_length[halftrack];
+		}
+		return;
+
+	case FL_SCANKILLER:
+		clock_us += byte_time() * (sim_length[halftrack] ? sim_length[halftrack] : revolution());
+		ack = scan_killer();
+		break;
+
+	case FL_SCANDENSITY:
+		/* statistic for bitrates 1-4, highest density first */
+		clock_us += 60000000.0 / sim_rpm;
+		for (i = 0; i < 4; i++)
+			send(((sim_length[halftrack]) && ((sim_density[halftrack] & 3) == 3 - i)) ? 0x70 : 0);
+		break;
+
+	case FL_READMOTOR:
+		ack = via_1c00;
+		break;
+
+	case FL_TEST:
+		for (i = 0; i < 0x100; i++)
+			send((BYTE) i);
+		break;
+
+	case FL_WRITE:
+		pending = SIM_WRITE;
+		timed_out = 0;
+		start = position();
+		if (!sim_length[halftrack])
+			return;
+
+		if (!args[0])
+			wait = (long) (sim_length[halftrack] - start);
+		else if (args[1])
+			wait = wait_sync(start);
+		else
+			wait = 0;
+
+		if (wait < 0)
+			timed_out = 1;
+		else
+		{
+			clock_us += wait * byte_time();
+			start = (start + wait) % sim_length[halftrack];
+		}
+		return;
+
+	case FL_CAPACITY:
+		/* $2000 bytes of $55 and a short sync, then count one revolution */
+		length = revolution();
+		memset(sim_buffer + halftrack * NIB_TRACK_LENGTH, 0x55, length);
+		memset(sim_buffer + halftrack * NIB_TRACK_LENGTH + length - 5, 0xff, 5);
+		sim_length[halftrack] = length;
+		sim_density[halftrack] = bitrate();
+		clock_us += (0x2000 + length) * byte_time();
+		send((BYTE) (length & 0xff));
+		ack = (BYTE) (length >> 8);
+		break;
+
+	case FL_VERIFY_CODE:
+		for (i = 0; i < sizeof(sim_code); i++)
+			send(sim_code[i]);
+		break;
+
+	case FL_FILLTRACK:
+		length = revolution();
+		memset(sim_buffer + halftrack * NIB_TRACK_LENGTH, args[0], length);
+		sim_length[halftrack] = length;
+		sim_density[halftrack] = bitrate();
+		clock_us += 0x2000 * byte_time();
+		break;
+
+	default:
+		/* FL_ALIGNDISK is not emulated */
+		break;
+	}
+
+	send(ack);
+}
+
+static int
+arguments(BYTE cmd)
+{
+	switch (cmd)
+	{
+	case FL_STEPTO:
+	case FL_ALIGNDISK:
+	case FL_FILLTRACK:
+		return 1;
+	case FL_MOTOR:
+	case FL_WRITE:
+		return 2;
+	case FL_DENSITY:
+		return 3;
+	case FL_READMARKER:
+		return use_floppycode_ihs ? 0 : 1;
+	}
+	return 0;
+}
+
+/* bytes from the host, commands start with $00,$55,$aa,$ff like in _read_command */
+static void
+receive(BYTE c)
+{
+	static const BYTE header[] = { 0x00, 0x55, 0xaa, 0xff };
+
+	if (!running)
+		return;
+
+	if (sim_cmdlen < 4)
+	{
+		if (c == header[sim_cmdlen])
+			sim_cmdlen++;
+		else
+			sim_cmdlen = (c == header[0]) ? 1 : 0;
+		return;
+	}
+
+	sim_cmd[sim_cmdlen++] = c;
+	if (sim_cmdlen < 5 + arguments(sim_cmd[4]))
+		return;
+
+	/* whatever the host left of the last answer is lost */
+	sim_head = sim_tail = 0;
+	pending = SIM_IDLE;
+	sim_cmdlen = 0;
+	execute(sim_cmd[4], sim_cmd + 5);
+}
+
+static unsigned char
+sim_read(void)
+{
+	sim_transfer(1);
+	if (sim_head < sim_tail)
+		return sim_out[sim_head++];
+	return 0;
+}
+
+static void
+sim_write(unsigned char c)
+{
+	sim_transfer(1);
+	receive(c);
+}
+
+static int
+sim_read_n(unsigned char *buffer, unsigned int length)
+{
+	unsigned int i;
+
+	sim_transfer(length);
+	for (i = 0; i < length; i++)
+		buffer[i] = (sim_head < sim_tail) ? sim_out[sim_head++] : 0;
+	return 1;
+}
+
+static int
+sim_write_n(unsigned char *buffer, unsigned int length)
+{
+	unsigned int i;
+
+	sim_transfer(length);
+	for (i = 0; i < length; i++)
+		receive(buffer[i]);
+	return 1;
+}
+
+static int
+transfer_failed(int what)
+{
+	if ((pending != what) || (timed_out))
+		return 1;
+	return (sim_timeout) && (sim_random(&cable_seed) % sim_timeout == 0);
+}
+
+static int
+sim_read_track(unsigned char *buffer, unsigned int length)
+{
+	unsigned int i, bit;
+
+	sim_transfer(length);
+	if (pending == SIM_PROBE)
+	{
+		pending = SIM_IDLE;
+		memset(buffer, 0, length);
+		return 1;
+	}
+
+	if (transfer_failed(SIM_READ))
+	{
+		pending = SIM_IDLE;
+		return 0;
+	}
+	pending = SIM_IDLE;
+
+	for (i = 0; i < length; i++)
+	{
+		buffer[i] = sim_length[halftrack] ? track_byte(start + i) : 0;
+		if (!buffer[i])
+			buffer[i] = (BYTE) sim_random(&disk_seed);
+	}
+
+	for (i = 0; i < (unsigned int) sim_noise; i++)
+	{
+		bit = sim_random(&disk_seed) % (length * 8);
+		buffer[bit >> 3] ^= 1 << (bit & 7);
+	}
+
+	clock_us += length * byte_time();
+	return 1;
+}
+
+static int
+sim_write_track(unsigned char *buffer, unsigned int length)
+{
+	BYTE track[NIB_TRACK_LENGTH], *data;
+	size_t i, size, old;
+
+	sim_transfer(length);
+	if (transfer_failed(SIM_WRITE))
+	{
+		pending = SIM_IDLE;
+		return 0;
+	}
+	pending = SIM_IDLE;
+
+	/* the parallel code stops at $00 and writes $01 as weak $00, see _write_track */
+	if (!use_floppycode_srq)
+	{
+		for (i = 0; (i < length) && (buffer[i]); i++)
+			;
+		length = (unsigned int) i;
+	}
+
+	/* the track is as long as the bitrate it gets written with makes it */
+	data = sim_buffer + halftrack * NIB_TRACK_LENGTH;
+	size = revolution();
+	old = sim_length[halftrack];
+	for (i = 0; i < size; i++)
+		track[i] = old ? data[i % old] : 0x00;
+	if (old)
+		start = start * size / old;
+
+	for (i = 0; i < length; i++)
+		track[(start + i) % size] = (buffer[i] == 0x01 && !use_floppycode_srq) ? 0x00 : buffer[i];
+
+	memcpy(data, track, size);
+	sim_length[halftrack] = size;
+	sim_density[halftrack] = bitrate();
+	clock_us += length * byte_time();
+	return 1;
+}
+
+static int
+sim_upload(unsigned char *code, unsigned int length)
+{
+	if (length > sizeof(sim_code))
+		length = sizeof(sim_code);
+
+	memset(sim_code, 0, sizeof(sim_code));
+	memcpy(sim_code, code, length);
+
+	/* the code starts in _flop_main and reports in from its main loop */
+	running = 1;
+	halftrack = 36;
+	via_1c00 &= 0xf3;
+	sim_head = sim_tail = sim_cmdlen = 0;
+	send(0);
+	return 0;
+}
+
+static void
+sim_status(char *buffer, int size)
+{
+	char status[40];
+
+	sprintf(status, "73,CBM DOS V2.6 %d,00,00", sim_drivetype);
+	strncpy(buffer, status, size);
+	buffer[size - 1] = '\0';
+}
+
+static drive_transport sim_transport = {
+	sim_read,
+	sim_write,
+	sim_read_n,
+	sim_write_n,
+	sim_read_track,
+	sim_write_track,
+	sim_upload,
+	sim_status,
+};
+
+static int
+load_disk(char *filename)
+{
+	nib_context ctx;
+	BYTE *file_buffer;
+	int track, result;
+
+	init_context(&ctx);
+
+	if (compare_extension(filename, "D64"))
+		result = read_d64(&ctx, filename, sim_buffer, sim_density, sim_length);
+	else if (compare_extension(filename, "G64"))
+		result = read_g64(&ctx, filename, sim_buffer, sim_density, sim_length);
+	else if ((compare_extension(filename, "NIB")) || (compare_extension(filename, "NBZ")))
+	{
+		if ((file_buffer = (BYTE *) malloc(SIM_HALFTRACKS * NIB_TRACK_LENGTH)) == NULL)
+		{
+			printf("Out of memory for the virtual disk\n");
+			return 0;
+		}
+		result = read_nib_file(&ctx, filename, file_buffer, SIM_HALFTRACKS * NIB_TRACK_LENGTH,
+			sim_buffer, sim_density, sim_length);
+		free(file_buffer);
+
+		/* a NIB track holds more than one revolution, keep just one */
+		if (result)
+			align_tracks(&ctx, sim_buffer, sim_density, sim_length, sim_alignment);
+	}
+	else
+	{
+		printf("Unknown image type for the virtual disk\n");
+		return 0;
+	}
+
+	if (!result)
+		return 0;
+
+	for (track = 0; track < SIM_HALFTRACKS; track++)
+	{
+		if (sim_length[track] > NIB_TRACK_LENGTH)
+			sim_length[track] = NIB_TRACK_LENGTH;
+		if (!check_formatted(sim_buffer + track * NIB_TRACK_LENGTH, sim_length[track]))
+			sim_length[track] = 0;
+	}
+	return 1;
+}
+
+/* use the virtual drive described by spec (image and options) from now on */
+int
+sim_open(char *spec)
+{
+	static char filename[256];
+	char *option, *value;
+
+	strncpy(filename, spec, sizeof(filename) - 1);
+	option = strchr(filename, ',');
+	if (option)
+		*option++ = '\0';
+
+	while (option)
+	{
+		value = strchr(option, '=');
+		spec = strchr(option, ',');
+		if (spec)
+			*spec++ = '\0';
+		if (!value)
+		{
+			printf("Virtual drive option '%s' needs a value\n", option);
+			return 0;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(option, "rpm"))
+			sim_rpm = atoi(value);
+		else if (!strcmp(option, "rate"))
+			sim_rate = atol(value);
+		else if (!strcmp(option, "latency"))
+			sim_latency = atol(value);
+		else if (!strcmp(option, "timeout"))
+			sim_timeout = atoi(value);
+		else if (!strcmp(option, "noise"))
+			sim_noise = atoi(value);
+		else if (!strcmp(option, "seed"))
+		{
+			disk_seed = (unsigned int) atol(value) * 2 + 1;
+			cable_seed = disk_seed + 2;
+		}
+		else if (!strcmp(option, "drive"))
+			sim_drivetype = atoi(value);
+		else
+		{
+			printf("Unknown virtual drive option '%s'\n", option);
+			return 0;
+		}
+		option = spec;
+	}
+
+	if ((sim_rpm < 250) || (sim_rpm > 350) || ((sim_drivetype != 1541) && (sim_drivetype != 1571)))
+	{
+		printf("Virtual drive needs 250-350 RPM and a 1541 or 1571\n");
+		return 0;
+	}
+
+	if (!load_disk(filename))
+		return 0;
+
+	printf("Virtual %d at %d RPM with \"%s\"\n", sim_drivetype, sim_rpm, filename);
+	transport = &sim_transport;
+	return 1;
+}
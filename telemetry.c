@@ -0,0 +1,118 @@
+/*
+ * Per-track timing for NIBTOOLS
+ * nibread and nibwrite log every step of a halftrack with -W<file>: head
+ * steps, density scans, each burst transfer, retries, host side extraction
+ * and verifies, with wall time, bytes and result ("timeout" when the burst
+ * transfer gave up).  The file is JSON Lines, or CSV if its name ends in .csv.
+ *
+ * One record per line:
+ *   tool      nibread or nibwrite
+ *   halftrack the halftrack, track is halftrack/2
+ *   event     step, scan, read, write, fill, extract, retry, verify or track
+ *   attempt   number of the transfer, pass or verify for this halftrack
+ *   start     ms since the file was opened
+ *   ms        wall time of the event
+ *   bytes     bytes transferred, or the track length found by extract/verify
+ *   result    ok, timeout, or how a retry, verify or track ended
+ *
+ * "track" spans the whole halftrack.  With -N (nibread) or -J (nibwrite)
+ * the host work of one track runs next to the transfers of the next, so
+ * tracks overlap and extract is timed on the worker thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(WIN32) || defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "telemetry.h"
+
+char *timing_file = NULL;
+
+static FILE *fptiming = NULL;
+static char *timing_tool;
+static int timing_csv;
+static double timing_base;
+
+/* a steady clock in ms, also for the transfer benchmark */
+double
+clock_ms(void)
+{
+#if defined(WIN32) || defined(_WIN32)
+	LARGE_INTEGER count, frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double)count.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#elif defined(DJGPP)
+	return (double)uclock() * 1000.0 / UCLOCKS_PER_SEC;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1000000.0;
+#endif
+}
+
+int
+open_timing(char *filename, char *tool)
+{
+	char *dotpos;
+
+	if ((fptiming = fopen(filename, "w")) == NULL)
+	{
+		printf("Couldn't create timing file %s!\n", filename);
+		return 0;
+	}
+
+	timing_tool = tool;
+	dotpos = strrchr(filename, '.');
+	timing_csv = ((dotpos != NULL) && (!strcmp(dotpos, ".csv") || !strcmp(dotpos, ".CSV")));
+	timing_base = clock_ms();
+
+	if (timing_csv)
+		fprintf(fptiming, "tool,halftrack,track,event,attempt,start,ms,bytes,result\n");
+
+	return 1;
+}
+
+void
+close_timing(void)
+{
+	if (fptiming) fclose(fptiming);
+	fptiming = NULL;
+}
+
+/* start of an event, for log_timing() */
+double
+timing_now(void)
+{
+	if (!fptiming)
+		return 0;
+
+	return clock_ms() - timing_base;
+}
+
+/* one fprintf per record, stdio keeps records of worker threads whole */
+void
+log_timing(int halftrack, char *event, int attempt, double start, size_t bytes, char *result)
+{
+	double ms;
+
+	if (!fptiming)
+		return;
+
+	ms = timing_now() - start;
+
+	if (timing_csv)
+		fprintf(fptiming, "%s,%d,%.1f,%s,%d,%.3f,%.3f,%u,%s\n",
+			timing_tool, halftrack, (float)halftrack / 2, event, attempt, start, ms, (unsigned int)bytes, result);
+	else
+		fprintf(fptiming, "{\"tool\":\"%s\",\"halftrack\":%d,\"track\":%.1f,\"event\":\"%s\",\"attempt\":%d,"
+			"\"start\":%.3f,\"ms\":%.3f,\"bytes\":%u,\"result\":\"%s\"}\n",
+			timing_tool, halftrack, (float)halftrack / 2, event, attempt, start, ms, (unsigned int)bytes, result);
+}
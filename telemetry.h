@@ -0,0 +1,14 @@
+/* telemetry.h */
+
+#ifndef _telemetry_h
+#define _telemetry_h
+
+extern char *timing_file;
+
+double clock_ms(void);
+int open_timing(char *filename, char *tool);
+void close_timing(void);
+double timing_now(void);
+void log_timing(int halftrack, char *event, int attempt, double start, size_t bytes, char *result);
+
+#endif /* _telemetry_h */
@@ -0,0 +1,332 @@
+/*
+ * Worker threads for NIBTOOLS
+ * Runs independent jobs (tracks, images) on a small pool of threads.
+ * Each worker takes the next job number until all are done, so the caller
+ * only has to keep the results of different jobs apart.
+ * start_job() runs a single job next to the caller, so host work can go on
+ * while the caller talks to the drive.
+ * DOS has no threads, jobs always run in order there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32) || defined(_WIN32)
+#include <windows.h>
+#define THREAD_WIN32
+#elif !defined(DJGPP)
+#include <pthread.h>
+#include <unistd.h>
+#define THREAD_POSIX
+#endif
+
+#include "thread.h"
+
+typedef struct
+{
+	job_func func;
+	void *arg;
+	int jobs;
+	int next;
+#if defined(THREAD_WIN32)
+	CRITICAL_SECTION lock;
+#elif defined(THREAD_POSIX)
+	pthread_mutex_t lock;
+#endif
+} job_queue;
+
+struct job_thread
+{
+	job_func func;
+	void *arg;
+	int job;
+	int running;
+#if defined(THREAD_WIN32)
+	HANDLE thread;
+#elif defined(THREAD_POSIX)
+	pthread_t thread;
+#endif
+};
+
+struct job_lock
+{
+#if defined(THREAD_WIN32)
+	CRITICAL_SECTION lock;
+#elif defined(THREAD_POSIX)
+	pthread_mutex_t lock;
+#else
+	int unused;
+#endif
+};
+
+int
+cpu_count(void)
+{
+	int n = 1;
+
+#if defined(THREAD_WIN32)
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	n = (int) info.dwNumberOfProcessors;
+#elif defined(THREAD_POSIX) && defined(_SC_NPROCESSORS_ONLN)
+	n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	if (n < 1)
+		n = 1;
+	if (n > MAX_WORKER_THREADS)
+		n = MAX_WORKER_THREADS;
+	return n;
+}
+
+static int
+next_job(job_queue *queue)
+{
+	int job;
+
+#if defined(THREAD_WIN32)
+	EnterCriticalSection(&queue->lock);
+#elif defined(THREAD_POSIX)
+	pthread_mutex_lock(&queue->lock);
+#endif
+
+	job = (queue->next < queue->jobs) ? queue->next++ : -1;
+
+#if defined(THREAD_WIN32)
+	LeaveCriticalSection(&queue->lock);
+#elif defined(THREAD_POSIX)
+	pthread_mutex_unlock(&queue->lock);
+#endif
+
+	return job;
+}
+
+#if defined(THREAD_WIN32)
+static DWORD WINAPI
+worker(LPVOID param)
+#else
+static void *
+worker(void *param)
+#endif
+{
+	job_queue *queue = (job_queue *) param;
+	int job;
+
+	while ((job = next_job(queue)) >= 0)
+		queue->func(queue->arg, job);
+
+	return 0;
+}
+
+/*
+ * Run func(arg, 0) .. func(arg, jobs-1) on up to 'workers' threads and
+ * wait for all of them.  Falls back to running in order if threads are
+ * not available or cannot be started.  Returns the number of threads used.
+ */
+int
+run_jobs(job_func func, void *arg, int jobs, int workers)
+{
+	job_queue queue;
+	int i, started = 0;
+#if defined(THREAD_WIN32)
+	HANDLE threads[MAX_WORKER_THREADS];
+#elif defined(THREAD_POSIX)
+	pthread_t threads[MAX_WORKER_THREADS];
+	pthread_attr_t attr;
+#endif
+
+	queue.func = func;
+	queue.arg = arg;
+	queue.jobs = jobs;
+	queue.next = 0;
+
+	if (workers > MAX_WORKER_THREADS)
+		workers = MAX_WORKER_THREADS;
+	if (workers > jobs)
+		workers = jobs;
+
+#if defined(THREAD_WIN32)
+	if (workers > 1)
+	{
+		InitializeCriticalSection(&queue.lock);
+
+		for (i = 0; i < workers - 1; i++)
+		{
+			threads[started] = CreateThread(NULL, WORKER_STACK_SIZE, worker, &queue, 0, NULL);
+			if (threads[started] == NULL)
+				break;
+			started++;
+		}
+
+		/* this thread is the last worker */
+		worker(&queue);
+
+		if (started)
+		{
+			WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+			for (i = 0; i < started; i++)
+				CloseHandle(threads[i]);
+		}
+		DeleteCriticalSection(&queue.lock);
+		return started + 1;
+	}
+#elif defined(THREAD_POSIX)
+	if (workers > 1)
+	{
+		pthread_mutex_init(&queue.lock, NULL);
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+
+		for (i = 0; i < workers - 1; i++)
+		{
+			if (pthread_create(&threads[started], &attr, worker, &queue) != 0)
+				break;
+			started++;
+		}
+		pthread_attr_destroy(&attr);
+
+		/* this thread is the last worker */
+		worker(&queue);
+
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+
+		pthread_mutex_destroy(&queue.lock);
+		return started + 1;
+	}
+#endif
+
+	for (i = 0; i < jobs; i++)
+		func(arg, i);
+	return 1;
+}
+
+#if defined(THREAD_WIN32)
+static DWORD WINAPI
+background(LPVOID param)
+#else
+static void *
+background(void *param)
+#endif
+{
+	job_thread *thread = (job_thread *) param;
+
+	thread->func(thread->arg, thread->job);
+	return 0;
+}
+
+/*
+ * Start func(arg, job) next to the calling thread, wait_job() waits for it
+ * and frees the handle.  If no thread can be started the job has already
+ * run when this returns.  Returns NULL only if out of memory, after
+ * running the job.
+ */
+job_thread *
+start_job(job_func func, void *arg, int job)
+{
+	job_thread *thread;
+
+	if ((thread = (job_thread *) malloc(sizeof(job_thread))) == NULL)
+	{
+		func(arg, job);
+		return NULL;
+	}
+
+	thread->func = func;
+	thread->arg = arg;
+	thread->job = job;
+	thread->running = 0;
+
+#if defined(THREAD_WIN32)
+	thread->thread = CreateThread(NULL, WORKER_STACK_SIZE, background, thread, 0, NULL);
+	thread->running = (thread->thread != NULL);
+#elif defined(THREAD_POSIX)
+	{
+		pthread_attr_t attr;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+		thread->running = (pthread_create(&thread->thread, &attr, background, thread) == 0);
+		pthread_attr_destroy(&attr);
+	}
+#endif
+
+	if (!thread->running)
+		func(arg, job);
+	return thread;
+}
+
+void
+wait_job(job_thread *thread)
+{
+	if (!thread)
+		return;
+
+	if (thread->running)
+	{
+#if defined(THREAD_WIN32)
+		WaitForSingleObject(thread->thread, INFINITE);
+		CloseHandle(thread->thread);
+#elif defined(THREAD_POSIX)
+		pthread_join(thread->thread, NULL);
+#endif
+	}
+	free(thread);
+}
+
+/* a lock for data that jobs share, NULL if it can't be created */
+job_lock *
+create_lock(void)
+{
+	job_lock *lock;
+
+	if ((lock = (job_lock *) malloc(sizeof(job_lock))) == NULL)
+		return NULL;
+
+#if defined(THREAD_WIN32)
+	InitializeCriticalSection(&lock->lock);
+#elif defined(THREAD_POSIX)
+	if (pthread_mutex_init(&lock->lock, NULL) != 0)
+	{
+		free(lock);
+		return NULL;
+	}
+#endif
+	return lock;
+}
+
+void
+enter_lock(job_lock *lock)
+{
+#if defined(THREAD_WIN32)
+	EnterCriticalSection(&lock->lock);
+#elif defined(THREAD_POSIX)
+	pthread_mutex_lock(&lock->lock);
+#endif
+}
+
+void
+leave_lock(job_lock *lock)
+{
+#if defined(THREAD_WIN32)
+	LeaveCriticalSection(&lock->lock);
+#elif defined(THREAD_POSIX)
+	pthread_mutex_unlock(&lock->lock);
+#endif
+}
+
+void
+destroy_lock(job_lock *lock)
+{
+	if (!lock)
+		return;
+
+#if defined(THREAD_WIN32)
+	DeleteCriticalSection(&lock->lock);
+#elif defined(THREAD_POSIX)
+	pthread_mutex_destroy(&lock->lock);
+#endif
+	free(lock);
+}
@@ -0,0 +1,24 @@
+/* thread.h */
+
+#ifndef _thread_h
+#define _thread_h
+
+#define MAX_WORKER_THREADS 64
+
+/* tracks can need a few hundred kB of stack for buffers and indexes */
+#define WORKER_STACK_SIZE (2 * 1024 * 1024)
+
+typedef void (*job_func)(void *arg, int job);
+typedef struct job_thread job_thread;
+typedef struct job_lock job_lock;
+
+int cpu_count(void);
+int run_jobs(job_func func, void *arg, int jobs, int workers);
+job_thread *start_job(job_func func, void *arg, int job);
+void wait_job(job_thread *thread);
+job_lock *create_lock(void);
+void enter_lock(job_lock *lock);
+void leave_lock(job_lock *lock);
+void destroy_lock(job_lock *lock);
+
+#endif /* _thread_h */
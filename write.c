@@ -12,21 +12,24 @@
 #include "mnibarch.h"
 #include "gcr.h"
 #include "nibtools.h"
+#include "thread.h"
+#include "telemetry.h"
 
-void
-master_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, size_t tracklen)
+extern nib_context ctx;
+
+/* lay out a track the way the drive code wants it, returns the number of bytes to send */
+static size_t
+build_track(BYTE *rawtrack, BYTE *track_buffer, BYTE *track_density, int track, size_t tracklen, BYTE fill)
 {
-	int i,leader;
-	static BYTE last_density = -1;
-	BYTE rawtrack[NIB_TRACK_LENGTH*2];
+	int leader;
 
 	if(track_inc==1) leader=0;
 	else leader=10;
 
 	//if(track_density[track] & BM_NO_SYNC)
-	//	memset(rawtrack, 0x55, sizeof(rawtrack));
+	//	memset(rawtrack, 0x55, NIB_TRACK_LENGTH*2);
 	//else
-		memset(rawtrack, fillbyte, sizeof(rawtrack));
+		memset(rawtrack, fill, NIB_TRACK_LENGTH*2);
 
 	/* merge track data */
 	memcpy(rawtrack + leader, track_buffer + (track * NIB_TRACK_LENGTH), tracklen);
@@ -42,30 +45,43 @@ master_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, si
 	}
 
 	/* handle short tracks */
-	if(tracklen < capacity[track_density[track]&3])
+	if(tracklen < ctx.capacity[track_density[track]&3])
 	{
-			if(verbose) printf("[pad:%d]", capacity[track_density[track]&3] - tracklen);
-			tracklen = capacity[track_density[track]&3];
+			if(verbose) printf("[pad:%d]", ctx.capacity[track_density[track]&3] - tracklen);
+			tracklen = ctx.capacity[track_density[track]&3];
 	}
 
 	/* replace 0x00 bytes by 0x01, as 0x00 indicates end of track */
 	if(!use_floppycode_srq)  // not in srq code
-		replace_bytes(rawtrack, sizeof(rawtrack), 0x00, 0x01);
+		replace_bytes(rawtrack, NIB_TRACK_LENGTH*2, 0x00, 0x01);
+
+	/* I think the +1 is because the last byte is not written 100%, but probably never matters */
+	return tracklen + leader + 1;
+}
+
+static void
+send_track(CBM_FILE fd, BYTE *rawtrack, BYTE density, int track, size_t rawlen)
+{
+	int i;
+	double start;
+	static BYTE last_density = -1;
 
 	/* step to destination track and set density */
-	if((fattrack)&&(track==fattrack+2))
+	start = timing_now();
+	if((ctx.fattrack)&&(track==ctx.fattrack+2))
 		step_to_halftrack(fd, track+1);
 	else
 		step_to_halftrack(fd, track);
+	log_timing(track, "step", 0, start, 0, "ok");
 
-	if((fattrack)&&((track==fattrack)||(track==fattrack+2)))
+	if((ctx.fattrack)&&((track==ctx.fattrack)||(track==ctx.fattrack+2)))
 			printf("[fat track]");
 
-	if((track_density[track]&3) != last_density)
+	if((density&3) != last_density)
 	{
-		set_density(fd, track_density[track]&3);
+		set_density(fd, density&3);
 		if(verbose>1) printf("[D]");
-		last_density = track_density[track]&3;
+		last_density = density&3;
 	}
 
 	// try to do track alignment through simple timers
@@ -83,6 +99,7 @@ master_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, si
 	/* burst send track */
 	for (i = 0; i < 3; i ++)
 	{
+		start = timing_now();
 		send_mnib_cmd(fd, FL_WRITE, NULL, 0);
 
 		/* Neither of these currently work with SRQ */
@@ -94,11 +111,14 @@ master_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, si
 		//burst_write(fd, (unsigned char)((align_disk) ? 0xfb : 0x00));
 		burst_write(fd, (unsigned char)(0x00));
 
-		/* I think the +1 is because the last byte is not written 100%, but probably never matters */
-		if (burst_write_track(fd, rawtrack, (int)(tracklen + leader + 1)))
+		if (burst_write_track(fd, rawtrack, (int)rawlen))
+		{
+			log_timing(track, "write", i, start, rawlen, "ok");
 			break;
+		}
 		else
 		{
+			log_timing(track, "write", i, start, 0, "timeout");
 			//putchar('?');
 			printf("(timeout) ");
 			fflush(stdin);
@@ -117,143 +137,284 @@ master_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, si
 }
 
 void
-master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+master_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, size_t tracklen)
 {
-	int track, verified, retries, added_sync=0, addsyncloops;
-	size_t badgcr, badgcr2, length, verlen, verlen2;
-	BYTE verbuf1[NIB_TRACK_LENGTH], verbuf2[NIB_TRACK_LENGTH], verbuf3[NIB_TRACK_LENGTH], align;
-	size_t gcr_match;
-	char errorstring[0x1000];
-	char fillbytesave;
+	BYTE rawtrack[NIB_TRACK_LENGTH*2];
+	size_t rawlen;
 
-	//if(track_inc==1) unformat_disk(fd);
+	rawlen = build_track(rawtrack, track_buffer, track_density, track, tracklen, ctx.fillbyte);
+	send_track(fd, rawtrack, track_density[track], track, rawlen);
+}
 
-	printf("Writing to disk");
+/*
+ * master_disk prepares a track completely on the host before it touches the
+ * drive, so with -J the next track can be prepared while this one is written
+ */
+typedef struct {
+	int track;
+	int state;
+	int show;
+	BYTE *track_buffer;
+	BYTE *track_density;
+	size_t *track_length;
+	size_t origlen;		/* length shown to the user, before adding sync */
+	size_t length;		/* compressed length, checked by the verify */
+	size_t rawlen;
+	BYTE rawtrack[NIB_TRACK_LENGTH*2];
+} track_write;
 
-	for (track=backwards?end_track:start_track; backwards?(track>=start_track):(track<=end_track); backwards?(track-=track_inc):(track+=track_inc))
+#define WRITE_TRACK	0
+#define WRITE_KILLER	1
+#define WRITE_EMPTY	2
+
+static void
+write_header(track_write *tw)
+{
+	int track = tw->track;
+	BYTE density = tw->track_density[track];
+
+	/* user display */
+	printf("\n%4.1f: (", (float)track/2);
+	printf("%d", density&3);
+	if ((density&3) != speed_map[track/2]) printf("!");
+	printf(":%d) ", tw->origlen);
+	if (density & BM_NO_SYNC) printf("NOSYNC ");
+	if (density & BM_FF_TRACK) printf("KILLER ");
+	printf("WRITE  ");
+}
+
+static void
+prepare_write(track_write *tw)
+{
+	int track = tw->track, added_sync=0, addsyncloops;
+	BYTE *gcrdata = tw->track_buffer + (track * NIB_TRACK_LENGTH);
+	BYTE *track_density = tw->track_density;
+	size_t *track_length = tw->track_length;
+	size_t badgcr;
+	BYTE fill;
+
+	/* double-check our sync-flag assumptions and process track for remaster */
+	track_density[track] = check_sync_flags(gcrdata, track_density[track], track_length[track]);
+	tw->origlen = track_length[track];
+
+	/* engineer killer track */
+	if(track_density[track] & BM_FF_TRACK)
+	{
+		tw->state = WRITE_KILLER;
+		return;
+	}
+
+	/* zero out empty tracks entirely */
+	if(!check_formatted(gcrdata, track_length[track]))
 	{
-		/* double-check our sync-flag assumptions and process track for remaster */
-		track_density[track] =
-			check_sync_flags(track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], track_length[track]);
+		tw->state = WRITE_EMPTY;
+		return;
+	}
+
+	tw->state = WRITE_TRACK;
+	if(tw->show) write_header(tw);
 
-		/* engineer killer track */
-		if(track_density[track] & BM_FF_TRACK)
+	/* loop last byte of track data for filler
+	   we do this before processing track in case we get wrong byte */
+	fill = ctx.fillbyte;
+	if(fill == 0xfe)
+		fill = gcrdata[track_length[track] - 1];
+	if(verbose) printf("[fill:$%x]", fill);
+
+	if((increase_sync)&&(track_length[track])&&(!(track_density[track]&BM_NO_SYNC))&&(!(track_density[track]&BM_FF_TRACK)))
+	{
+		for(addsyncloops=0;addsyncloops<increase_sync;addsyncloops++)
 		{
-				fill_track(fd, track, 0xFF);
-				printf("\n%4.1f: KILLED!",  (float) track / 2);
-				continue;
+			added_sync = lengthen_sync(gcrdata, track_length[track], ctx.capacity[track_density[track]&3]);
+			track_length[track] += added_sync;
+			if(verbose) printf("[+sync:%d]", added_sync);
 		}
+	}
+
+	badgcr = check_bad_gcr(&ctx, gcrdata, track_length[track]);
+	if(verbose) printf("[weak:%d]", badgcr);
+
+	//verbose+=1;
+	tw->length = compress_halftrack(&ctx, track, gcrdata, track_density[track], track_length[track]);
+	//verbose-=1;
+
+	tw->rawlen = build_track(tw->rawtrack, tw->track_buffer, track_density, track, tw->length, fill);
+}
+
+static void
+prepare_job(void *arg, int job)
+{
+	prepare_write((track_write *) arg);
+}
+
+static void
+verify_write(CBM_FILE fd, track_write *tw)
+{
+	int track = tw->track, verified, retries;
+	BYTE *track_buffer = tw->track_buffer;
+	BYTE *track_density = tw->track_density;
+	size_t *track_length = tw->track_length;
+	size_t badgcr, badgcr2, length = tw->length, verlen, verlen2;
+	BYTE verbuf1[NIB_TRACK_LENGTH], verbuf2[NIB_TRACK_LENGTH], verbuf3[NIB_TRACK_LENGTH], align;
+	size_t gcr_match;
+	char errorstring[0x1000];
+	double start, step;
 
-		/* zero out empty tracks entirely */
-		if(!check_formatted(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track]))
+	verified=retries=0;
+	while(!verified)
+	{
+		// Don't bother to compare unformatted or bad data
+		if (track_length[track] == NIB_TRACK_LENGTH) break;
+
+		start = step = timing_now();
+		memset(verbuf1, 0, NIB_TRACK_LENGTH);
+		if((ihs) && (!(track_density[track] & BM_NO_SYNC)))
+			send_mnib_cmd(fd, FL_READIHS, NULL, 0);
+		else if (Use_SCPlus_IHS) // "-j"
+			send_mnib_cmd(fd, FL_IHS_READ_SCP, NULL, 0);
+		else
 		{
-				if(track_inc!=1)
-				{
-					fill_track(fd, track, 0x00);
-					printf("\n%4.1f: UNFORMATTED!",  (float) track / 2);
-				}
-				continue;
+			if ((track_density[track] & BM_NO_SYNC) || (track_density[track] & BM_FF_TRACK))
+				send_mnib_cmd(fd, FL_READWOSYNC, NULL, 0);
+			else
+				send_mnib_cmd(fd, FL_READNORMAL, NULL, 0);
 		}
-
-		/* user display */
-		printf("\n%4.1f: (", (float)track/2);
-		printf("%d", track_density[track]&3);
-		if ((track_density[track]&3) != speed_map[track/2]) printf("!");
-		printf(":%d) ", track_length[track]);
-		if (track_density[track] & BM_NO_SYNC) printf("NOSYNC ");
-		if (track_density[track] & BM_FF_TRACK) printf("KILLER ");
-		printf("WRITE  ");
-
-		/* loop last byte of track data for filler
-		   we do this before processing track in case we get wrong byte */
-		fillbytesave = fillbyte;
-		if(fillbyte == 0xfe)
-			fillbyte = track_buffer[(track * NIB_TRACK_LENGTH) + track_length[track] - 1];
-		if(verbose) printf("[fill:$%x]", fillbyte);
-
-		if((increase_sync)&&(track_length[track])&&(!(track_density[track]&BM_NO_SYNC))&&(!(track_density[track]&BM_FF_TRACK)))
+		burst_read(fd);
+		if (burst_read_track(fd, verbuf1, NIB_TRACK_LENGTH))
+			log_timing(track, "read", retries, step, NIB_TRACK_LENGTH, "ok");
+		else
+			log_timing(track, "read", retries, step, 0, "timeout");
+
+		step = timing_now();
+		memset(verbuf2, 0, NIB_TRACK_LENGTH);
+		memset(verbuf3, 0, NIB_TRACK_LENGTH);
+		verlen  = extract_GCR_track(&ctx, verbuf2, verbuf1, &align, track/2, track_length[track], track_length[track]);
+		verlen2 = extract_GCR_track(&ctx, verbuf3, track_buffer+(track * NIB_TRACK_LENGTH), &align, track/2, track_length[track], track_length[track]);
+		log_timing(track, "extract", retries, step, verlen, "ok");
+
+		printf("\n      (%d:%d) VERIFY ", track_density[track]&3, verlen);
+		if(fplog) fprintf(fplog, "\n      (%d:%d) VERIFY ", track_density[track]&3, verlen);
+
+		// Fix bad GCR in tracks for compare
+		badgcr = check_bad_gcr(&ctx, verbuf2, track_length[track]);
+		if(verbose>1) printf("(badgcr=%.4d:", badgcr);
+		badgcr2 = check_bad_gcr(&ctx, verbuf3, track_length[track]);
+		if(verbose>1) printf("%.4d)", badgcr2);
+
+		// compare raw gcr data
+		gcr_match = compare_tracks(verbuf3, verbuf2, verlen, verlen, 1, errorstring);
+		//printf(" (match:%.4d) ", (int)gcr_match);
+		if(fplog) fprintf(fplog, " (match:%.4d) ", (int)gcr_match);
+
+		if(gcr_match >= length-10)
+		{
+			printf("OK (%.4d/%.4d) ",gcr_match,length);
+			log_timing(track, "verify", retries, start, gcr_match, "match");
+			verified=1;
+		}
+		else
 		{
-			for(addsyncloops=0;addsyncloops<increase_sync;addsyncloops++)
+			log_timing(track, "verify", retries, start, gcr_match, "mismatch");
+			retries++;
+			printf("Retry %d (%.4d/%.4d) ",retries,gcr_match,length);
+			step = timing_now();
+			fill_track(fd, track, 0x00);
+			send_track(fd, tw->rawtrack, track_density[track], track, tw->rawlen);
+			log_timing(track, "retry", retries, step, tw->rawlen, "ok");
+		}
+		if(((track>70)&&(retries>=3))||(retries>=10))
+		{
+			printf("\nWrite verify FAILED - Odd data or bad media!\n");
+			verified=1;
+		}
+	}
+}
+
+static void
+finish_write(CBM_FILE fd, track_write *tw)
+{
+	int track = tw->track;
+	double start = timing_now();
+
+	switch(tw->state)
+	{
+		case WRITE_KILLER:
+			fill_track(fd, track, 0xFF);
+			printf("\n%4.1f: KILLED!",  (float) track / 2);
+			log_timing(track, "track", 0, start, 0, "killer");
+			return;
+
+		case WRITE_EMPTY:
+			if(track_inc!=1)
 			{
-				added_sync = lengthen_sync(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track], capacity[track_density[track]&3]);
-				track_length[track] += added_sync;
-				if(verbose) printf("[+sync:%d]", added_sync);
+				fill_track(fd, track, 0x00);
+				printf("\n%4.1f: UNFORMATTED!",  (float) track / 2);
 			}
-		}
+			log_timing(track, "track", 0, start, 0, "unformatted");
+			return;
+	}
 
-		badgcr = check_bad_gcr(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track]);
-		if(verbose) printf("[weak:%d]", badgcr);
+	if(!tw->show) write_header(tw);
+	send_track(fd, tw->rawtrack, tw->track_density[track], track, tw->rawlen);
 
-		//verbose+=1;
-		length = compress_halftrack(track, track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], track_length[track]);
-		//verbose-=1;
+	if(track_match)	// Try to verify our write
+		verify_write(fd, tw);
 
-		master_track(fd, track_buffer, track_density, track, length);
+	log_timing(track, "track", 0, start, tw->rawlen, "ok");
+}
 
-		fillbyte = fillbytesave;
+void
+master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	static track_write writes[2];
+	track_write *current = &writes[0], *next = &writes[1], *done;
+	job_thread *thread;
+	int track, step, pipelined, more, i;
 
-		if(track_match)	// Try to verify our write
-		{
-			verified=retries=0;
-			while(!verified)
-			{
-				// Don't bother to compare unformatted or bad data
-				if (track_length[track] == NIB_TRACK_LENGTH) break;
-
-				memset(verbuf1, 0, NIB_TRACK_LENGTH);
-				if((ihs) && (!(track_density[track] & BM_NO_SYNC)))
-					send_mnib_cmd(fd, FL_READIHS, NULL, 0);
-				else if (Use_SCPlus_IHS) // "-j"
-					send_mnib_cmd(fd, FL_IHS_READ_SCP, NULL, 0);
-				else
-				{
-					if ((track_density[track] & BM_NO_SYNC) || (track_density[track] & BM_FF_TRACK))
-						send_mnib_cmd(fd, FL_READWOSYNC, NULL, 0);
-					else
-						send_mnib_cmd(fd, FL_READNORMAL, NULL, 0);
-				}
-				burst_read(fd);
-				burst_read_track(fd, verbuf1, NIB_TRACK_LENGTH);
-
-				memset(verbuf2, 0, NIB_TRACK_LENGTH);
-				memset(verbuf3, 0, NIB_TRACK_LENGTH);
-				verlen  = extract_GCR_track(verbuf2, verbuf1, &align, track/2, track_length[track], track_length[track]);
-				verlen2 = extract_GCR_track(verbuf3, track_buffer+(track * NIB_TRACK_LENGTH), &align, track/2, track_length[track], track_length[track]);
-
-				printf("\n      (%d:%d) VERIFY ", track_density[track]&3, verlen);
-				fprintf(fplog, "\n      (%d:%d) VERIFY ", track_density[track]&3, verlen);
-
-				// Fix bad GCR in tracks for compare
-				badgcr = check_bad_gcr(verbuf2, track_length[track]);
-				if(verbose>1) printf("(badgcr=%.4d:", badgcr);
-				badgcr2 = check_bad_gcr(verbuf3, track_length[track]);
-				if(verbose>1) printf("%.4d)", badgcr2);
-
-				// compare raw gcr data
-				gcr_match = compare_tracks(verbuf3, verbuf2, verlen, verlen, 1, errorstring);
-				//printf(" (match:%.4d) ", (int)gcr_match);
-				fprintf(fplog, " (match:%.4d) ", (int)gcr_match);
-
-				if(gcr_match >= length-10)
-				{
-					printf("OK (%.4d/%.4d) ",gcr_match,length);
-					verified=1;
-				}
-				else
-				{
-					retries++;
-					printf("Retry %d (%.4d/%.4d) ",retries,gcr_match,length);
-					fill_track(fd, track, 0x00);
-					master_track(fd, track_buffer, track_density, track, length);
-				}
-				if(((track>70)&&(retries>=3))||(retries>=10))
-				{
-					printf("\nWrite verify FAILED - Odd data or bad media!\n");
-					verified=1;
-				}
-			}
+	//if(track_inc==1) unformat_disk(fd);
 
-		}
+	printf("Writing to disk");
+
+	step = backwards ? -track_inc : track_inc;
+	track = backwards ? end_track : start_track;
+	if((track < start_track) || (track > end_track))
+		return;
+
+	/* the GCR routines print right away when verbose, that can't wait */
+	pipelined = (ctx.workers > 1) && (!ctx.verbose);
+	if(pipelined) init_GCR_tables();
+
+	for(i = 0; i < 2; i++)
+	{
+		writes[i].show = !pipelined;
+		writes[i].track_buffer = track_buffer;
+		writes[i].track_density = track_density;
+		writes[i].track_length = track_length;
+	}
+
+	current->track = track;
+	prepare_write(current);
+
+	for (; (track>=start_track) && (track<=end_track); track+=step)
+	{
+		next->track = track + step;
+		more = (next->track >= start_track) && (next->track <= end_track);
+
+		/* each track only touches its own part of the buffers */
+		thread = NULL;
+		if((pipelined) && (more))
+			thread = start_job(prepare_job, next, 0);
+
+		finish_write(fd, current);
+
+		if(pipelined)
+			wait_job(thread);
+		else if(more)
+			prepare_write(next);
+
+		done = current;
+		current = next;
+		next = done;
 	}
 }
 
@@ -298,7 +459,7 @@ master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *tr
 			/* process track */
 			memcpy(track_buffer + (track * NIB_TRACK_LENGTH), trackbuf, NIB_TRACK_LENGTH);
 			track_density[track] = check_sync_flags(track_buffer + (track * NIB_TRACK_LENGTH), density, length);
-			//length = compress_halftrack(track, track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], length);
+			//length = compress_halftrack(&ctx, track, track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], length);
 
 			printf(" (%d", track_density[track] & 3);
 			if ( (track_density[track]&3) != speed_map[track/2])
@@ -310,10 +471,10 @@ master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *tr
 			printf(") (%d) ", length);
 
 			/* truncate the end if needed (reduce tail) */
-			if (length > capacity[density & 3])
+			if (length > ctx.capacity[density & 3])
 			{
-				printf(" (trunc:%d) ",  length - capacity[density & 3]);
-				length = capacity[density & 3];
+				printf(" (trunc:%d) ",  length - ctx.capacity[density & 3]);
+				length = ctx.capacity[density & 3];
 			}
 			master_track(fd, track_buffer, track_density, track, length);
 		}
@@ -349,13 +510,19 @@ unformat_disk(CBM_FILE fd)
 
 void fill_track(CBM_FILE fd, int track, BYTE fill)
 {
+	double start;
+
 	// step head
+	start = timing_now();
 	step_to_halftrack(fd, track);
+	log_timing(track, "step", 0, start, 0, "ok");
 
 	// write all $ff bytes
+	start = timing_now();
 	send_mnib_cmd(fd, FL_FILLTRACK, NULL, 0);
 	burst_write(fd, fill);  // 0xff byte is all sync "killer" track
 	burst_read(fd);
+	log_timing(track, "fill", 0, start, 0, "ok");
 }
 
 
@@ -414,7 +581,7 @@ void adjust_target(CBM_FILE fd)
 			if(cap[j] > cap_high[i]) cap_high[i] = cap[j];
 			if(cap[j] < cap_low[i]) cap_low[i] = cap[j];
 		}
-		capacity[i] = run_total / DENSITY_SAMPLES ;
+		ctx.capacity[i] = run_total / DENSITY_SAMPLES ;
 		cap_margin[i] = cap_high[i] - cap_low[i];
 
 		if(cap_margin[i] > capacity_margin)
@@ -423,29 +590,29 @@ void adjust_target(CBM_FILE fd)
 		switch(i)
 		{
 			case 0:
-				printf("(%.2frpm) margin:%d\n", (float)DENSITY0 / capacity[0], cap_margin[i]);
+				printf("(%.2frpm) margin:%d\n", (float)DENSITY0 / ctx.capacity[0], cap_margin[i]);
 				break;
 
 			case 1:
-				printf("(%.2frpm) margin:%d\n", (float)DENSITY1 / capacity[1], cap_margin[i]);
+				printf("(%.2frpm) margin:%d\n", (float)DENSITY1 / ctx.capacity[1], cap_margin[i]);
 				break;
 
 			case 2:
-				printf("(%.2frpm) margin:%d\n", (float)DENSITY2 / capacity[2], cap_margin[i]);
+				printf("(%.2frpm) margin:%d\n", (float)DENSITY2 / ctx.capacity[2], cap_margin[i]);
 				break;
 
 			case 3:
-				printf("(%.2frpm) margin:%d\n", (float)DENSITY3 / capacity[3], cap_margin[i]);
+				printf("(%.2frpm) margin:%d\n", (float)DENSITY3 / ctx.capacity[3], cap_margin[i]);
 				break;
 		}
 
-		capacity[i] -= capacity_margin + extra_capacity_margin;
+		ctx.capacity[i] -= capacity_margin + extra_capacity_margin;
 	}
 
-	motor_speed = (float)(((float)DENSITY3 / (capacity[3] + capacity_margin + extra_capacity_margin))
-							+((float)DENSITY2 / (capacity[2] + capacity_margin + extra_capacity_margin))
-							+((float)DENSITY1 / (capacity[1] + capacity_margin + extra_capacity_margin))
-							+((float)DENSITY0 / (capacity[0] + capacity_margin + extra_capacity_margin)) ) / 4;
+	motor_speed = (float)(((float)DENSITY3 / (ctx.capacity[3] + capacity_margin + extra_capacity_margin))
+							+((float)DENSITY2 / (ctx.capacity[2] + capacity_margin + extra_capacity_margin))
+							+((float)DENSITY1 / (ctx.capacity[1] + capacity_margin + extra_capacity_margin))
+							+((float)DENSITY0 / (ctx.capacity[0] + capacity_margin + extra_capacity_margin)) ) / 4;
 
 	printf("Motor speed: ~%.2f RPM.\n", motor_speed);
 	printf("Track capacity margin: %d\n", capacity_margin + extra_capacity_margin);